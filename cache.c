@@ -19,150 +19,139 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <time.h>
 #include "rdesktop.h"
 
 /* BITMAP CACHE */
 extern int g_pstcache_fd[];
+extern int g_bmpcache_cells[];
+extern uint32 g_bmpcache_max_bytes;
 
-#define NUM_ELEMENTS(array) (sizeof(array) / sizeof(array[0]))
 #define IS_PERSISTENT(id) (g_pstcache_fd[id] > 0)
-#define TO_TOP -1
 #define NOT_SET -1
 #define IS_SET(idx) (idx >= 0)
 
 /*
- * TODO: Test for optimal value of BUMP_COUNT. TO_TOP gives lowest cpu utilisation but using
- * a positive value will hopefully result in less frequently used bitmaps having a greater chance
- * of being evicted from the cache, and therby reducing the need to load bitmaps from disk.
- * (Jeroen)
+ * Every bitmap in the cache is on the LRU list of its cache, most
+ * recently used last. Only bitmaps of persistent caches can be evicted,
+ * as they can be loaded again; the server tracks the content of the
+ * others. A persistent cache keeps up to g_bmpcache_cells bitmaps in
+ * memory, and all caches together should hold no more than
+ * g_bmpcache_max_bytes of pixel data, if set.
  */
-#define BUMP_COUNT 40
-
 struct bmpcache_entry
 {
 	RD_HBITMAP bitmap;
+	uint32 size;
 	sint16 previous;
 	sint16 next;
 };
 
-static struct bmpcache_entry g_bmpcache[3][0xa00];
+static struct bmpcache_entry *g_bmpcache[3];
+static int g_bmpcache_size[3];
 static RD_HBITMAP g_volatile_bc[3];
 
 static int g_bmpcache_lru[3] = { NOT_SET, NOT_SET, NOT_SET };
 static int g_bmpcache_mru[3] = { NOT_SET, NOT_SET, NOT_SET };
 
 static int g_bmpcache_count[3];
+static uint32 g_bmpcache_bytes;
+static CACHE_STATS g_bmpcache_stats[3];
+static CACHE_STATS g_volatile_bc_stats[3];
 
-/* Setup the bitmap cache lru/mru linked list */
-void
-cache_rebuild_bmpcache_linked_list(uint8 id, sint16 * idx, int count)
+static void
+lru_unlink(uint8 id, uint16 idx)
 {
-	int n = count, c = 0;
-	sint16 n_idx;
+	int p_idx = g_bmpcache[id][idx].previous;
+	int n_idx = g_bmpcache[id][idx].next;
 
-	/* find top, skip evicted bitmaps */
-	while (--n >= 0 && g_bmpcache[id][idx[n]].bitmap == NULL);
-	if (n < 0)
-	{
-		g_bmpcache_mru[id] = g_bmpcache_lru[id] = NOT_SET;
-		return;
-	}
+	if (IS_SET(p_idx))
+		g_bmpcache[id][p_idx].next = n_idx;
+	else
+		g_bmpcache_lru[id] = n_idx;
 
-	g_bmpcache_mru[id] = idx[n];
-	g_bmpcache[id][idx[n]].next = NOT_SET;
-	n_idx = idx[n];
-	c++;
+	if (IS_SET(n_idx))
+		g_bmpcache[id][n_idx].previous = p_idx;
+	else
+		g_bmpcache_mru[id] = p_idx;
 
-	/* link list */
-	while (n >= 0)
-	{
-		/* skip evicted bitmaps */
-		while (--n >= 0 && g_bmpcache[id][idx[n]].bitmap == NULL);
+	--g_bmpcache_count[id];
+}
 
-		if (n < 0)
-			break;
+/* Link a bitmap in at the MRU end, or at the LRU end */
+static void
+lru_link(uint8 id, uint16 idx, RD_BOOL mru)
+{
+	int p_idx, n_idx;
 
-		g_bmpcache[id][n_idx].previous = idx[n];
-		g_bmpcache[id][idx[n]].next = n_idx;
-		n_idx = idx[n];
-		c++;
-	}
+	p_idx = mru ? g_bmpcache_mru[id] : NOT_SET;
+	n_idx = mru ? NOT_SET : g_bmpcache_lru[id];
 
-	g_bmpcache[id][n_idx].previous = NOT_SET;
-	g_bmpcache_lru[id] = n_idx;
+	g_bmpcache[id][idx].previous = p_idx;
+	g_bmpcache[id][idx].next = n_idx;
 
-	if (c != g_bmpcache_count[id])
-	{
-		error("Oops. %d in bitmap cache linked list, %d in ui cache...\n", c,
-		      g_bmpcache_count[id]);
-		exit(EX_SOFTWARE);
-	}
+	if (IS_SET(p_idx))
+		g_bmpcache[id][p_idx].next = idx;
+	else
+		g_bmpcache_lru[id] = idx;
+
+	if (IS_SET(n_idx))
+		g_bmpcache[id][n_idx].previous = idx;
+	else
+		g_bmpcache_mru[id] = idx;
+
+	++g_bmpcache_count[id];
 }
 
-/* Move a bitmap to a new position in the linked list. */
-void
-cache_bump_bitmap(uint8 id, uint16 idx, int bump)
+/* Drop a bitmap, which must be in the cache */
+static void
+remove_bitmap(uint8 id, uint16 idx)
 {
-	int p_idx, n_idx, n;
+	lru_unlink(id, idx);
+	ui_destroy_bitmap(g_bmpcache[id][idx].bitmap);
+	g_bmpcache[id][idx].bitmap = NULL;
+	g_bmpcache_bytes -= g_bmpcache[id][idx].size;
+	g_bmpcache_stats[id].bytes -= g_bmpcache[id][idx].size;
+	g_bmpcache_stats[id].count--;
+}
 
-	if (!IS_PERSISTENT(id))
+/* (Re)size a bitmap cache to the number of cells the server was told of.
+   Its content is dropped if the size changes. */
+void
+cache_resize_bitmap(uint8 id, int cells)
+{
+	if ((id >= NUM_ELEMENTS(g_bmpcache)) || (cells == g_bmpcache_size[id]))
 		return;
 
-	if (g_bmpcache_mru[id] == idx)
-		return;
+	while (IS_SET(g_bmpcache_lru[id]))
+		remove_bitmap(id, g_bmpcache_lru[id]);
 
-	DEBUG_RDP5(("bump bitmap: id=%d, idx=%d, bump=%d\n", id, idx, bump));
+	g_bmpcache[id] = (struct bmpcache_entry *) xrealloc(g_bmpcache[id],
+							    cells * sizeof(struct bmpcache_entry));
+	memset(g_bmpcache[id], 0, cells * sizeof(struct bmpcache_entry));
+	g_bmpcache_size[id] = cells;
+}
 
-	n_idx = g_bmpcache[id][idx].next;
-	p_idx = g_bmpcache[id][idx].previous;
+/* Setup the bitmap cache lru/mru linked list */
+void
+cache_rebuild_bmpcache_linked_list(uint8 id, sint16 * idx, int count)
+{
+	int n, c = g_bmpcache_count[id];
 
-	if (IS_SET(n_idx))
-	{
-		/* remove */
-		--g_bmpcache_count[id];
-		if (IS_SET(p_idx))
-			g_bmpcache[id][p_idx].next = n_idx;
-		else
-			g_bmpcache_lru[id] = n_idx;
-		if (IS_SET(n_idx))
-			g_bmpcache[id][n_idx].previous = p_idx;
-		else
-			g_bmpcache_mru[id] = p_idx;
-	}
-	else
-	{
-		p_idx = NOT_SET;
-		n_idx = g_bmpcache_lru[id];
-	}
+	g_bmpcache_mru[id] = g_bmpcache_lru[id] = NOT_SET;
+	g_bmpcache_count[id] = 0;
 
-	if (bump >= 0)
-	{
-		for (n = 0; n < bump && IS_SET(n_idx); n++)
-		{
-			p_idx = n_idx;
-			n_idx = g_bmpcache[id][p_idx].next;
-		}
-	}
-	else
+	/* skip evicted bitmaps */
+	for (n = 0; n < count; n++)
+		if (g_bmpcache[id][idx[n]].bitmap != NULL)
+			lru_link(id, idx[n], True);
+
+	if (c != g_bmpcache_count[id])
 	{
-		p_idx = g_bmpcache_mru[id];
-		n_idx = NOT_SET;
+		error("Oops. %d in bitmap cache linked list, %d in ui cache...\n",
+		      g_bmpcache_count[id], c);
+		exit(EX_SOFTWARE);
 	}
-
-	/* insert */
-	++g_bmpcache_count[id];
-	g_bmpcache[id][idx].previous = p_idx;
-	g_bmpcache[id][idx].next = n_idx;
-
-	if (p_idx >= 0)
-		g_bmpcache[id][p_idx].next = idx;
-	else
-		g_bmpcache_lru[id] = idx;
-
-	if (n_idx >= 0)
-		g_bmpcache[id][n_idx].previous = idx;
-	else
-		g_bmpcache_mru[id] = idx;
 }
 
 /* Evict the least-recently used bitmap from the cache */
@@ -170,42 +159,77 @@ void
 cache_evict_bitmap(uint8 id)
 {
 	uint16 idx;
-	int n_idx;
 
-	if (!IS_PERSISTENT(id))
+	if (!IS_PERSISTENT(id) || !IS_SET(g_bmpcache_lru[id]))
 		return;
 
 	idx = g_bmpcache_lru[id];
-	n_idx = g_bmpcache[id][idx].next;
-	DEBUG_RDP5(("evict bitmap: id=%d idx=%d n_idx=%d bmp=%p\n", id, idx, n_idx,
-		    g_bmpcache[id][idx].bitmap));
+	DEBUG_RDP5(("evict bitmap: id=%d idx=%d n_idx=%d bmp=%p\n", id, idx,
+		    g_bmpcache[id][idx].next, g_bmpcache[id][idx].bitmap));
 
-	ui_destroy_bitmap(g_bmpcache[id][idx].bitmap);
-	--g_bmpcache_count[id];
-	g_bmpcache[id][idx].bitmap = 0;
-
-	g_bmpcache_lru[id] = n_idx;
-	g_bmpcache[id][n_idx].previous = NOT_SET;
+	remove_bitmap(id, idx);
+	g_bmpcache_stats[id].evictions++;
 
 	pstcache_touch_bitmap(id, idx, 0);
 }
 
+/* Evict until the persistent caches are within their limits. The most
+   recently used bitmap of each cache stays, as it is about to be used. */
+static void
+trim_bitmaps(void)
+{
+	uint8 id;
+	RD_BOOL evicted = True;
+
+	for (id = 0; id < NUM_ELEMENTS(g_bmpcache); id++)
+		if (IS_PERSISTENT(id))
+			while ((g_bmpcache_count[id] > MAX(g_bmpcache_cells[id], 1)))
+				cache_evict_bitmap(id);
+
+	while (g_bmpcache_max_bytes && (g_bmpcache_bytes > g_bmpcache_max_bytes) && evicted)
+	{
+		evicted = False;
+		for (id = 0; id < NUM_ELEMENTS(g_bmpcache); id++)
+		{
+			if (IS_PERSISTENT(id) && (g_bmpcache_count[id] > 1))
+			{
+				cache_evict_bitmap(id);
+				evicted = True;
+			}
+		}
+	}
+}
+
 /* Retrieve a bitmap from the cache */
 RD_HBITMAP
 cache_get_bitmap(uint8 id, uint16 idx)
 {
-	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < NUM_ELEMENTS(g_bmpcache[0])))
+	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < g_bmpcache_size[id]))
 	{
-		if (g_bmpcache[id][idx].bitmap || pstcache_load_bitmap(id, idx))
+		g_bmpcache_stats[id].gets++;
+		if (g_bmpcache[id][idx].bitmap)
 		{
-			if (IS_PERSISTENT(id))
-				cache_bump_bitmap(id, idx, BUMP_COUNT);
+			if (g_bmpcache_mru[id] != idx)
+			{
+				lru_unlink(id, idx);
+				lru_link(id, idx, True);
+			}
 
 			return g_bmpcache[id][idx].bitmap;
 		}
+
+		g_bmpcache_stats[id].misses++;
+		if (pstcache_load_bitmap(id, idx))
+		{
+			g_bmpcache_stats[id].loads++;
+			return g_bmpcache[id][idx].bitmap;
+		}
 	}
 	else if ((id < NUM_ELEMENTS(g_volatile_bc)) && (idx == 0x7fff))
 	{
+		g_volatile_bc_stats[id].gets++;
+		if (g_volatile_bc[id] == NULL)
+			g_volatile_bc_stats[id].misses++;
 		return g_volatile_bc[id];
 	}
 
@@ -213,28 +237,31 @@ cache_get_bitmap(uint8 id, uint16 idx)
 	return NULL;
 }
 
+static void
+store_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap, RD_BOOL mru)
+{
+	if (g_bmpcache[id][idx].bitmap != NULL)
+		remove_bitmap(id, idx);
+
+	g_bmpcache[id][idx].bitmap = bitmap;
+	g_bmpcache[id][idx].size = ui_get_bitmap_size(bitmap);
+	g_bmpcache_bytes += g_bmpcache[id][idx].size;
+	g_bmpcache_stats[id].bytes += g_bmpcache[id][idx].size;
+	g_bmpcache_stats[id].count++;
+	g_bmpcache_stats[id].puts++;
+	lru_link(id, idx, mru);
+}
+
 /* Store a bitmap in the cache */
 void
 cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap)
 {
 	RD_HBITMAP old;
 
-	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < NUM_ELEMENTS(g_bmpcache[0])))
+	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < g_bmpcache_size[id]))
 	{
-		old = g_bmpcache[id][idx].bitmap;
-		if (old != NULL)
-			ui_destroy_bitmap(old);
-		g_bmpcache[id][idx].bitmap = bitmap;
-
-		if (IS_PERSISTENT(id))
-		{
-			if (old == NULL)
-				g_bmpcache[id][idx].previous = g_bmpcache[id][idx].next = NOT_SET;
-
-			cache_bump_bitmap(id, idx, TO_TOP);
-			if (g_bmpcache_count[id] > BMPCACHE2_C2_CELLS)
-				cache_evict_bitmap(id);
-		}
+		store_bitmap(id, idx, bitmap, True);
+		trim_bitmaps();
 	}
 	else if ((id < NUM_ELEMENTS(g_volatile_bc)) && (idx == 0x7fff))
 	{
@@ -242,6 +269,9 @@ cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap)
 		if (old != NULL)
 			ui_destroy_bitmap(old);
 		g_volatile_bc[id] = bitmap;
+		g_volatile_bc_stats[id].puts++;
+		g_volatile_bc_stats[id].count = 1;
+		g_volatile_bc_stats[id].bytes = ui_get_bitmap_size(bitmap);
 	}
 	else
 	{
@@ -249,6 +279,23 @@ cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap)
 	}
 }
 
+/* Store a bitmap loaded ahead of use. It goes below all others in the
+   LRU order, and is dropped if the cell is taken or the cache is full. */
+void
+cache_preload_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap)
+{
+	if ((id >= NUM_ELEMENTS(g_bmpcache)) || (idx >= g_bmpcache_size[id]) || !IS_PERSISTENT(id)
+	    || (g_bmpcache[id][idx].bitmap != NULL) || (g_bmpcache_count[id] >= g_bmpcache_cells[id])
+	    || (g_bmpcache_max_bytes && (g_bmpcache_bytes >= g_bmpcache_max_bytes)))
+	{
+		ui_destroy_bitmap(bitmap);
+		return;
+	}
+
+	store_bitmap(id, idx, bitmap, False);
+	g_bmpcache_stats[id].loads++;
+}
+
 /* Updates the persistent bitmap cache MRU information on exit */
 void
 cache_save_state(void)
@@ -256,6 +303,9 @@ cache_save_state(void)
 	uint32 id = 0, t = 0;
 	int idx;
 
+	/* the stamps would be overwritten by queued saves */
+	pstcache_flush();
+
 	for (id = 0; id < NUM_ELEMENTS(g_bmpcache); id++)
 		if (IS_PERSISTENT(id))
 		{
@@ -272,7 +322,8 @@ cache_save_state(void)
 
 
 /* FONT CACHE */
-static FONTGLYPH g_fontcache[12][256];
+static FONTGLYPH g_fontcache[GLYPH_CACHE_FONTS][256];
+static CACHE_STATS g_fontcache_stats[GLYPH_CACHE_FONTS];
 
 /* Retrieve a glyph from the font cache */
 FONTGLYPH *
@@ -282,9 +333,11 @@ cache_get_font(uint8 font, uint16 character)
 
 	if ((font < NUM_ELEMENTS(g_fontcache)) && (character < NUM_ELEMENTS(g_fontcache[0])))
 	{
+		g_fontcache_stats[font].gets++;
 		glyph = &g_fontcache[font][character];
 		if (glyph->pixmap != NULL)
 			return glyph;
+		g_fontcache_stats[font].misses++;
 	}
 
 	error("get font %d:%d\n", font, character);
@@ -302,7 +355,15 @@ cache_put_font(uint8 font, uint16 character, uint16 offset,
 	{
 		glyph = &g_fontcache[font][character];
 		if (glyph->pixmap != NULL)
-			ui_destroy_glyph(glyph->pixmap);
+		{
+			ui_destroy_font_glyph(font, glyph->pixmap);
+			g_fontcache_stats[font].count--;
+			g_fontcache_stats[font].bytes -= (glyph->width + 7) / 8 * glyph->height;
+		}
+
+		g_fontcache_stats[font].puts++;
+		g_fontcache_stats[font].count++;
+		g_fontcache_stats[font].bytes += (width + 7) / 8 * height;
 
 		glyph->offset = offset;
 		glyph->baseline = baseline;
@@ -318,7 +379,13 @@ cache_put_font(uint8 font, uint16 character, uint16 offset,
 
 
 /* TEXT CACHE */
+/* Fragments are at most 255 bytes, so each entry has a fixed buffer that
+   is reused in place */
+#define TEXT_FRAGMENT_SIZE	255
+
 static DATABLOB g_textcache[256];
+static uint8 g_textcache_data[256][TEXT_FRAGMENT_SIZE];
+static CACHE_STATS g_textcache_stats;
 
 /* Retrieve a text item from the cache */
 DATABLOB *
@@ -327,6 +394,9 @@ cache_get_text(uint8 cache_id)
 	DATABLOB *text;
 
 	text = &g_textcache[cache_id];
+	g_textcache_stats.gets++;
+	if (text->data == NULL)
+		g_textcache_stats.misses++;
 	return text;
 }
 
@@ -336,10 +406,22 @@ cache_put_text(uint8 cache_id, void *data, int length)
 {
 	DATABLOB *text;
 
+	if (length > TEXT_FRAGMENT_SIZE)
+	{
+		error("put text %d:%d\n", cache_id, length);
+		return;
+	}
+
 	text = &g_textcache[cache_id];
 	if (text->data != NULL)
-		xfree(text->data);
-	text->data = xmalloc(length);
+	{
+		g_textcache_stats.count--;
+		g_textcache_stats.bytes -= text->size;
+	}
+	g_textcache_stats.puts++;
+	g_textcache_stats.count++;
+	g_textcache_stats.bytes += length;
+	text->data = g_textcache_data[cache_id];
 	text->size = length;
 	memcpy(text->data, data, length);
 }
@@ -347,6 +429,7 @@ cache_put_text(uint8 cache_id, void *data, int length)
 
 /* DESKTOP CACHE */
 static uint8 g_deskcache[0x38400 * 4];
+static CACHE_STATS g_deskcache_stats;	/* bytes is the highest offset stored to */
 
 /* Retrieve desktop data from the cache */
 uint8 *
@@ -357,11 +440,13 @@ cache_get_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel)
 	if (offset > sizeof(g_deskcache))
 		offset = 0;
 
+	g_deskcache_stats.gets++;
 	if ((offset + length) <= sizeof(g_deskcache))
 	{
 		return &g_deskcache[offset];
 	}
 
+	g_deskcache_stats.misses++;
 	error("get desktop %d:%d\n", offset, length);
 	return NULL;
 }
@@ -377,6 +462,8 @@ cache_put_desktop(uint32 offset, int cx, int cy, int scanline, int bytes_per_pix
 
 	if ((offset + length) <= sizeof(g_deskcache))
 	{
+		g_deskcache_stats.puts++;
+		g_deskcache_stats.bytes = MAX(g_deskcache_stats.bytes, offset + length);
 		cx *= bytes_per_pixel;
 		while (cy--)
 		{
@@ -394,6 +481,7 @@ cache_put_desktop(uint32 offset, int cx, int cy, int scanline, int bytes_per_pix
 
 /* CURSOR CACHE */
 static RD_HCURSOR g_cursorcache[0x20];
+static CACHE_STATS g_cursorcache_stats;
 
 /* Retrieve cursor from cache */
 RD_HCURSOR
@@ -403,9 +491,11 @@ cache_get_cursor(uint16 cache_idx)
 
 	if (cache_idx < NUM_ELEMENTS(g_cursorcache))
 	{
+		g_cursorcache_stats.gets++;
 		cursor = g_cursorcache[cache_idx];
 		if (cursor != NULL)
 			return cursor;
+		g_cursorcache_stats.misses++;
 	}
 
 	error("get cursor %d\n", cache_idx);
@@ -423,6 +513,9 @@ cache_put_cursor(uint16 cache_idx, RD_HCURSOR cursor)
 		old = g_cursorcache[cache_idx];
 		if (old != NULL)
 			ui_destroy_cursor(old);
+		else
+			g_cursorcache_stats.count++;
+		g_cursorcache_stats.puts++;
 
 		g_cursorcache[cache_idx] = cursor;
 	}
@@ -432,9 +525,65 @@ cache_put_cursor(uint16 cache_idx, RD_HCURSOR cursor)
 	}
 }
 
+/* OFFSCREEN BITMAP CACHE */
+static RD_HBITMAP g_offscreen_cache[OFFSCREEN_CACHE_ENTRIES];
+static CACHE_STATS g_offscreen_cache_stats;
+
+/* Retrieve offscreen bitmap from cache */
+RD_HBITMAP
+cache_get_offscreen(uint16 cache_idx)
+{
+	RD_HBITMAP bitmap;
+
+	if (cache_idx < NUM_ELEMENTS(g_offscreen_cache))
+	{
+		g_offscreen_cache_stats.gets++;
+		bitmap = g_offscreen_cache[cache_idx];
+		if (bitmap != NULL)
+			return bitmap;
+		g_offscreen_cache_stats.misses++;
+	}
+
+	error("get offscreen %d\n", cache_idx);
+	return NULL;
+}
+
+/* Store offscreen bitmap in cache, or remove it if bitmap is NULL */
+void
+cache_put_offscreen(uint16 cache_idx, RD_HBITMAP bitmap)
+{
+	RD_HBITMAP old;
+
+	if (cache_idx < NUM_ELEMENTS(g_offscreen_cache))
+	{
+		old = g_offscreen_cache[cache_idx];
+		if (old != NULL)
+		{
+			g_offscreen_cache_stats.count--;
+			g_offscreen_cache_stats.bytes -= ui_get_bitmap_size(old);
+			ui_destroy_bitmap(old);
+		}
+
+		if (bitmap != NULL)
+		{
+			g_offscreen_cache_stats.puts++;
+			g_offscreen_cache_stats.count++;
+			g_offscreen_cache_stats.bytes += ui_get_bitmap_size(bitmap);
+		}
+
+		g_offscreen_cache[cache_idx] = bitmap;
+	}
+	else
+	{
+		error("put offscreen %d\n", cache_idx);
+	}
+}
+
 /* BRUSH CACHE */
 /* index 0 is 2 colour brush, index 1 is muti colour brush */
 static BRUSHDATA g_brushcache[2][64];
+static uint8 g_brushcache_data[2][64][BRUSH_DATA_SIZE];
+static CACHE_STATS g_brushcache_stats[2];
 
 /* Retrieve brush from cache */
 BRUSHDATA *
@@ -443,6 +592,9 @@ cache_get_brush_data(uint8 colour_code, uint8 idx)
 	colour_code = colour_code == 1 ? 0 : 1;
 	if (idx < NUM_ELEMENTS(g_brushcache[0]))
 	{
+		g_brushcache_stats[colour_code].gets++;
+		if (g_brushcache[colour_code][idx].data == NULL)
+			g_brushcache_stats[colour_code].misses++;
 		return &g_brushcache[colour_code][idx];
 	}
 	error("get brush %d %d\n", colour_code, idx);
@@ -450,24 +602,80 @@ cache_get_brush_data(uint8 colour_code, uint8 idx)
 }
 
 /* Store brush in cache */
-/* this function takes over the data pointer in struct, eg, caller gives it up */
+/* the data is copied into a buffer the cache keeps for each entry */
 void
 cache_put_brush_data(uint8 colour_code, uint8 idx, BRUSHDATA * brush_data)
 {
 	BRUSHDATA *bd;
 
 	colour_code = colour_code == 1 ? 0 : 1;
-	if (idx < NUM_ELEMENTS(g_brushcache[0]))
+	if ((idx < NUM_ELEMENTS(g_brushcache[0])) && (brush_data->data_size <= BRUSH_DATA_SIZE))
 	{
 		bd = &g_brushcache[colour_code][idx];
 		if (bd->data != 0)
 		{
-			xfree(bd->data);
+			g_brushcache_stats[colour_code].count--;
+			g_brushcache_stats[colour_code].bytes -= bd->data_size;
 		}
-		memcpy(bd, brush_data, sizeof(BRUSHDATA));
+		g_brushcache_stats[colour_code].puts++;
+		g_brushcache_stats[colour_code].count++;
+		g_brushcache_stats[colour_code].bytes += brush_data->data_size;
+		if (bd->handle != NULL)
+		{
+			ui_destroy_brush(bd->handle);
+		}
+		bd->colour_code = brush_data->colour_code;
+		bd->data_size = brush_data->data_size;
+		bd->data = g_brushcache_data[colour_code][idx];
+		memcpy(bd->data, brush_data->data, brush_data->data_size);
+		bd->handle = NULL;
 	}
 	else
 	{
 		error("put brush %d %d\n", colour_code, idx);
 	}
 }
+
+
+/* STATISTICS */
+static struct
+{
+	char *name;
+	CACHE_STATS *stats;
+	int count;
+}
+g_cache_registry[] =
+{
+	{ "bitmap", g_bmpcache_stats, NUM_ELEMENTS(g_bmpcache_stats) },
+	{ "volatile", g_volatile_bc_stats, NUM_ELEMENTS(g_volatile_bc_stats) },
+	{ "font", g_fontcache_stats, NUM_ELEMENTS(g_fontcache_stats) },
+	{ "text", &g_textcache_stats, 1 },
+	{ "desktop", &g_deskcache_stats, 1 },
+	{ "cursor", &g_cursorcache_stats, 1 },
+	{ "offscreen", &g_offscreen_cache_stats, 1 },
+	{ "brush", g_brushcache_stats, NUM_ELEMENTS(g_brushcache_stats) }
+};
+
+/* Write the counters of all caches, one line per cache id */
+void
+cache_dump_stats(FILE * fp)
+{
+	CACHE_STATS *stats;
+	unsigned int n;
+	int id;
+	long now = (long) time(NULL);
+
+	for (n = 0; n < NUM_ELEMENTS(g_cache_registry); n++)
+	{
+		for (id = 0; id < g_cache_registry[n].count; id++)
+		{
+			stats = &g_cache_registry[n].stats[id];
+			fprintf(fp, "cachestats time=%ld cache=%s id=%d gets=%u puts=%u misses=%u "
+				"evictions=%u loads=%u count=%u bytes=%u\n", now,
+				g_cache_registry[n].name, id, stats->gets, stats->puts, stats->misses,
+				stats->evictions, stats->loads, stats->count, stats->bytes);
+		}
+	}
+
+	fflush(fp);
+}
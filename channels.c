@@ -20,27 +20,91 @@
 
 #include "rdesktop.h"
 
-#define MAX_CHANNELS			6
+#ifdef WITH_SCARD
+#include <pthread.h>
+#endif
+
 #define CHANNEL_CHUNK_LENGTH		1600
 #define CHANNEL_FLAG_FIRST		0x01
 #define CHANNEL_FLAG_LAST		0x02
 #define CHANNEL_FLAG_SHOW_PROTOCOL	0x10
 
+/* Largest message we reassemble from fragments */
+#define CHANNEL_MAX_LENGTH		(64 * 1024 * 1024)
+
+/* Reassembly buffers come in power of two size classes from 4 KiB to
+   1 MiB. A few of each are kept for reuse, larger ones are freed as soon
+   as their message has been processed. */
+#define CHANNEL_POOL_MIN_SHIFT		12
+#define CHANNEL_POOL_CLASSES		9
+#define CHANNEL_POOL_DEPTH		2
+
+/* Bytes of queued fragments sent per call of send_queued */
+#define CHANNEL_PUMP_LENGTH		16384
+
+typedef struct _CHANNEL_FRAGMENT
+{
+	struct _CHANNEL_FRAGMENT *next;
+	VCHANNEL *channel;
+	uint32 length;
+	uint32 flags;
+	uint32 size;
+	uint8 data[1];
+}
+CHANNEL_FRAGMENT;
+
+typedef struct _CHANNEL_QUEUE
+{
+	CHANNEL_FRAGMENT *head;
+	CHANNEL_FRAGMENT *tail;
+	uint32 deficit;
+}
+CHANNEL_QUEUE;
+
 extern RD_BOOL g_use_rdp5;
 extern RD_BOOL g_encryption;
+extern int g_channel_share[];
 
 VCHANNEL g_channels[MAX_CHANNELS];
 unsigned int g_num_channels;
 
-/* FIXME: We should use the information in TAG_SRV_CHANNELS to map RDP5
-   channels to MCS channels.
+static CHANNEL_QUEUE g_channel_queue[CHANNEL_PRIORITIES];
+#ifdef WITH_SCARD
+static pthread_t g_channel_main_thread;
+#endif
 
-   The format of TAG_SRV_CHANNELS seems to be
+static uint8 *g_channel_pool[CHANNEL_POOL_CLASSES][CHANNEL_POOL_DEPTH];
+static int g_channel_pool_count[CHANNEL_POOL_CLASSES];
 
-   global_channel_no (uint16le)
-   number_of_other_channels (uint16le)
-   ..followed by uint16les for the other channels.
-*/
+/* Index into g_channels plus one for each MCS channel id, zero for none */
+static uint8 g_channel_map[0x10000];
+
+/* Move a channel to a new MCS channel id, or to 0 for none. Channels get
+   consecutive ids when they are registered, and the ids the server
+   assigned once it has told us in TAG_SRV_CHANNELS. */
+void
+channel_set_mcs_id(VCHANNEL * channel, uint16 mcs_id)
+{
+	uint8 index = channel - g_channels + 1;
+
+	if (g_channel_map[channel->mcs_id] == index)
+		g_channel_map[channel->mcs_id] = 0;
+
+	channel->mcs_id = mcs_id;
+	if (mcs_id != 0)
+		g_channel_map[mcs_id] = index;
+}
+
+/* Unassign all channels, before the server's list of ids is applied.
+   The server may assign fewer channels than were requested. */
+void
+channel_clear_mcs_ids(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_num_channels; i++)
+		channel_set_mcs_id(&g_channels[i], 0);
+}
 
 VCHANNEL *
 channel_register(char *name, uint32 flags, void (*callback) (STREAM))
@@ -52,16 +116,20 @@ channel_register(char *name, uint32 flags, void (*callback) (STREAM))
 
 	if (g_num_channels >= MAX_CHANNELS)
 	{
-		error("Channel table full, increase MAX_CHANNELS\n");
+		error("Channel table full, at most %d channels\n", MAX_CHANNELS);
 		return NULL;
 	}
 
 	channel = &g_channels[g_num_channels];
-	channel->mcs_id = MCS_GLOBAL_CHANNEL + 1 + g_num_channels;
+	channel_set_mcs_id(channel, MCS_GLOBAL_CHANNEL + 1 + g_num_channels);
 	strncpy(channel->name, name, 8);
 	channel->flags = flags;
+	channel->priority = CHANNEL_PRIORITY_INTERACTIVE;
 	channel->process = callback;
 	g_num_channels++;
+#ifdef WITH_SCARD
+	g_channel_main_thread = pthread_self();
+#endif
 	return channel;
 }
 
@@ -75,58 +143,170 @@ channel_init(VCHANNEL * channel, uint32 length)
 	return s;
 }
 
+/* Queue a message as fragments, copying it out of the send buffer */
+static void
+queue_message(VCHANNEL * channel, uint8 * data, uint32 length)
+{
+	CHANNEL_QUEUE *queue = &g_channel_queue[channel->priority];
+	CHANNEL_FRAGMENT *fragment;
+	uint32 thislength, remaining, flags;
+
+	remaining = length;
+	flags = CHANNEL_FLAG_FIRST;
+	do
+	{
+		thislength = MIN(remaining, CHANNEL_CHUNK_LENGTH);
+		remaining -= thislength;
+		if (remaining == 0)
+			flags |= CHANNEL_FLAG_LAST;
+		if (channel->flags & CHANNEL_OPTION_SHOW_PROTOCOL)
+			flags |= CHANNEL_FLAG_SHOW_PROTOCOL;
+
+		fragment = (CHANNEL_FRAGMENT *) xmalloc(sizeof(CHANNEL_FRAGMENT) + thislength);
+		fragment->next = NULL;
+		fragment->channel = channel;
+		fragment->length = length;
+		fragment->flags = flags;
+		fragment->size = thislength;
+		memcpy(fragment->data, data, thislength);
+
+		if (queue->tail == NULL)
+			queue->head = fragment;
+		else
+			queue->tail->next = fragment;
+		queue->tail = fragment;
+
+		data += thislength;
+		flags = 0;
+	}
+	while (remaining > 0);
+}
+
+static void
+send_fragment(CHANNEL_FRAGMENT * fragment)
+{
+	STREAM s;
+
+	DEBUG_CHANNEL(("Sending %d bytes with flags %d\n", fragment->size, fragment->flags));
+
+	s = sec_init(g_encryption ? SEC_ENCRYPT : 0, fragment->size + 8);
+	out_uint32_le(s, fragment->length);
+	out_uint32_le(s, fragment->flags);
+	out_uint8p(s, fragment->data, fragment->size);
+	s_mark_end(s);
+	sec_send_to_channel(s, g_encryption ? SEC_ENCRYPT : 0, fragment->channel->mcs_id);
+}
+
+/* Send up to budget bytes of queued fragments. Each round every queue
+   may send its share of CHANNEL_CHUNK_LENGTH sized fragments, and what
+   it does not use is kept for the next round (deficit round robin). */
+static void
+send_queued(int budget)
+{
+	CHANNEL_QUEUE *queue;
+	CHANNEL_FRAGMENT *fragment;
+	RD_BOOL active;
+	int i;
+
+	do
+	{
+		active = False;
+		for (i = 0; (i < CHANNEL_PRIORITIES) && (budget > 0); i++)
+		{
+			queue = &g_channel_queue[i];
+			if (queue->head == NULL)
+			{
+				queue->deficit = 0;
+				continue;
+			}
+
+			active = True;
+			queue->deficit += g_channel_share[i] * CHANNEL_CHUNK_LENGTH;
+			while ((queue->head != NULL) && (queue->head->size <= queue->deficit)
+			       && (budget > 0))
+			{
+				fragment = queue->head;
+				queue->head = fragment->next;
+				if (queue->head == NULL)
+					queue->tail = NULL;
+
+				send_fragment(fragment);
+				queue->deficit -= fragment->size;
+				budget -= fragment->size + 8;
+				xfree(fragment);
+			}
+		}
+	}
+	while (active && (budget > 0));
+}
+
+/* Whether ui_select should wait for the socket to take more data */
+RD_BOOL
+channel_send_queued(void)
+{
+	int i;
+
+	for (i = 0; i < CHANNEL_PRIORITIES; i++)
+		if (g_channel_queue[i].head != NULL)
+			return True;
+
+	return False;
+}
+
+/* Messages that fit in one fragment go out in place if nothing is
+   waiting. Anything else is queued by the channel's priority and
+   trickles out from ui_select between X events, so that input PDUs,
+   which are never queued, are not held up by bulk transfers. */
 void
 channel_send_hooked(STREAM s, VCHANNEL * channel)
 {
 	uint32 length, flags;
-	uint32 thislength, remaining;
-	uint8 *data;
 
 #ifdef WITH_SCARD
 	scard_lock(SCARD_LOCK_CHANNEL);
 #endif
 	DEBUG(("Caught hooked call channel_send_hooked()\n"));
-	/* first fragment sent in-place */
 	s_pop_layer(s, channel_hdr);
 	length = s->end - s->p - 8;
 
 	DEBUG_CHANNEL(("channel_send, length = %d\n", length));
 
-	thislength = MIN(length, CHANNEL_CHUNK_LENGTH);
+	/* the server did not give us this channel */
+	if (channel->mcs_id == 0)
+	{
+#ifdef WITH_SCARD
+		scard_unlock(SCARD_LOCK_CHANNEL);
+#endif
+		return;
+	}
+
 /* Note: In the original clipboard implementation, this number was
    1592, not 1600. However, I don't remember the reason and 1600 seems
    to work so.. This applies only to *this* length, not the length of
    continuation or ending packets. */
-	remaining = length - thislength;
-	flags = (remaining == 0) ? CHANNEL_FLAG_FIRST | CHANNEL_FLAG_LAST : CHANNEL_FLAG_FIRST;
-	if (channel->flags & CHANNEL_OPTION_SHOW_PROTOCOL)
-		flags |= CHANNEL_FLAG_SHOW_PROTOCOL;
-
-	out_uint32_le(s, length);
-	out_uint32_le(s, flags);
-	data = s->end = s->p + thislength;
-	DEBUG_CHANNEL(("Sending %d bytes with FLAG_FIRST\n", thislength));
-	sec_send_to_channel(s, g_encryption ? SEC_ENCRYPT : 0, channel->mcs_id);
-
-	/* subsequent segments copied (otherwise would have to generate headers backwards) */
-	while (remaining > 0)
+	if ((length <= CHANNEL_CHUNK_LENGTH) && !channel_send_queued())
 	{
-		thislength = MIN(remaining, CHANNEL_CHUNK_LENGTH);
-		remaining -= thislength;
-		flags = (remaining == 0) ? CHANNEL_FLAG_LAST : 0;
+		flags = CHANNEL_FLAG_FIRST | CHANNEL_FLAG_LAST;
 		if (channel->flags & CHANNEL_OPTION_SHOW_PROTOCOL)
 			flags |= CHANNEL_FLAG_SHOW_PROTOCOL;
 
-		DEBUG_CHANNEL(("Sending %d bytes with flags %d\n", thislength, flags));
-
-		s = sec_init(g_encryption ? SEC_ENCRYPT : 0, thislength + 8);
 		out_uint32_le(s, length);
 		out_uint32_le(s, flags);
-		out_uint8p(s, data, thislength);
-		s_mark_end(s);
 		sec_send_to_channel(s, g_encryption ? SEC_ENCRYPT : 0, channel->mcs_id);
-
-		data += thislength;
+	}
+	else
+	{
+		queue_message(channel, s->p + 8, length);
+#ifdef WITH_SCARD
+		/* other threads have nobody to send the rest for them */
+		if (!pthread_equal(pthread_self(), g_channel_main_thread))
+		{
+			while (channel_send_queued())
+				send_queued(CHANNEL_PUMP_LENGTH);
+		}
+		else
+#endif
+			send_queued(CHANNEL_PUMP_LENGTH);
 	}
 
 #ifdef WITH_SCARD
@@ -141,25 +321,125 @@ channel_send(STREAM s, VCHANNEL * channel)
 	channel_send_hooked(s, channel);
 }
 
+/* Queue a message without sending any of it, for senders that cut a
+   long message into PDUs of their own. channel_send_pending starts it
+   off, and ui_select sends the rest as the socket drains. */
+void
+channel_queue(STREAM s, VCHANNEL * channel)
+{
+	uint32 length;
+
+#ifdef WITH_SCARD
+	scard_lock(SCARD_LOCK_CHANNEL);
+#endif
+	s_pop_layer(s, channel_hdr);
+	length = s->end - s->p - 8;
+	if (channel->mcs_id != 0)
+		queue_message(channel, s->p + 8, length);
+#ifdef WITH_SCARD
+	scard_unlock(SCARD_LOCK_CHANNEL);
+#endif
+}
+
+/* Called from ui_select when the socket is writable */
+void
+channel_send_pending(void)
+{
+#ifdef WITH_SCARD
+	scard_lock(SCARD_LOCK_CHANNEL);
+#endif
+	send_queued(CHANNEL_PUMP_LENGTH);
+#ifdef WITH_SCARD
+	scard_unlock(SCARD_LOCK_CHANNEL);
+#endif
+}
+
+/* Drop what was queued for the previous connection */
+void
+channel_reset_state(void)
+{
+	CHANNEL_FRAGMENT *fragment;
+	int i;
+
+	for (i = 0; i < CHANNEL_PRIORITIES; i++)
+	{
+		while ((fragment = g_channel_queue[i].head) != NULL)
+		{
+			g_channel_queue[i].head = fragment->next;
+			xfree(fragment);
+		}
+		g_channel_queue[i].tail = NULL;
+		g_channel_queue[i].deficit = 0;
+	}
+}
+
+/* Size class for a buffer, CHANNEL_POOL_CLASSES if it is too large to keep */
+static int
+pool_class(uint32 length)
+{
+	int class = 0;
+
+	while ((class < CHANNEL_POOL_CLASSES)
+	       && (length > (1U << (CHANNEL_POOL_MIN_SHIFT + class))))
+		class++;
+
+	return class;
+}
+
+/* Give a stream a reassembly buffer for a message of length bytes */
+static void
+pool_get(STREAM in, uint32 length)
+{
+	int class = pool_class(length);
+
+	if (class < CHANNEL_POOL_CLASSES)
+	{
+		in->size = 1 << (CHANNEL_POOL_MIN_SHIFT + class);
+		if (g_channel_pool_count[class] > 0)
+			in->data = g_channel_pool[class][--g_channel_pool_count[class]];
+		else
+			in->data = (uint8 *) xmalloc(in->size);
+	}
+	else
+	{
+		in->size = length;
+		in->data = (uint8 *) xmalloc(in->size);
+	}
+
+	in->p = in->data;
+	in->end = in->data + length;
+}
+
+/* Return the reassembly buffer of a stream to the pool */
+static void
+pool_put(STREAM in)
+{
+	int class = pool_class(in->size);
+
+	if ((class < CHANNEL_POOL_CLASSES) && (g_channel_pool_count[class] < CHANNEL_POOL_DEPTH))
+		g_channel_pool[class][g_channel_pool_count[class]++] = in->data;
+	else
+		xfree(in->data);
+
+	in->data = in->p = in->end = NULL;
+	in->size = 0;
+}
+
 void
 channel_process(STREAM s, uint16 mcs_channel)
 {
 	uint32 length, flags;
 	uint32 thislength;
-	VCHANNEL *channel = NULL;
-	unsigned int i;
+	VCHANNEL *channel;
+	uint8 index;
 	STREAM in;
 
-	for (i = 0; i < g_num_channels; i++)
-	{
-		channel = &g_channels[i];
-		if (channel->mcs_id == mcs_channel)
-			break;
-	}
-
-	if (i >= g_num_channels)
+	index = g_channel_map[mcs_channel];
+	if (index == 0)
 		return;
 
+	channel = &g_channels[index - 1];
+
 	in_uint32_le(s, length);
 	in_uint32_le(s, flags);
 	if ((flags & CHANNEL_FLAG_FIRST) && (flags & CHANNEL_FLAG_LAST))
@@ -173,15 +453,25 @@ channel_process(STREAM s, uint16 mcs_channel)
 		in = &channel->in;
 		if (flags & CHANNEL_FLAG_FIRST)
 		{
-			if (length > in->size)
+			/* drop a message that never got its last fragment */
+			if (in->data != NULL)
+				pool_put(in);
+
+			if ((length == 0) || (length > CHANNEL_MAX_LENGTH))
 			{
-				in->data = (uint8 *) xrealloc(in->data, length);
-				in->size = length;
+				warning("channel_process: bad message length %u on %.8s\n",
+					length, channel->name);
+				return;
 			}
-			in->p = in->data;
+
+			pool_get(in, length);
 		}
 
-		thislength = MIN(s->end - s->p, in->data + in->size - in->p);
+		/* not part of a message we accepted */
+		if (in->data == NULL)
+			return;
+
+		thislength = MIN(s->end - s->p, in->end - in->p);
 		memcpy(in->p, s->p, thislength);
 		in->p += thislength;
 
@@ -190,6 +480,7 @@ channel_process(STREAM s, uint16 mcs_channel)
 			in->end = in->p;
 			in->p = in->data;
 			channel->process(in);
+			pool_put(in);
 		}
 	}
 }
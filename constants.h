@@ -205,9 +205,22 @@ enum RDP_INPUT_DEVICE
 #define MOUSE_FLAG_BUTTON5      0x0380
 #define MOUSE_FLAG_DOWN         0x8000
 
+/* Fast-path input */
+#define FASTPATH_INPUT_ENCRYPTED	0x80
+#define FASTPATH_INPUT_EVENT_SCANCODE	0
+#define FASTPATH_INPUT_EVENT_MOUSE	1
+#define FASTPATH_INPUT_EVENT_SYNC	3
+#define FASTPATH_INPUT_KBDFLAGS_RELEASE	0x01
+#define FASTPATH_INPUT_KBDFLAGS_EXTENDED	0x02
+
 /* Raster operation masks */
 #define ROP2_S(rop3) (rop3 & 0xf)
 #define ROP2_P(rop3) ((rop3 & 0x3) | ((rop3 & 0x30) >> 2))
+#define ROP3_S(rop2) ((rop2) | ((rop2) << 4))
+#define ROP3_P(rop2) (((rop2) & 0x3) | (((rop2) & 0x3) << 2) | (((rop2) & 0xc) << 2) | (((rop2) & 0xc) << 4))
+#define ROP3_USES_P(rop3) ((((rop3) >> 4) ^ (rop3)) & 0x0f)
+#define ROP3_USES_S(rop3) ((((rop3) >> 2) ^ (rop3)) & 0x33)
+#define ROP3_USES_D(rop3) ((((rop3) >> 1) ^ (rop3)) & 0x55)
 
 #define ROP2_COPY	0xc
 #define ROP2_XOR	0x6
@@ -230,6 +243,21 @@ enum RDP_INPUT_DEVICE
 #define BMPCACHE2_C2_CELLS	0x150
 #define BMPCACHE2_NUM_PSTCELLS	0x9f6
 
+/* brush cache data, 8x8 at up to 4 bytes per pixel */
+#define BRUSH_DATA_SIZE		(8 * 8 * 4)
+
+/* RDP glyph cache, 10 caches with cells of up to 2048 bytes */
+#define GLYPH_CACHE_ENTRIES	254
+#define GLYPH_CACHE_FONTS	12
+#define FRAGMENT_CACHE_ENTRIES	256
+
+/* RDP offscreen bitmap cache */
+#define OFFSCREEN_CACHE_SIZE	7680	/* kB */
+#define OFFSCREEN_CACHE_ENTRIES	500
+#define OFFSCREEN_CACHE_ID	0xff	/* cache id of MEMBLT and TRIBLT */
+#define OFFSCREEN_SCREEN	0xffff	/* surface id of the screen */
+#define OFFSCREEN_DELETE_LIST	0x8000
+
 #define PDU_FLAG_FIRST		0x01
 #define PDU_FLAG_LAST		0x02
 
@@ -266,9 +294,23 @@ enum RDP_INPUT_DEVICE
 #define RDP_CAPSET_COLCACHE	10
 #define RDP_CAPLEN_COLCACHE	0x08
 
+#define RDP_CAPSET_INPUT	13
+#define RDP_CAPLEN_INPUT	0x58
+#define INPUT_FLAG_SCANCODES		0x0001
+#define INPUT_FLAG_FASTPATH_INPUT	0x0008
+#define INPUT_FLAG_FASTPATH_INPUT2	0x0020
+
 #define RDP_CAPSET_BRUSHCACHE	15
 #define RDP_CAPLEN_BRUSHCACHE	0x08
 
+#define RDP_CAPSET_GLYPHCACHE	16
+#define RDP_CAPLEN_GLYPHCACHE	0x34
+#define GLYPH_SUPPORT_FULL	2
+#define GLYPH_SUPPORT_ENCODE	3	/* glyph cache rev2 orders */
+
+#define RDP_CAPSET_OFFSCREEN	17
+#define RDP_CAPLEN_OFFSCREEN	0x0C
+
 #define RDP_CAPSET_BMPCACHE2	19
 #define RDP_CAPLEN_BMPCACHE2	0x28
 #define BMPCACHE2_FLAG_PERSIST	((uint32)1<<31)
@@ -368,6 +410,14 @@ enum RDP_INPUT_DEVICE
 #define WAVE_FORMAT_ALAW	6
 #define WAVE_FORMAT_MULAW	7
 
+/* Static virtual channels a client may request */
+#define MAX_CHANNELS			31
+
+/* Outbound virtual channel priorities, input PDUs always go first */
+#define CHANNEL_PRIORITY_INTERACTIVE	0
+#define CHANNEL_PRIORITY_BULK		1
+#define CHANNEL_PRIORITIES		2
+
 /* Virtual channel options */
 #define CHANNEL_OPTION_INITIALIZED	0x80000000
 #define CHANNEL_OPTION_ENCRYPT_RDP	0x40000000
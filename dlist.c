@@ -0,0 +1,522 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Display list of decoded drawing orders
+   Copyright (C) the rdesktop developers
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rdesktop.h"
+
+extern RD_BOOL g_order_profile;
+
+/*
+ * The order parser records drawing orders here as plain command
+ * records instead of calling the ui for each one. dlist_flush hands
+ * them to the ui in one go, setting the clip only where it changes
+ * between commands. Records hold no pointers: bitmaps, brushes and
+ * glyphs are named by their cache index and looked up at flush time, so
+ * the list must be flushed before anything replaces cache entries or
+ * switches the drawing surface. Points and text live in a data area
+ * that is reallocated as it grows, so records refer to them by offset.
+ * Each record is still drawn with its own ui call.
+ */
+
+enum DLIST_TYPE
+{
+	DL_DESTBLT,
+	DL_PATBLT,
+	DL_SCREENBLT,
+	DL_MEMBLT,
+	DL_TRIBLT,
+	DL_LINE,
+	DL_RECT,
+	DL_POLYGON,
+	DL_POLYLINE,
+	DL_ELLIPSE,
+	DL_TEXT,
+	DL_DESKSAVE,
+	DL_DESKRESTORE
+};
+
+typedef struct
+{
+	int x, y, cx, cy;
+}
+DLIST_RECT;
+
+typedef struct _DLIST_CMD
+{
+	uint8 type;
+	uint8 order;		/* that recorded it, when profiling */
+	uint8 opcode;
+	RD_BOOL clipped;
+	DLIST_RECT clip;
+	DLIST_RECT dest;	/* clip rectangle of the text, for DL_TEXT */
+	union
+	{
+		/* blts, rect, ellipse and the desktop cache */
+		struct
+		{
+			int srcx, srcy;
+			uint8 cache_id;
+			uint16 cache_idx;
+			uint8 fillmode;
+			uint32 offset;
+		}
+		area;
+		struct
+		{
+			int startx, starty, endx, endy;
+		}
+		line;
+		/* polygon, polyline */
+		struct
+		{
+			uint8 fillmode;
+			int points;
+			int npoints;
+		}
+		poly;
+		struct
+		{
+			uint8 font, flags;
+			int mixmode;
+			int x, y;
+			DLIST_RECT box;
+			int text;
+			uint8 length;
+		}
+		text;
+	}
+	u;
+	RD_BOOL brushed;
+	BRUSH brush;		/* as received, without brush data */
+	PEN pen;
+	int bgcolour, fgcolour;
+}
+DLIST_CMD;
+
+static DLIST_CMD *g_dlist = NULL;
+static int g_dlist_count = 0;
+static int g_dlist_size = 0;
+
+static uint8 *g_dlist_data = NULL;
+static int g_dlist_used = 0;
+static int g_dlist_data_size = 0;
+
+static RD_BOOL g_dlist_clipped = False;
+static DLIST_RECT g_dlist_clip;
+static uint8 g_dlist_order = 0;
+
+/* Look up the brush data of a cached brush */
+static void
+setup_brush(BRUSH * out_brush, BRUSH * in_brush)
+{
+	BRUSHDATA *brush_data;
+	uint8 cache_idx;
+	uint8 colour_code;
+
+	memcpy(out_brush, in_brush, sizeof(BRUSH));
+	if (out_brush->style & 0x80)
+	{
+		colour_code = out_brush->style & 0x0f;
+		cache_idx = out_brush->pattern[0];
+		brush_data = cache_get_brush_data(colour_code, cache_idx);
+		if ((brush_data == NULL) || (brush_data->data == NULL))
+		{
+			error("error getting brush data, style %x\n", out_brush->style);
+			out_brush->bd = NULL;
+			memset(out_brush->pattern, 0, 8);
+		}
+		else
+		{
+			out_brush->bd = brush_data;
+		}
+		out_brush->style = 3;
+	}
+}
+
+/* The bitmap a MEMBLT or TRIBLT copies from */
+static RD_HBITMAP
+get_blt_source(uint8 cache_id, uint16 cache_idx)
+{
+	if (cache_id == OFFSCREEN_CACHE_ID)
+		return cache_get_offscreen(cache_idx);
+
+	return cache_get_bitmap(cache_id, cache_idx);
+}
+
+static DLIST_CMD *
+add_cmd(uint8 type, uint8 opcode)
+{
+	DLIST_CMD *cmd;
+
+	if (g_dlist_count == g_dlist_size)
+	{
+		g_dlist_size = g_dlist_size ? g_dlist_size * 2 : 256;
+		g_dlist = (DLIST_CMD *) xrealloc(g_dlist, g_dlist_size * sizeof(DLIST_CMD));
+	}
+
+	cmd = &g_dlist[g_dlist_count++];
+	cmd->type = type;
+	cmd->order = g_dlist_order;
+	cmd->opcode = opcode;
+	cmd->clipped = g_dlist_clipped;
+	cmd->clip = g_dlist_clip;
+	cmd->brushed = False;
+	return cmd;
+}
+
+/* Copy points or text to the data area, returning their offset */
+static int
+add_data(void *data, int length)
+{
+	int offset = g_dlist_used;
+
+	if (g_dlist_used + length > g_dlist_data_size)
+	{
+		while (g_dlist_used + length > g_dlist_data_size)
+			g_dlist_data_size = g_dlist_data_size ? g_dlist_data_size * 2 : 4096;
+		g_dlist_data = (uint8 *) xrealloc(g_dlist_data, g_dlist_data_size);
+	}
+
+	memcpy(g_dlist_data + offset, data, length);
+	/* keep the points that follow aligned */
+	g_dlist_used += (length + 7) & ~7;
+	return offset;
+}
+
+static void
+set_area(DLIST_CMD * cmd, int x, int y, int cx, int cy)
+{
+	cmd->dest.x = x;
+	cmd->dest.y = y;
+	cmd->dest.cx = cx;
+	cmd->dest.cy = cy;
+}
+
+static void
+set_brush(DLIST_CMD * cmd, BRUSH * brush, int bgcolour, int fgcolour)
+{
+	if (brush != NULL)
+	{
+		cmd->brushed = True;
+		cmd->brush = *brush;
+		cmd->brush.bd = NULL;
+	}
+	cmd->bgcolour = bgcolour;
+	cmd->fgcolour = fgcolour;
+}
+
+/* Attribute the following commands to an order type, for the profile */
+void
+dlist_set_order(uint8 order)
+{
+	g_dlist_order = order;
+}
+
+void
+dlist_set_clip(int x, int y, int cx, int cy)
+{
+	g_dlist_clipped = True;
+	g_dlist_clip.x = x;
+	g_dlist_clip.y = y;
+	g_dlist_clip.cx = cx;
+	g_dlist_clip.cy = cy;
+}
+
+void
+dlist_reset_clip(void)
+{
+	g_dlist_clipped = False;
+}
+
+void
+dlist_destblt(uint8 opcode, int x, int y, int cx, int cy)
+{
+	DLIST_CMD *cmd = add_cmd(DL_DESTBLT, opcode);
+
+	set_area(cmd, x, y, cx, cy);
+}
+
+void
+dlist_patblt(uint8 opcode, int x, int y, int cx, int cy, BRUSH * brush, int bgcolour,
+	     int fgcolour)
+{
+	DLIST_CMD *cmd = add_cmd(DL_PATBLT, opcode);
+
+	set_area(cmd, x, y, cx, cy);
+	set_brush(cmd, brush, bgcolour, fgcolour);
+}
+
+void
+dlist_screenblt(uint8 opcode, int x, int y, int cx, int cy, int srcx, int srcy)
+{
+	DLIST_CMD *cmd = add_cmd(DL_SCREENBLT, opcode);
+
+	set_area(cmd, x, y, cx, cy);
+	cmd->u.area.srcx = srcx;
+	cmd->u.area.srcy = srcy;
+}
+
+void
+dlist_memblt(uint8 opcode, int x, int y, int cx, int cy, uint8 cache_id, uint16 cache_idx,
+	     int srcx, int srcy)
+{
+	DLIST_CMD *cmd = add_cmd(DL_MEMBLT, opcode);
+
+	set_area(cmd, x, y, cx, cy);
+	cmd->u.area.cache_id = cache_id;
+	cmd->u.area.cache_idx = cache_idx;
+	cmd->u.area.srcx = srcx;
+	cmd->u.area.srcy = srcy;
+}
+
+void
+dlist_triblt(uint8 opcode, int x, int y, int cx, int cy, uint8 cache_id, uint16 cache_idx,
+	     int srcx, int srcy, BRUSH * brush, int bgcolour, int fgcolour)
+{
+	DLIST_CMD *cmd = add_cmd(DL_TRIBLT, opcode);
+
+	set_area(cmd, x, y, cx, cy);
+	cmd->u.area.cache_id = cache_id;
+	cmd->u.area.cache_idx = cache_idx;
+	cmd->u.area.srcx = srcx;
+	cmd->u.area.srcy = srcy;
+	set_brush(cmd, brush, bgcolour, fgcolour);
+}
+
+void
+dlist_line(uint8 opcode, int startx, int starty, int endx, int endy, PEN * pen)
+{
+	DLIST_CMD *cmd = add_cmd(DL_LINE, opcode);
+
+	cmd->u.line.startx = startx;
+	cmd->u.line.starty = starty;
+	cmd->u.line.endx = endx;
+	cmd->u.line.endy = endy;
+	cmd->pen = *pen;
+}
+
+void
+dlist_rect(int x, int y, int cx, int cy, int colour)
+{
+	DLIST_CMD *cmd = add_cmd(DL_RECT, ROP2_COPY);
+
+	set_area(cmd, x, y, cx, cy);
+	cmd->fgcolour = colour;
+}
+
+void
+dlist_polygon(uint8 opcode, uint8 fillmode, RD_POINT * points, int npoints, BRUSH * brush,
+	      int bgcolour, int fgcolour)
+{
+	DLIST_CMD *cmd = add_cmd(DL_POLYGON, opcode);
+
+	cmd->u.poly.fillmode = fillmode;
+	cmd->u.poly.points = add_data(points, npoints * sizeof(RD_POINT));
+	cmd->u.poly.npoints = npoints;
+	set_brush(cmd, brush, bgcolour, fgcolour);
+}
+
+void
+dlist_polyline(uint8 opcode, RD_POINT * points, int npoints, PEN * pen)
+{
+	DLIST_CMD *cmd = add_cmd(DL_POLYLINE, opcode);
+
+	cmd->u.poly.points = add_data(points, npoints * sizeof(RD_POINT));
+	cmd->u.poly.npoints = npoints;
+	cmd->pen = *pen;
+}
+
+void
+dlist_ellipse(uint8 opcode, uint8 fillmode, int x, int y, int cx, int cy, BRUSH * brush,
+	      int bgcolour, int fgcolour)
+{
+	DLIST_CMD *cmd = add_cmd(DL_ELLIPSE, opcode);
+
+	set_area(cmd, x, y, cx, cy);
+	cmd->u.area.fillmode = fillmode;
+	set_brush(cmd, brush, bgcolour, fgcolour);
+}
+
+void
+dlist_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y, int clipx,
+		int clipy, int clipcx, int clipcy, int boxx, int boxy, int boxcx, int boxcy,
+		BRUSH * brush, int bgcolour, int fgcolour, uint8 * text, uint8 length)
+{
+	DLIST_CMD *cmd = add_cmd(DL_TEXT, opcode);
+
+	cmd->u.text.font = font;
+	cmd->u.text.flags = flags;
+	cmd->u.text.mixmode = mixmode;
+	cmd->u.text.x = x;
+	cmd->u.text.y = y;
+	set_area(cmd, clipx, clipy, clipcx, clipcy);
+	cmd->u.text.box.x = boxx;
+	cmd->u.text.box.y = boxy;
+	cmd->u.text.box.cx = boxcx;
+	cmd->u.text.box.cy = boxcy;
+	cmd->u.text.text = add_data(text, length);
+	cmd->u.text.length = length;
+	set_brush(cmd, brush, bgcolour, fgcolour);
+}
+
+void
+dlist_desktop_save(uint32 offset, int x, int y, int cx, int cy)
+{
+	DLIST_CMD *cmd = add_cmd(DL_DESKSAVE, ROP2_COPY);
+
+	set_area(cmd, x, y, cx, cy);
+	cmd->u.area.offset = offset;
+}
+
+void
+dlist_desktop_restore(uint32 offset, int x, int y, int cx, int cy)
+{
+	DLIST_CMD *cmd = add_cmd(DL_DESKRESTORE, ROP2_COPY);
+
+	set_area(cmd, x, y, cx, cy);
+	cmd->u.area.offset = offset;
+}
+
+/* Draw everything recorded so far and empty the list */
+void
+dlist_flush(void)
+{
+	DLIST_CMD *cmd;
+	DLIST_RECT *r;
+	BRUSH *brush, cached;
+	RD_HBITMAP src = NULL;
+	RD_BOOL clipped = False;
+	DLIST_RECT clip;
+	double start = 0;
+	int i;
+
+	for (i = 0; i < g_dlist_count; i++)
+	{
+		cmd = &g_dlist[i];
+		if (g_order_profile)
+			start = order_profile_clock();
+
+		if (cmd->clipped)
+		{
+			if (!clipped || memcmp(&clip, &cmd->clip, sizeof(clip)))
+			{
+				clip = cmd->clip;
+				clipped = True;
+				ui_set_clip(clip.x, clip.y, clip.cx, clip.cy);
+			}
+		}
+		else if (clipped)
+		{
+			clipped = False;
+			ui_reset_clip();
+		}
+
+		r = &cmd->dest;
+		brush = NULL;
+		if (cmd->brushed)
+		{
+			setup_brush(&cached, &cmd->brush);
+			brush = &cached;
+		}
+		if ((cmd->type == DL_MEMBLT) || (cmd->type == DL_TRIBLT))
+			src = get_blt_source(cmd->u.area.cache_id, cmd->u.area.cache_idx);
+
+		switch (cmd->type)
+		{
+			case DL_DESTBLT:
+				ui_destblt(cmd->opcode, r->x, r->y, r->cx, r->cy);
+				break;
+
+			case DL_PATBLT:
+				ui_patblt(cmd->opcode, r->x, r->y, r->cx, r->cy, brush,
+					  cmd->bgcolour, cmd->fgcolour);
+				break;
+
+			case DL_SCREENBLT:
+				ui_screenblt(cmd->opcode, r->x, r->y, r->cx, r->cy,
+					     cmd->u.area.srcx, cmd->u.area.srcy);
+				break;
+
+			case DL_MEMBLT:
+				if (src != NULL)
+					ui_memblt(cmd->opcode, r->x, r->y, r->cx, r->cy, src,
+						  cmd->u.area.srcx, cmd->u.area.srcy);
+				break;
+
+			case DL_TRIBLT:
+				if (src != NULL)
+					ui_triblt(cmd->opcode, r->x, r->y, r->cx, r->cy, src,
+						  cmd->u.area.srcx, cmd->u.area.srcy, brush,
+						  cmd->bgcolour, cmd->fgcolour);
+				break;
+
+			case DL_LINE:
+				ui_line(cmd->opcode, cmd->u.line.startx, cmd->u.line.starty,
+					cmd->u.line.endx, cmd->u.line.endy, &cmd->pen);
+				break;
+
+			case DL_RECT:
+				ui_rect(r->x, r->y, r->cx, r->cy, cmd->fgcolour);
+				break;
+
+			case DL_POLYGON:
+				ui_polygon(cmd->opcode, cmd->u.poly.fillmode,
+					   (RD_POINT *) (g_dlist_data + cmd->u.poly.points),
+					   cmd->u.poly.npoints, brush, cmd->bgcolour, cmd->fgcolour);
+				break;
+
+			case DL_POLYLINE:
+				ui_polyline(cmd->opcode,
+					    (RD_POINT *) (g_dlist_data + cmd->u.poly.points),
+					    cmd->u.poly.npoints, &cmd->pen);
+				break;
+
+			case DL_ELLIPSE:
+				ui_ellipse(cmd->opcode, cmd->u.area.fillmode, r->x, r->y, r->cx,
+					   r->cy, brush, cmd->bgcolour, cmd->fgcolour);
+				break;
+
+			case DL_TEXT:
+				ui_draw_text(cmd->u.text.font, cmd->u.text.flags, cmd->opcode,
+					     cmd->u.text.mixmode, cmd->u.text.x, cmd->u.text.y,
+					     r->x, r->y, r->cx, r->cy, cmd->u.text.box.x,
+					     cmd->u.text.box.y, cmd->u.text.box.cx,
+					     cmd->u.text.box.cy, brush, cmd->bgcolour,
+					     cmd->fgcolour, g_dlist_data + cmd->u.text.text,
+					     cmd->u.text.length);
+				break;
+
+			case DL_DESKSAVE:
+				ui_desktop_save(cmd->u.area.offset, r->x, r->y, r->cx, r->cy);
+				break;
+
+			case DL_DESKRESTORE:
+				ui_desktop_restore(cmd->u.area.offset, r->x, r->y, r->cx, r->cy);
+				break;
+		}
+
+		if (g_order_profile)
+			order_profile_draw(cmd->order, start);
+	}
+
+	if (clipped)
+		ui_reset_clip();
+
+	g_dlist_count = 0;
+	g_dlist_used = 0;
+}
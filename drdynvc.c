@@ -0,0 +1,439 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Protocol services - Dynamic virtual channels
+   Copyright (C) the rdesktop developers
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rdesktop.h"
+
+/*
+ * Dynamic virtual channels are multiplexed over the "drdynvc" static
+ * channel. Modules register a listener by name with dvc_register, and the
+ * server opens and closes channels to the listeners at will. Each PDU
+ * carries a one byte header (command, length size, channel id size)
+ * followed by the channel id, and fits in one static channel fragment.
+ */
+
+#define DYNVC_CREATE		0x01
+#define DYNVC_DATA_FIRST	0x02
+#define DYNVC_DATA		0x03
+#define DYNVC_CLOSE		0x04
+#define DYNVC_CAPABILITIES	0x05
+
+/* Highest version we speak; version 3 adds compressed data PDUs */
+#define DYNVC_VERSION		2
+
+#define MAX_DVCHANNELS		16
+#define DVC_PDU_LENGTH		1600
+#define DVC_MAX_LENGTH		(64 * 1024 * 1024)
+#define DVC_STATUS_NO_LISTENER	0xc0000001
+
+static VCHANNEL *drdynvc_channel;
+static DVCHANNEL g_dvchannels[MAX_DVCHANNELS];
+static unsigned int g_num_dvchannels;
+static uint16 g_dvc_version;
+static struct stream g_dvc_out;
+
+/* Size code of a channel id or length: 0, 1 or 2 for 1, 2 or 4 bytes */
+static int
+dvc_size_code(uint32 value)
+{
+	if (value <= 0xff)
+		return 0;
+	if (value <= 0xffff)
+		return 1;
+	return 2;
+}
+
+static uint32
+dvc_in_value(STREAM s, int code)
+{
+	uint8 value8;
+	uint16 value16;
+	uint32 value32;
+
+	switch (code)
+	{
+		case 0:
+			in_uint8(s, value8);
+			return value8;
+		case 1:
+			in_uint16_le(s, value16);
+			return value16;
+		default:
+			in_uint32_le(s, value32);
+			return value32;
+	}
+}
+
+static void
+dvc_out_value(STREAM s, int code, uint32 value)
+{
+	switch (code)
+	{
+		case 0:
+			out_uint8(s, value);
+			break;
+		case 1:
+			out_uint16_le(s, value);
+			break;
+		default:
+			out_uint32_le(s, value);
+			break;
+	}
+}
+
+static DVCHANNEL *
+dvc_find(uint32 id)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_num_dvchannels; i++)
+		if (g_dvchannels[i].open && (g_dvchannels[i].id == id))
+			return &g_dvchannels[i];
+
+	return NULL;
+}
+
+/* Start a PDU for a channel; the caller adds the rest */
+static STREAM
+dvc_pdu_init(uint8 cmd, int sp, uint32 id, uint32 length)
+{
+	STREAM s;
+	int cb = dvc_size_code(id);
+
+	s = channel_init(drdynvc_channel, 1 + (1 << cb) + length);
+	out_uint8(s, (cmd << 4) | (sp << 2) | cb);
+	dvc_out_value(s, cb, id);
+	return s;
+}
+
+static void
+dvc_close(DVCHANNEL * channel)
+{
+	channel->open = False;
+	xfree(channel->in.data);
+	channel->in.data = channel->in.p = channel->in.end = NULL;
+
+	if (channel->notify != NULL)
+		channel->notify(False);
+}
+
+static void
+dvc_process_capabilities(STREAM s)
+{
+	in_uint8s(s, 1);	/* pad */
+	in_uint16_le(s, g_dvc_version);
+	/* version 2 adds priority charges, which we leave to the server */
+
+	DEBUG_CHANNEL(("DRDYNVC server version %d\n", g_dvc_version));
+	g_dvc_version = MIN(g_dvc_version, DYNVC_VERSION);
+
+	s = channel_init(drdynvc_channel, 4);
+	out_uint8(s, DYNVC_CAPABILITIES << 4);
+	out_uint8(s, 0);	/* pad */
+	out_uint16_le(s, g_dvc_version);
+	s_mark_end(s);
+	channel_send(s, drdynvc_channel);
+}
+
+static void
+dvc_process_create(STREAM s, uint32 id)
+{
+	DVCHANNEL *channel = NULL;
+	uint32 status = DVC_STATUS_NO_LISTENER;
+	char *name;
+	unsigned int i;
+
+	name = (char *) s->p;
+	if (memchr(name, 0, s->end - s->p) == NULL)
+		return;
+
+	/* only one instance of each listener */
+	for (i = 0; i < g_num_dvchannels; i++)
+	{
+		if (!g_dvchannels[i].open && (strcmp(g_dvchannels[i].name, name) == 0))
+		{
+			channel = &g_dvchannels[i];
+			status = 0;
+			break;
+		}
+	}
+
+	DEBUG_CHANNEL(("DRDYNVC create %s as %d: %s\n", name, id,
+		       channel ? "ok" : "no listener"));
+
+	s = dvc_pdu_init(DYNVC_CREATE, 0, id, 4);
+	out_uint32_le(s, status);
+	s_mark_end(s);
+	channel_send(s, drdynvc_channel);
+
+	if (channel == NULL)
+		return;
+
+	channel->id = id;
+	channel->open = True;
+	if (channel->notify != NULL)
+		channel->notify(True);
+}
+
+static void
+dvc_process_data(STREAM s, uint32 id, uint32 length, RD_BOOL first)
+{
+	DVCHANNEL *channel;
+	STREAM in;
+	uint32 thislength;
+
+	channel = dvc_find(id);
+	if (channel == NULL)
+		return;
+
+	in = &channel->in;
+	if (first)
+	{
+		xfree(in->data);
+		in->data = in->p = in->end = NULL;
+
+		if ((length == 0) || (length > DVC_MAX_LENGTH))
+		{
+			warning("DRDYNVC: bad message length %u on %s\n", length, channel->name);
+			return;
+		}
+
+		/* all of it in the first PDU after all */
+		if (length <= (uint32) (s->end - s->p))
+		{
+			s->end = s->p + length;
+			channel->process(s);
+			return;
+		}
+
+		in->data = (uint8 *) xmalloc(length);
+		in->size = length;
+		in->p = in->data;
+		in->end = in->data + length;
+	}
+	else if (in->data == NULL)
+	{
+		/* single PDU message - pass straight up */
+		channel->process(s);
+		return;
+	}
+
+	thislength = MIN(s->end - s->p, in->end - in->p);
+	memcpy(in->p, s->p, thislength);
+	in->p += thislength;
+
+	if (in->p == in->end)
+	{
+		in->p = in->data;
+		channel->process(in);
+		xfree(in->data);
+		in->data = in->p = in->end = NULL;
+	}
+}
+
+static void
+dvc_process_close(uint32 id)
+{
+	DVCHANNEL *channel;
+	STREAM s;
+
+	channel = dvc_find(id);
+	if (channel != NULL)
+		dvc_close(channel);
+
+	s = dvc_pdu_init(DYNVC_CLOSE, 0, id, 0);
+	s_mark_end(s);
+	channel_send(s, drdynvc_channel);
+}
+
+static void
+drdynvc_process(STREAM s)
+{
+	uint8 header;
+	uint32 id, length;
+	int cmd, sp, cb;
+
+	in_uint8(s, header);
+	cmd = header >> 4;
+	sp = (header >> 2) & 0x03;
+	cb = header & 0x03;
+
+	if (cmd == DYNVC_CAPABILITIES)
+	{
+		dvc_process_capabilities(s);
+		return;
+	}
+
+	id = dvc_in_value(s, cb);
+	if (!s_check(s))
+		return;
+
+	switch (cmd)
+	{
+		case DYNVC_CREATE:
+			dvc_process_create(s, id);
+			break;
+
+		case DYNVC_DATA_FIRST:
+			length = dvc_in_value(s, sp);
+			if (s_check(s))
+				dvc_process_data(s, id, length, True);
+			break;
+
+		case DYNVC_DATA:
+			dvc_process_data(s, id, 0, False);
+			break;
+
+		case DYNVC_CLOSE:
+			dvc_process_close(id);
+			break;
+
+		default:
+			unimpl("DRDYNVC command 0x%x\n", cmd);
+	}
+}
+
+/* Register a listener for dynamic channels of a name. The notify
+   callback, if any, is told when the server opens or closes it. */
+DVCHANNEL *
+dvc_register(char *name, void (*callback) (STREAM), void (*notify) (RD_BOOL))
+{
+	DVCHANNEL *channel;
+
+	if (g_num_dvchannels >= MAX_DVCHANNELS)
+	{
+		error("Dynamic channel table full, at most %d channels\n", MAX_DVCHANNELS);
+		return NULL;
+	}
+
+	channel = &g_dvchannels[g_num_dvchannels];
+	channel->name = xstrdup(name);
+	channel->open = False;
+	channel->process = callback;
+	channel->notify = notify;
+	g_num_dvchannels++;
+	return channel;
+}
+
+STREAM
+dvc_init(DVCHANNEL * channel, uint32 length)
+{
+	/* one buffer serves all channels, as with channel_init */
+	UNUSED(channel);
+
+	if (length > g_dvc_out.size)
+	{
+		g_dvc_out.data = (uint8 *) xrealloc(g_dvc_out.data, length);
+		g_dvc_out.size = length;
+	}
+
+	g_dvc_out.p = g_dvc_out.data;
+	g_dvc_out.end = g_dvc_out.data + g_dvc_out.size;
+	return &g_dvc_out;
+}
+
+/* Send a message as one DATA PDU, or as a DATA_FIRST PDU with the total
+   length followed by DATA PDUs. Each PDU fits in one static channel
+   fragment, so the PDUs of a long message are queued rather than sent,
+   and go out as the socket drains, sharing it with the other channels. */
+void
+dvc_send(STREAM s, DVCHANNEL * channel)
+{
+	uint32 length, thislength, remaining;
+	uint8 *data;
+	int header, sp;
+	STREAM out;
+
+	if (!channel->open)
+		return;
+
+	data = s->data;
+	length = remaining = s->end - s->data;
+	header = 1 + (1 << dvc_size_code(channel->id));
+
+	if (header + length <= DVC_PDU_LENGTH)
+	{
+		out = dvc_pdu_init(DYNVC_DATA, 0, channel->id, length);
+		out_uint8p(out, data, length);
+		s_mark_end(out);
+		channel_send(out, drdynvc_channel);
+		return;
+	}
+
+	sp = dvc_size_code(length);
+	thislength = DVC_PDU_LENGTH - header - (1 << sp);
+	out = dvc_pdu_init(DYNVC_DATA_FIRST, sp, channel->id, (1 << sp) + thislength);
+	dvc_out_value(out, sp, length);
+	out_uint8p(out, data, thislength);
+	s_mark_end(out);
+	channel_queue(out, drdynvc_channel);
+
+	for (data += thislength, remaining -= thislength; remaining > 0;
+	     data += thislength, remaining -= thislength)
+	{
+		thislength = MIN(remaining, (uint32) (DVC_PDU_LENGTH - header));
+		out = dvc_pdu_init(DYNVC_DATA, 0, channel->id, thislength);
+		out_uint8p(out, data, thislength);
+		s_mark_end(out);
+		channel_queue(out, drdynvc_channel);
+	}
+
+	channel_send_pending();
+}
+
+/* The ECHO channel sends back whatever it gets */
+static DVCHANNEL *echo_channel;
+
+static void
+echo_process(STREAM s)
+{
+	uint32 length = s->end - s->p;
+	STREAM out;
+
+	out = dvc_init(echo_channel, length);
+	out_uint8p(out, s->p, length);
+	s_mark_end(out);
+	dvc_send(out, echo_channel);
+}
+
+RD_BOOL
+drdynvc_init(void)
+{
+	drdynvc_channel =
+		channel_register("drdynvc",
+				 CHANNEL_OPTION_INITIALIZED | CHANNEL_OPTION_ENCRYPT_RDP |
+				 CHANNEL_OPTION_COMPRESS_RDP, drdynvc_process);
+	if (drdynvc_channel == NULL)
+		return False;
+
+	echo_channel = dvc_register("ECHO", echo_process, NULL);
+	return True;
+}
+
+/* Dynamic channels do not survive the connection */
+void
+drdynvc_reset_state(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_num_dvchannels; i++)
+		if (g_dvchannels[i].open)
+			dvc_close(&g_dvchannels[i]);
+
+	g_dvc_version = 0;
+}
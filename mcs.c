@@ -422,6 +422,9 @@ mcs_connect(char *server, STREAM mcs_data, char *username, RD_BOOL reconnect)
 
 	for (i = 0; i < g_num_channels; i++)
 	{
+		if (g_channels[i].mcs_id == 0)
+			continue;
+
 		mcs_send_cjrq(g_channels[i].mcs_id);
 		if (!mcs_recv_cjcf())
 			goto error;
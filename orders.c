@@ -17,12 +17,25 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <time.h>
 #include "rdesktop.h"
 #include "orders.h"
 
 extern uint8 *g_next_packet;
 static RDP_ORDER_STATE g_order_state;
+static uint16 g_surface = OFFSCREEN_SCREEN;	/* where drawing orders go */
 extern RD_BOOL g_use_rdp5;
+extern RD_BOOL g_order_profile;
+extern char *g_order_record_file;
+extern int g_width;
+extern int g_height;
+extern int g_server_depth;
+
+static ORDER_PROFILE g_primary_profile[32];
+static ORDER_PROFILE g_secondary_profile[8];
+
+static FILE *g_order_record;
+static FILE *g_order_replay;
 
 /* Read field indicating which parameters are present */
 static void
@@ -91,13 +104,12 @@ parse_delta(uint8 * buffer, int *offset)
 static void
 rdp_in_colour(STREAM s, uint32 * colour)
 {
-	uint32 i;
-	in_uint8(s, i);
-	*colour = i;
-	in_uint8(s, i);
-	*colour |= i << 8;
-	in_uint8(s, i);
-	*colour |= i << 16;
+	uint16 low;
+	uint8 high;
+
+	in_uint16_le(s, low);
+	in_uint8(s, high);
+	*colour = low | (high << 16);
 }
 
 /* Parse bounds information */
@@ -147,33 +159,6 @@ rdp_parse_pen(STREAM s, PEN * pen, uint32 present)
 	return s_check(s);
 }
 
-static void
-setup_brush(BRUSH * out_brush, BRUSH * in_brush)
-{
-	BRUSHDATA *brush_data;
-	uint8 cache_idx;
-	uint8 colour_code;
-
-	memcpy(out_brush, in_brush, sizeof(BRUSH));
-	if (out_brush->style & 0x80)
-	{
-		colour_code = out_brush->style & 0x0f;
-		cache_idx = out_brush->pattern[0];
-		brush_data = cache_get_brush_data(colour_code, cache_idx);
-		if ((brush_data == NULL) || (brush_data->data == NULL))
-		{
-			error("error getting brush data, style %x\n", out_brush->style);
-			out_brush->bd = NULL;
-			memset(out_brush->pattern, 0, 8);
-		}
-		else
-		{
-			out_brush->bd = brush_data;
-		}
-		out_brush->style = 3;
-	}
-}
-
 /* Parse a brush */
 static RD_BOOL
 rdp_parse_brush(STREAM s, BRUSH * brush, uint32 present)
@@ -196,126 +181,209 @@ rdp_parse_brush(STREAM s, BRUSH * brush, uint32 present)
 	return s_check(s);
 }
 
-/* Process a destination blt order */
-static void
-process_destblt(STREAM s, DESTBLT_ORDER * os, uint32 present, RD_BOOL delta)
-{
-	if (present & 0x01)
-		rdp_in_coord(s, &os->x, delta);
+/* Readers for each kind of schema field */
+#define FIELD_PRESENT(bit)	(present & (1 << (bit)))
 
-	if (present & 0x02)
-		rdp_in_coord(s, &os->y, delta);
+#define PARSE_COORD(bit, member, delta) \
+	if (FIELD_PRESENT(bit)) \
+		rdp_in_coord(s, &os->member, delta);
 
-	if (present & 0x04)
-		rdp_in_coord(s, &os->cx, delta);
+#define PARSE_UINT8(bit, member, delta) \
+	if (FIELD_PRESENT(bit)) \
+	{ \
+		in_uint8(s, os->member); \
+	}
 
-	if (present & 0x08)
-		rdp_in_coord(s, &os->cy, delta);
+#define PARSE_UINT16(bit, member, delta) \
+	if (FIELD_PRESENT(bit)) \
+		in_uint16_le(s, os->member);
 
-	if (present & 0x10)
-		in_uint8(s, os->opcode);
+#define PARSE_UINT32(bit, member, delta) \
+	if (FIELD_PRESENT(bit)) \
+		in_uint32_le(s, os->member);
 
-	DEBUG(("DESTBLT(op=0x%x,x=%d,y=%d,cx=%d,cy=%d)\n",
-	       os->opcode, os->x, os->y, os->cx, os->cy));
+#define PARSE_COLOUR(bit, member, delta) \
+	if (FIELD_PRESENT(bit)) \
+		rdp_in_colour(s, &os->member);
 
-	ui_destblt(ROP2_S(os->opcode), os->x, os->y, os->cx, os->cy);
-}
+#define PARSE_COLOUR_BYTE(bit, member, shift) \
+	if (FIELD_PRESENT(bit)) \
+	{ \
+		uint8 byte; \
+		in_uint8(s, byte); \
+		os->member = (os->member & ~((uint32) 0xff << (shift))) | (byte << (shift)); \
+	}
 
-/* Process a pattern blt order */
-static void
-process_patblt(STREAM s, PATBLT_ORDER * os, uint32 present, RD_BOOL delta)
-{
-	BRUSH brush;
+#define PARSE_COLOUR_B0(bit, member, delta)	PARSE_COLOUR_BYTE(bit, member, 0)
+#define PARSE_COLOUR_B1(bit, member, delta)	PARSE_COLOUR_BYTE(bit, member, 8)
+#define PARSE_COLOUR_B2(bit, member, delta)	PARSE_COLOUR_BYTE(bit, member, 16)
 
-	if (present & 0x0001)
-		rdp_in_coord(s, &os->x, delta);
+#define PARSE_BRUSH(bit, member, delta) \
+	rdp_parse_brush(s, &os->member, present >> (bit));
 
-	if (present & 0x0002)
-		rdp_in_coord(s, &os->y, delta);
+#define PARSE_PEN(bit, member, delta) \
+	rdp_parse_pen(s, &os->member, present >> (bit));
 
-	if (present & 0x0004)
-		rdp_in_coord(s, &os->cx, delta);
+#define PARSE_DATA(bit, member, delta) \
+	if (FIELD_PRESENT(bit)) \
+	{ \
+		in_uint8(s, os->datasize); \
+		in_uint8a(s, os->data, os->datasize); \
+	}
 
-	if (present & 0x0008)
-		rdp_in_coord(s, &os->cy, delta);
+#define PARSE_TEXT(bit, member, delta) \
+	if (FIELD_PRESENT(bit)) \
+	{ \
+		in_uint8(s, os->length); \
+		in_uint8a(s, os->text, os->length); \
+	}
 
-	if (present & 0x0010)
-		in_uint8(s, os->opcode);
+#define PARSE_GLYPH(bit, member, delta)
+
+#define PARSE_ABSOLUTE(bit, kind, member)	PARSE_##kind(bit, member, False)
+#define PARSE_DELTA(bit, kind, member)		PARSE_##kind(bit, member, True)
+
+/* Generate parse_<name> from a schema. Each branch has the delta flag
+   as a constant, so the co-ordinate readers need not test it. */
+#define ORDER_PARSER(name, type, SCHEMA) \
+static void \
+parse_##name(STREAM s, type * os, uint32 present, RD_BOOL delta) \
+{ \
+	if (delta) \
+	{ \
+		SCHEMA(PARSE_DELTA) \
+	} \
+	else \
+	{ \
+		SCHEMA(PARSE_ABSOLUTE) \
+	} \
+}
 
-	if (present & 0x0020)
-		rdp_in_colour(s, &os->bgcolour);
+ORDER_PARSER(destblt, DESTBLT_ORDER, DESTBLT_SCHEMA)
+ORDER_PARSER(patblt, PATBLT_ORDER, PATBLT_SCHEMA)
+ORDER_PARSER(screenblt, SCREENBLT_ORDER, SCREENBLT_SCHEMA)
+ORDER_PARSER(line, LINE_ORDER, LINE_SCHEMA)
+ORDER_PARSER(rect, RECT_ORDER, RECT_SCHEMA)
+ORDER_PARSER(desksave, DESKSAVE_ORDER, DESKSAVE_SCHEMA)
+ORDER_PARSER(memblt, MEMBLT_ORDER, MEMBLT_SCHEMA)
+ORDER_PARSER(triblt, TRIBLT_ORDER, TRIBLT_SCHEMA)
+ORDER_PARSER(polygon, POLYGON_ORDER, POLYGON_SCHEMA)
+ORDER_PARSER(polygon2, POLYGON2_ORDER, POLYGON2_SCHEMA)
+ORDER_PARSER(polyline, POLYLINE_ORDER, POLYLINE_SCHEMA)
+ORDER_PARSER(ellipse, ELLIPSE_ORDER, ELLIPSE_SCHEMA)
+ORDER_PARSER(ellipse2, ELLIPSE2_ORDER, ELLIPSE2_SCHEMA)
+ORDER_PARSER(text2, TEXT2_ORDER, TEXT2_SCHEMA)
+ORDER_PARSER(fast_index, FAST_INDEX_ORDER, FAST_INDEX_SCHEMA)
+ORDER_PARSER(fast_glyph, FAST_INDEX_ORDER, FAST_GLYPH_SCHEMA)
+
+/* The schemas as data, indexed by order type */
+#define SCHEMA_FIELD(bit, kind, member)	{ #member, OF_##kind, bit },
+#define SCHEMA_BITS(bit, kind, member) \
+	| ((OF_##kind == OF_BRUSH ? 0x1f : OF_##kind == OF_PEN ? 0x07 : 0x01) << (bit))
+#define SCHEMA_PRESENT(SCHEMA)		(0 SCHEMA(SCHEMA_BITS))
+
+#define ORDER_FIELDS(name, SCHEMA) \
+static ORDER_FIELD g_##name##_fields[] = { SCHEMA(SCHEMA_FIELD) };
+
+ORDER_FIELDS(destblt, DESTBLT_SCHEMA)
+ORDER_FIELDS(patblt, PATBLT_SCHEMA)
+ORDER_FIELDS(screenblt, SCREENBLT_SCHEMA)
+ORDER_FIELDS(line, LINE_SCHEMA)
+ORDER_FIELDS(rect, RECT_SCHEMA)
+ORDER_FIELDS(desksave, DESKSAVE_SCHEMA)
+ORDER_FIELDS(memblt, MEMBLT_SCHEMA)
+ORDER_FIELDS(triblt, TRIBLT_SCHEMA)
+ORDER_FIELDS(polygon, POLYGON_SCHEMA)
+ORDER_FIELDS(polygon2, POLYGON2_SCHEMA)
+ORDER_FIELDS(polyline, POLYLINE_SCHEMA)
+ORDER_FIELDS(ellipse, ELLIPSE_SCHEMA)
+ORDER_FIELDS(ellipse2, ELLIPSE2_SCHEMA)
+ORDER_FIELDS(text2, TEXT2_SCHEMA)
+ORDER_FIELDS(fast_index, FAST_INDEX_SCHEMA)
+ORDER_FIELDS(fast_glyph, FAST_GLYPH_SCHEMA)
+
+#define ORDER_SCHEMA_ENTRY(name, SCHEMA) \
+	{ #name, SCHEMA_PRESENT(SCHEMA), \
+	  (SCHEMA_PRESENT(SCHEMA) > 0xffff) ? 3 : (SCHEMA_PRESENT(SCHEMA) > 0xff) ? 2 : 1, \
+	  g_##name##_fields, NUM_ELEMENTS(g_##name##_fields) }
+#define NO_SCHEMA	{ NULL, 0, 0, NULL, 0 }
+
+static ORDER_SCHEMA g_order_schema[32] = {
+	ORDER_SCHEMA_ENTRY(destblt, DESTBLT_SCHEMA),
+	ORDER_SCHEMA_ENTRY(patblt, PATBLT_SCHEMA),
+	ORDER_SCHEMA_ENTRY(screenblt, SCREENBLT_SCHEMA),
+	NO_SCHEMA, NO_SCHEMA, NO_SCHEMA, NO_SCHEMA, NO_SCHEMA, NO_SCHEMA,
+	ORDER_SCHEMA_ENTRY(line, LINE_SCHEMA),
+	ORDER_SCHEMA_ENTRY(rect, RECT_SCHEMA),
+	ORDER_SCHEMA_ENTRY(desksave, DESKSAVE_SCHEMA),
+	NO_SCHEMA,
+	ORDER_SCHEMA_ENTRY(memblt, MEMBLT_SCHEMA),
+	ORDER_SCHEMA_ENTRY(triblt, TRIBLT_SCHEMA),
+	NO_SCHEMA, NO_SCHEMA, NO_SCHEMA, NO_SCHEMA,
+	ORDER_SCHEMA_ENTRY(fast_index, FAST_INDEX_SCHEMA),
+	ORDER_SCHEMA_ENTRY(polygon, POLYGON_SCHEMA),
+	ORDER_SCHEMA_ENTRY(polygon2, POLYGON2_SCHEMA),
+	ORDER_SCHEMA_ENTRY(polyline, POLYLINE_SCHEMA),
+	NO_SCHEMA,
+	ORDER_SCHEMA_ENTRY(fast_glyph, FAST_GLYPH_SCHEMA),
+	ORDER_SCHEMA_ENTRY(ellipse, ELLIPSE_SCHEMA),
+	ORDER_SCHEMA_ENTRY(ellipse2, ELLIPSE2_SCHEMA),
+	ORDER_SCHEMA_ENTRY(text2, TEXT2_SCHEMA),
+	NO_SCHEMA, NO_SCHEMA, NO_SCHEMA, NO_SCHEMA
+};
+
+/* The fields of a primary order type, or NULL if it is not supported */
+ORDER_SCHEMA *
+order_get_schema(uint8 type)
+{
+	if ((type >= NUM_ELEMENTS(g_order_schema)) || (g_order_schema[type].name == NULL))
+		return NULL;
 
-	if (present & 0x0040)
-		rdp_in_colour(s, &os->fgcolour);
+	return &g_order_schema[type];
+}
 
-	rdp_parse_brush(s, &os->brush, present >> 7);
+/* Process a destination blt order */
+static void
+process_destblt(STREAM s, DESTBLT_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	parse_destblt(s, os, present, delta);
+
+	DEBUG(("DESTBLT(op=0x%x,x=%d,y=%d,cx=%d,cy=%d)\n",
+	       os->opcode, os->x, os->y, os->cx, os->cy));
+
+	dlist_destblt(ROP2_S(os->opcode), os->x, os->y, os->cx, os->cy);
+}
+
+/* Process a pattern blt order */
+static void
+process_patblt(STREAM s, PATBLT_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	parse_patblt(s, os, present, delta);
 
 	DEBUG(("PATBLT(op=0x%x,x=%d,y=%d,cx=%d,cy=%d,bs=%d,bg=0x%x,fg=0x%x)\n", os->opcode, os->x,
 	       os->y, os->cx, os->cy, os->brush.style, os->bgcolour, os->fgcolour));
 
-	setup_brush(&brush, &os->brush);
-
-	ui_patblt(ROP2_P(os->opcode), os->x, os->y, os->cx, os->cy,
-		  &brush, os->bgcolour, os->fgcolour);
+	dlist_patblt(ROP2_P(os->opcode), os->x, os->y, os->cx, os->cy,
+		     &os->brush, os->bgcolour, os->fgcolour);
 }
 
 /* Process a screen blt order */
 static void
 process_screenblt(STREAM s, SCREENBLT_ORDER * os, uint32 present, RD_BOOL delta)
 {
-	if (present & 0x0001)
-		rdp_in_coord(s, &os->x, delta);
-
-	if (present & 0x0002)
-		rdp_in_coord(s, &os->y, delta);
-
-	if (present & 0x0004)
-		rdp_in_coord(s, &os->cx, delta);
-
-	if (present & 0x0008)
-		rdp_in_coord(s, &os->cy, delta);
-
-	if (present & 0x0010)
-		in_uint8(s, os->opcode);
-
-	if (present & 0x0020)
-		rdp_in_coord(s, &os->srcx, delta);
-
-	if (present & 0x0040)
-		rdp_in_coord(s, &os->srcy, delta);
+	parse_screenblt(s, os, present, delta);
 
 	DEBUG(("SCREENBLT(op=0x%x,x=%d,y=%d,cx=%d,cy=%d,srcx=%d,srcy=%d)\n",
 	       os->opcode, os->x, os->y, os->cx, os->cy, os->srcx, os->srcy));
 
-	ui_screenblt(ROP2_S(os->opcode), os->x, os->y, os->cx, os->cy, os->srcx, os->srcy);
+	dlist_screenblt(ROP2_S(os->opcode), os->x, os->y, os->cx, os->cy, os->srcx, os->srcy);
 }
 
 /* Process a line order */
 static void
 process_line(STREAM s, LINE_ORDER * os, uint32 present, RD_BOOL delta)
 {
-	if (present & 0x0001)
-		in_uint16_le(s, os->mixmode);
-
-	if (present & 0x0002)
-		rdp_in_coord(s, &os->startx, delta);
-
-	if (present & 0x0004)
-		rdp_in_coord(s, &os->starty, delta);
-
-	if (present & 0x0008)
-		rdp_in_coord(s, &os->endx, delta);
-
-	if (present & 0x0010)
-		rdp_in_coord(s, &os->endy, delta);
-
-	if (present & 0x0020)
-		rdp_in_colour(s, &os->bgcolour);
-
-	if (present & 0x0040)
-		in_uint8(s, os->opcode);
-
-	rdp_parse_pen(s, &os->pen, present >> 7);
+	parse_line(s, os, present, delta);
 
 	DEBUG(("LINE(op=0x%x,sx=%d,sy=%d,dx=%d,dy=%d,fg=0x%x)\n",
 	       os->opcode, os->startx, os->starty, os->endx, os->endy, os->pen.colour));
@@ -326,47 +394,18 @@ process_line(STREAM s, LINE_ORDER * os, uint32 present, RD_BOOL delta)
 		return;
 	}
 
-	ui_line(os->opcode - 1, os->startx, os->starty, os->endx, os->endy, &os->pen);
+	dlist_line(os->opcode - 1, os->startx, os->starty, os->endx, os->endy, &os->pen);
 }
 
 /* Process an opaque rectangle order */
 static void
 process_rect(STREAM s, RECT_ORDER * os, uint32 present, RD_BOOL delta)
 {
-	uint32 i;
-	if (present & 0x01)
-		rdp_in_coord(s, &os->x, delta);
-
-	if (present & 0x02)
-		rdp_in_coord(s, &os->y, delta);
-
-	if (present & 0x04)
-		rdp_in_coord(s, &os->cx, delta);
-
-	if (present & 0x08)
-		rdp_in_coord(s, &os->cy, delta);
-
-	if (present & 0x10)
-	{
-		in_uint8(s, i);
-		os->colour = (os->colour & 0xffffff00) | i;
-	}
-
-	if (present & 0x20)
-	{
-		in_uint8(s, i);
-		os->colour = (os->colour & 0xffff00ff) | (i << 8);
-	}
-
-	if (present & 0x40)
-	{
-		in_uint8(s, i);
-		os->colour = (os->colour & 0xff00ffff) | (i << 16);
-	}
+	parse_rect(s, os, present, delta);
 
 	DEBUG(("RECT(x=%d,y=%d,cx=%d,cy=%d,fg=0x%x)\n", os->x, os->y, os->cx, os->cy, os->colour));
 
-	ui_rect(os->x, os->y, os->cx, os->cy, os->colour);
+	dlist_rect(os->x, os->y, os->cx, os->cy, os->colour);
 }
 
 /* Process a desktop save order */
@@ -375,23 +414,7 @@ process_desksave(STREAM s, DESKSAVE_ORDER * os, uint32 present, RD_BOOL delta)
 {
 	int width, height;
 
-	if (present & 0x01)
-		in_uint32_le(s, os->offset);
-
-	if (present & 0x02)
-		rdp_in_coord(s, &os->left, delta);
-
-	if (present & 0x04)
-		rdp_in_coord(s, &os->top, delta);
-
-	if (present & 0x08)
-		rdp_in_coord(s, &os->right, delta);
-
-	if (present & 0x10)
-		rdp_in_coord(s, &os->bottom, delta);
-
-	if (present & 0x20)
-		in_uint8(s, os->action);
+	parse_desksave(s, os, present, delta);
 
 	DEBUG(("DESKSAVE(l=%d,t=%d,r=%d,b=%d,off=%d,op=%d)\n",
 	       os->left, os->top, os->right, os->bottom, os->offset, os->action));
@@ -400,117 +423,36 @@ process_desksave(STREAM s, DESKSAVE_ORDER * os, uint32 present, RD_BOOL delta)
 	height = os->bottom - os->top + 1;
 
 	if (os->action == 0)
-		ui_desktop_save(os->offset, os->left, os->top, width, height);
+		dlist_desktop_save(os->offset, os->left, os->top, width, height);
 	else
-		ui_desktop_restore(os->offset, os->left, os->top, width, height);
+		dlist_desktop_restore(os->offset, os->left, os->top, width, height);
 }
 
 /* Process a memory blt order */
 static void
 process_memblt(STREAM s, MEMBLT_ORDER * os, uint32 present, RD_BOOL delta)
 {
-	RD_HBITMAP bitmap;
-
-	if (present & 0x0001)
-	{
-		in_uint8(s, os->cache_id);
-		in_uint8(s, os->colour_table);
-	}
-
-	if (present & 0x0002)
-		rdp_in_coord(s, &os->x, delta);
-
-	if (present & 0x0004)
-		rdp_in_coord(s, &os->y, delta);
-
-	if (present & 0x0008)
-		rdp_in_coord(s, &os->cx, delta);
-
-	if (present & 0x0010)
-		rdp_in_coord(s, &os->cy, delta);
-
-	if (present & 0x0020)
-		in_uint8(s, os->opcode);
-
-	if (present & 0x0040)
-		rdp_in_coord(s, &os->srcx, delta);
-
-	if (present & 0x0080)
-		rdp_in_coord(s, &os->srcy, delta);
-
-	if (present & 0x0100)
-		in_uint16_le(s, os->cache_idx);
+	parse_memblt(s, os, present, delta);
 
 	DEBUG(("MEMBLT(op=0x%x,x=%d,y=%d,cx=%d,cy=%d,id=%d,idx=%d)\n",
 	       os->opcode, os->x, os->y, os->cx, os->cy, os->cache_id, os->cache_idx));
 
-	bitmap = cache_get_bitmap(os->cache_id, os->cache_idx);
-	if (bitmap == NULL)
-		return;
-
-	ui_memblt(ROP2_S(os->opcode), os->x, os->y, os->cx, os->cy, bitmap, os->srcx, os->srcy);
+	dlist_memblt(ROP2_S(os->opcode), os->x, os->y, os->cx, os->cy, os->cache_id,
+		     os->cache_idx, os->srcx, os->srcy);
 }
 
 /* Process a 3-way blt order */
 static void
 process_triblt(STREAM s, TRIBLT_ORDER * os, uint32 present, RD_BOOL delta)
 {
-	RD_HBITMAP bitmap;
-	BRUSH brush;
-
-	if (present & 0x000001)
-	{
-		in_uint8(s, os->cache_id);
-		in_uint8(s, os->colour_table);
-	}
-
-	if (present & 0x000002)
-		rdp_in_coord(s, &os->x, delta);
-
-	if (present & 0x000004)
-		rdp_in_coord(s, &os->y, delta);
-
-	if (present & 0x000008)
-		rdp_in_coord(s, &os->cx, delta);
-
-	if (present & 0x000010)
-		rdp_in_coord(s, &os->cy, delta);
-
-	if (present & 0x000020)
-		in_uint8(s, os->opcode);
-
-	if (present & 0x000040)
-		rdp_in_coord(s, &os->srcx, delta);
-
-	if (present & 0x000080)
-		rdp_in_coord(s, &os->srcy, delta);
-
-	if (present & 0x000100)
-		rdp_in_colour(s, &os->bgcolour);
-
-	if (present & 0x000200)
-		rdp_in_colour(s, &os->fgcolour);
-
-	rdp_parse_brush(s, &os->brush, present >> 10);
-
-	if (present & 0x008000)
-		in_uint16_le(s, os->cache_idx);
-
-	if (present & 0x010000)
-		in_uint16_le(s, os->unknown);
+	parse_triblt(s, os, present, delta);
 
 	DEBUG(("TRIBLT(op=0x%x,x=%d,y=%d,cx=%d,cy=%d,id=%d,idx=%d,bs=%d,bg=0x%x,fg=0x%x)\n",
 	       os->opcode, os->x, os->y, os->cx, os->cy, os->cache_id, os->cache_idx,
 	       os->brush.style, os->bgcolour, os->fgcolour));
 
-	bitmap = cache_get_bitmap(os->cache_id, os->cache_idx);
-	if (bitmap == NULL)
-		return;
-
-	setup_brush(&brush, &os->brush);
-
-	ui_triblt(os->opcode, os->x, os->y, os->cx, os->cy,
-		  bitmap, os->srcx, os->srcy, &brush, os->bgcolour, os->fgcolour);
+	dlist_triblt(os->opcode, os->x, os->y, os->cx, os->cy, os->cache_id, os->cache_idx,
+		     os->srcx, os->srcy, &os->brush, os->bgcolour, os->fgcolour);
 }
 
 /* Process a polygon order */
@@ -521,29 +463,7 @@ process_polygon(STREAM s, POLYGON_ORDER * os, uint32 present, RD_BOOL delta)
 	uint8 flags = 0;
 	RD_POINT *points;
 
-	if (present & 0x01)
-		rdp_in_coord(s, &os->x, delta);
-
-	if (present & 0x02)
-		rdp_in_coord(s, &os->y, delta);
-
-	if (present & 0x04)
-		in_uint8(s, os->opcode);
-
-	if (present & 0x08)
-		in_uint8(s, os->fillmode);
-
-	if (present & 0x10)
-		rdp_in_colour(s, &os->fgcolour);
-
-	if (present & 0x20)
-		in_uint8(s, os->npoints);
-
-	if (present & 0x40)
-	{
-		in_uint8(s, os->datasize);
-		in_uint8a(s, os->data, os->datasize);
-	}
+	parse_polygon(s, os, present, delta);
 
 	DEBUG(("POLYGON(x=%d,y=%d,op=0x%x,fm=%d,fg=0x%x,n=%d,sz=%d)\n",
 	       os->x, os->y, os->opcode, os->fillmode, os->fgcolour, os->npoints, os->datasize));
@@ -584,8 +504,8 @@ process_polygon(STREAM s, POLYGON_ORDER * os, uint32 present, RD_BOOL delta)
 	}
 
 	if (next - 1 == os->npoints)
-		ui_polygon(os->opcode - 1, os->fillmode, points, os->npoints + 1, NULL, 0,
-			   os->fgcolour);
+		dlist_polygon(os->opcode - 1, os->fillmode, points, os->npoints + 1, NULL, 0,
+			      os->fgcolour);
 	else
 		error("polygon parse error\n");
 
@@ -599,36 +519,8 @@ process_polygon2(STREAM s, POLYGON2_ORDER * os, uint32 present, RD_BOOL delta)
 	int index, data, next;
 	uint8 flags = 0;
 	RD_POINT *points;
-	BRUSH brush;
-
-	if (present & 0x0001)
-		rdp_in_coord(s, &os->x, delta);
-
-	if (present & 0x0002)
-		rdp_in_coord(s, &os->y, delta);
-
-	if (present & 0x0004)
-		in_uint8(s, os->opcode);
-
-	if (present & 0x0008)
-		in_uint8(s, os->fillmode);
 
-	if (present & 0x0010)
-		rdp_in_colour(s, &os->bgcolour);
-
-	if (present & 0x0020)
-		rdp_in_colour(s, &os->fgcolour);
-
-	rdp_parse_brush(s, &os->brush, present >> 6);
-
-	if (present & 0x0800)
-		in_uint8(s, os->npoints);
-
-	if (present & 0x1000)
-	{
-		in_uint8(s, os->datasize);
-		in_uint8a(s, os->data, os->datasize);
-	}
+	parse_polygon2(s, os, present, delta);
 
 	DEBUG(("POLYGON2(x=%d,y=%d,op=0x%x,fm=%d,bs=%d,bg=0x%x,fg=0x%x,n=%d,sz=%d)\n",
 	       os->x, os->y, os->opcode, os->fillmode, os->brush.style, os->bgcolour, os->fgcolour,
@@ -647,8 +539,6 @@ process_polygon2(STREAM s, POLYGON2_ORDER * os, uint32 present, RD_BOOL delta)
 		return;
 	}
 
-	setup_brush(&brush, &os->brush);
-
 	points = (RD_POINT *) xmalloc((os->npoints + 1) * sizeof(RD_POINT));
 	memset(points, 0, (os->npoints + 1) * sizeof(RD_POINT));
 
@@ -672,8 +562,8 @@ process_polygon2(STREAM s, POLYGON2_ORDER * os, uint32 present, RD_BOOL delta)
 	}
 
 	if (next - 1 == os->npoints)
-		ui_polygon(os->opcode - 1, os->fillmode, points, os->npoints + 1,
-			   &brush, os->bgcolour, os->fgcolour);
+		dlist_polygon(os->opcode - 1, os->fillmode, points, os->npoints + 1,
+			      &os->brush, os->bgcolour, os->fgcolour);
 	else
 		error("polygon2 parse error\n");
 
@@ -689,26 +579,7 @@ process_polyline(STREAM s, POLYLINE_ORDER * os, uint32 present, RD_BOOL delta)
 	PEN pen;
 	RD_POINT *points;
 
-	if (present & 0x01)
-		rdp_in_coord(s, &os->x, delta);
-
-	if (present & 0x02)
-		rdp_in_coord(s, &os->y, delta);
-
-	if (present & 0x04)
-		in_uint8(s, os->opcode);
-
-	if (present & 0x10)
-		rdp_in_colour(s, &os->fgcolour);
-
-	if (present & 0x20)
-		in_uint8(s, os->lines);
-
-	if (present & 0x40)
-	{
-		in_uint8(s, os->datasize);
-		in_uint8a(s, os->data, os->datasize);
-	}
+	parse_polyline(s, os, present, delta);
 
 	DEBUG(("POLYLINE(x=%d,y=%d,op=0x%x,fg=0x%x,n=%d,sz=%d)\n",
 	       os->x, os->y, os->opcode, os->fgcolour, os->lines, os->datasize));
@@ -751,7 +622,7 @@ process_polyline(STREAM s, POLYLINE_ORDER * os, uint32 present, RD_BOOL delta)
 	}
 
 	if (next - 1 == os->lines)
-		ui_polyline(os->opcode - 1, points, os->lines + 1, &pen);
+		dlist_polyline(os->opcode - 1, points, os->lines + 1, &pen);
 	else
 		error("polyline parse error\n");
 
@@ -762,155 +633,207 @@ process_polyline(STREAM s, POLYLINE_ORDER * os, uint32 present, RD_BOOL delta)
 static void
 process_ellipse(STREAM s, ELLIPSE_ORDER * os, uint32 present, RD_BOOL delta)
 {
-	if (present & 0x01)
-		rdp_in_coord(s, &os->left, delta);
-
-	if (present & 0x02)
-		rdp_in_coord(s, &os->top, delta);
-
-	if (present & 0x04)
-		rdp_in_coord(s, &os->right, delta);
-
-	if (present & 0x08)
-		rdp_in_coord(s, &os->bottom, delta);
-
-	if (present & 0x10)
-		in_uint8(s, os->opcode);
-
-	if (present & 0x20)
-		in_uint8(s, os->fillmode);
-
-	if (present & 0x40)
-		rdp_in_colour(s, &os->fgcolour);
+	parse_ellipse(s, os, present, delta);
 
 	DEBUG(("ELLIPSE(l=%d,t=%d,r=%d,b=%d,op=0x%x,fm=%d,fg=0x%x)\n", os->left, os->top,
 	       os->right, os->bottom, os->opcode, os->fillmode, os->fgcolour));
 
-	ui_ellipse(os->opcode - 1, os->fillmode, os->left, os->top, os->right - os->left,
-		   os->bottom - os->top, NULL, 0, os->fgcolour);
+	dlist_ellipse(os->opcode - 1, os->fillmode, os->left, os->top, os->right - os->left,
+		      os->bottom - os->top, NULL, 0, os->fgcolour);
 }
 
 /* Process an ellipse2 order */
 static void
 process_ellipse2(STREAM s, ELLIPSE2_ORDER * os, uint32 present, RD_BOOL delta)
 {
-	BRUSH brush;
-
-	if (present & 0x0001)
-		rdp_in_coord(s, &os->left, delta);
-
-	if (present & 0x0002)
-		rdp_in_coord(s, &os->top, delta);
-
-	if (present & 0x0004)
-		rdp_in_coord(s, &os->right, delta);
+	parse_ellipse2(s, os, present, delta);
 
-	if (present & 0x0008)
-		rdp_in_coord(s, &os->bottom, delta);
+	DEBUG(("ELLIPSE2(l=%d,t=%d,r=%d,b=%d,op=0x%x,fm=%d,bs=%d,bg=0x%x,fg=0x%x)\n",
+	       os->left, os->top, os->right, os->bottom, os->opcode, os->fillmode, os->brush.style,
+	       os->bgcolour, os->fgcolour));
 
-	if (present & 0x0010)
-		in_uint8(s, os->opcode);
+	dlist_ellipse(os->opcode - 1, os->fillmode, os->left, os->top, os->right - os->left,
+		      os->bottom - os->top, &os->brush, os->bgcolour, os->fgcolour);
+}
 
-	if (present & 0x0020)
-		in_uint8(s, os->fillmode);
+/* Process a text order */
+static void
+process_text2(STREAM s, TEXT2_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	int i;
 
-	if (present & 0x0040)
-		rdp_in_colour(s, &os->bgcolour);
+	parse_text2(s, os, present, delta);
 
-	if (present & 0x0080)
-		rdp_in_colour(s, &os->fgcolour);
+	DEBUG(("TEXT2(x=%d,y=%d,cl=%d,ct=%d,cr=%d,cb=%d,bl=%d,bt=%d,br=%d,bb=%d,bs=%d,bg=0x%x,fg=0x%x,font=%d,fl=0x%x,op=0x%x,mix=%d,n=%d)\n", os->x, os->y, os->clipleft, os->cliptop, os->clipright, os->clipbottom, os->boxleft, os->boxtop, os->boxright, os->boxbottom, os->brush.style, os->bgcolour, os->fgcolour, os->font, os->flags, os->opcode, os->mixmode, os->length));
 
-	rdp_parse_brush(s, &os->brush, present >> 8);
+	DEBUG(("Text: "));
 
-	DEBUG(("ELLIPSE2(l=%d,t=%d,r=%d,b=%d,op=0x%x,fm=%d,bs=%d,bg=0x%x,fg=0x%x)\n",
-	       os->left, os->top, os->right, os->bottom, os->opcode, os->fillmode, os->brush.style,
-	       os->bgcolour, os->fgcolour));
+	for (i = 0; i < os->length; i++)
+		DEBUG(("%02x ", os->text[i]));
 
-	setup_brush(&brush, &os->brush);
+	DEBUG(("\n"));
 
-	ui_ellipse(os->opcode - 1, os->fillmode, os->left, os->top, os->right - os->left,
-		   os->bottom - os->top, &brush, os->bgcolour, os->fgcolour);
+	dlist_draw_text(os->font, os->flags, os->opcode - 1, os->mixmode, os->x, os->y,
+			os->clipleft, os->cliptop, os->clipright - os->clipleft,
+			os->clipbottom - os->cliptop, os->boxleft, os->boxtop,
+			os->boxright - os->boxleft, os->boxbottom - os->boxtop,
+			&os->brush, os->bgcolour, os->fgcolour, os->text, os->length);
 }
 
-/* Process a text order */
+/* Draw a FAST_INDEX or FAST_GLYPH order. Parts of the opaque box and
+   the origin that are left out default to the background box. */
 static void
-process_text2(STREAM s, TEXT2_ORDER * os, uint32 present, RD_BOOL delta)
+draw_fast_text(FAST_INDEX_ORDER * os, uint8 * text, uint8 length)
 {
-	int i;
-	BRUSH brush;
+	sint16 boxleft = os->boxleft, boxtop = os->boxtop;
+	sint16 boxright = os->boxright, boxbottom = os->boxbottom;
+	sint16 x = os->x, y = os->y;
 
-	if (present & 0x000001)
-		in_uint8(s, os->font);
+	if (boxbottom == -32768)
+	{
+		/* boxtop says which sides are those of the background box */
+		if (boxtop & 0x01)
+			boxbottom = os->clipbottom;
+		if (boxtop & 0x02)
+			boxright = os->clipright;
+		if (boxtop & 0x08)
+			boxleft = os->clipleft;
+		boxtop = (boxtop & 0x04) ? os->cliptop : 0;
+	}
 
-	if (present & 0x000002)
-		in_uint8(s, os->flags);
+	if (boxleft == 0)
+		boxleft = os->clipleft;
 
-	if (present & 0x000004)
-		in_uint8(s, os->opcode);
+	if (boxright == 0)
+		boxright = os->clipright;
 
-	if (present & 0x000008)
-		in_uint8(s, os->mixmode);
+	/* ui_draw_text leaves out boxes that are not wider than 1 */
+	if ((boxright < boxleft) || (boxbottom < boxtop))
+		boxright = boxleft;
 
-	if (present & 0x000010)
-		rdp_in_colour(s, &os->fgcolour);
+	if (x == -32768)
+		x = os->clipleft;
 
-	if (present & 0x000020)
-		rdp_in_colour(s, &os->bgcolour);
+	if (y == -32768)
+		y = os->cliptop;
 
-	if (present & 0x000040)
-		in_uint16_le(s, os->clipleft);
+	dlist_draw_text(os->font, os->flags, ROP2_COPY, MIX_TRANSPARENT, x, y,
+			os->clipleft, os->cliptop, os->clipright - os->clipleft,
+			os->clipbottom - os->cliptop, boxleft, boxtop,
+			boxright - boxleft, boxbottom - boxtop,
+			NULL, os->bgcolour, os->fgcolour, text, length);
+}
 
-	if (present & 0x000080)
-		in_uint16_le(s, os->cliptop);
+/* Process a fast index order, TEXT2 without brush and with short fields */
+static void
+process_fast_index(STREAM s, FAST_INDEX_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	parse_fast_index(s, os, present, delta);
 
-	if (present & 0x000100)
-		in_uint16_le(s, os->clipright);
+	DEBUG(("FAST_INDEX(x=%d,y=%d,cl=%d,ct=%d,cr=%d,cb=%d,bl=%d,bt=%d,br=%d,bb=%d,bg=0x%x,fg=0x%x,font=%d,fl=0x%x,n=%d)\n", os->x, os->y, os->clipleft, os->cliptop, os->clipright, os->clipbottom, os->boxleft, os->boxtop, os->boxright, os->boxbottom, os->bgcolour, os->fgcolour, os->font, os->flags, os->length));
 
-	if (present & 0x000200)
-		in_uint16_le(s, os->clipbottom);
+	draw_fast_text(os, os->text, os->length);
+}
 
-	if (present & 0x000400)
-		in_uint16_le(s, os->boxleft);
+/* Read a value stored in one byte, or two if the top bit is set */
+static uint16
+rdp_in_2byte_unsigned(STREAM s)
+{
+	uint8 byte;
+	uint16 value;
 
-	if (present & 0x000800)
-		in_uint16_le(s, os->boxtop);
+	in_uint8(s, byte);
+	value = byte & 0x7f;
+	if (byte & 0x80)
+	{
+		in_uint8(s, byte);
+		value = (value << 8) | byte;
+	}
 
-	if (present & 0x001000)
-		in_uint16_le(s, os->boxright);
+	return value;
+}
 
-	if (present & 0x002000)
-		in_uint16_le(s, os->boxbottom);
+/* The same with the next bit as sign */
+static sint16
+rdp_in_2byte_signed(STREAM s)
+{
+	uint8 first, byte;
+	sint16 value;
 
-	rdp_parse_brush(s, &os->brush, present >> 14);
+	in_uint8(s, first);
+	value = first & 0x3f;
+	if (first & 0x80)
+	{
+		in_uint8(s, byte);
+		value = (value << 8) | byte;
+	}
 
-	if (present & 0x080000)
-		in_uint16_le(s, os->x);
+	return (first & 0x40) ? -value : value;
+}
+
+/* Read a glyph in the compact form of glyph cache rev2 and fast glyph
+   orders, and put it in the cache */
+static void
+process_glyph2(STREAM s, uint8 font, uint8 character)
+{
+	RD_HGLYPH bitmap;
+	sint16 offset, baseline;
+	uint16 width, height;
+	int datasize;
+	uint8 *data;
 
-	if (present & 0x100000)
-		in_uint16_le(s, os->y);
+	offset = rdp_in_2byte_signed(s);
+	baseline = rdp_in_2byte_signed(s);
+	width = rdp_in_2byte_unsigned(s);
+	height = rdp_in_2byte_unsigned(s);
 
-	if (present & 0x200000)
+	datasize = (height * ((width + 7) / 8) + 3) & ~3;
+	in_uint8p(s, data, datasize);
+
+	if (font >= GLYPH_CACHE_FONTS)
 	{
-		in_uint8(s, os->length);
-		in_uint8a(s, os->text, os->length);
+		error("put font %d:%d\n", font, character);
+		return;
 	}
 
-	DEBUG(("TEXT2(x=%d,y=%d,cl=%d,ct=%d,cr=%d,cb=%d,bl=%d,bt=%d,br=%d,bb=%d,bs=%d,bg=0x%x,fg=0x%x,font=%d,fl=0x%x,op=0x%x,mix=%d,n=%d)\n", os->x, os->y, os->clipleft, os->cliptop, os->clipright, os->clipbottom, os->boxleft, os->boxtop, os->boxright, os->boxbottom, os->brush.style, os->bgcolour, os->fgcolour, os->font, os->flags, os->opcode, os->mixmode, os->length));
+	bitmap = ui_create_font_glyph(font, offset, baseline, width, height, data);
+	cache_put_font(font, character, offset, baseline, width, height, bitmap);
+}
 
-	DEBUG(("Text: "));
+/* Process a fast glyph order, which may define the glyph it draws */
+static void
+process_fast_glyph(STREAM s, FAST_INDEX_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	uint8 *next;
 
-	for (i = 0; i < os->length; i++)
-		DEBUG(("%02x ", os->text[i]));
+	parse_fast_glyph(s, os, present, delta);
 
-	DEBUG(("\n"));
+	/* the GLYPH field of the schema */
+	if (present & 0x4000)
+	{
+		in_uint8(s, os->length);
+		next = s->p + os->length;
+		if (os->length > 0)
+		{
+			in_uint8(s, os->text[0]);
+			if (os->length > 1)
+			{
+				/* recorded text may use the glyph this replaces */
+				dlist_flush();
+				process_glyph2(s, os->font, os->text[0]);
+			}
+		}
+		s->p = next;
+	}
 
-	setup_brush(&brush, &os->brush);
+	DEBUG(("FAST_GLYPH(x=%d,y=%d,cl=%d,ct=%d,cr=%d,cb=%d,bl=%d,bt=%d,br=%d,bb=%d,bg=0x%x,fg=0x%x,font=%d,fl=0x%x,glyph=%d)\n", os->x, os->y, os->clipleft, os->cliptop, os->clipright, os->clipbottom, os->boxleft, os->boxtop, os->boxright, os->boxbottom, os->bgcolour, os->fgcolour, os->font, os->flags, os->text[0]));
 
-	ui_draw_text(os->font, os->flags, os->opcode - 1, os->mixmode, os->x, os->y,
-		     os->clipleft, os->cliptop, os->clipright - os->clipleft,
-		     os->clipbottom - os->cliptop, os->boxleft, os->boxtop,
-		     os->boxright - os->boxleft, os->boxbottom - os->boxtop,
-		     &brush, os->bgcolour, os->fgcolour, os->text, os->length);
+	if (os->length == 0)
+		return;
+
+	/* one glyph, with a zero offset unless the advance is implicit */
+	os->text[1] = 0;
+	draw_fast_text(os, os->text, (os->flags & TEXT2_IMPLICIT_X) ? 1 : 2);
 }
 
 /* Process a raw bitmap cache order */
@@ -1142,11 +1065,38 @@ process_fontcache(STREAM s)
 		datasize = (height * ((width + 7) / 8) + 3) & ~3;
 		in_uint8p(s, data, datasize);
 
-		bitmap = ui_create_glyph(width, height, data);
+		bitmap = ui_create_font_glyph(font, (sint16) offset, (sint16) baseline, width,
+					      height, data);
 		cache_put_font(font, character, offset, baseline, width, height, bitmap);
 	}
 }
 
+/* Process a glyph cache rev2 order, used when we ask for GLYPH_SUPPORT_ENCODE */
+static void
+process_fontcache2(STREAM s, uint16 flags)
+{
+	uint8 font, nglyphs, character;
+	int i;
+
+	font = flags & 0x0f;
+	nglyphs = flags >> 8;
+
+	DEBUG(("FONTCACHE2(font=%d,n=%d)\n", font, nglyphs));
+
+	/* the glyphs are dropped, and the order length skips them */
+	if (font >= GLYPH_CACHE_FONTS)
+	{
+		error("put font %d\n", font);
+		return;
+	}
+
+	for (i = 0; i < nglyphs; i++)
+	{
+		in_uint8(s, character);
+		process_glyph2(s, font, character);
+	}
+}
+
 static void
 process_compressed_8x8_brush_data(uint8 * in, uint8 * out, int Bpp)
 {
@@ -1185,6 +1135,7 @@ static void
 process_brushcache(STREAM s, uint16 flags)
 {
 	BRUSHDATA brush_data;
+	uint8 data[BRUSH_DATA_SIZE];
 	uint8 cache_idx, colour_code, width, height, size, type;
 	uint8 *comp_brush;
 	int index;
@@ -1205,7 +1156,7 @@ process_brushcache(STREAM s, uint16 flags)
 		{
 			brush_data.colour_code = 1;
 			brush_data.data_size = 8;
-			brush_data.data = xmalloc(8);
+			brush_data.data = data;
 			if (size == 8)
 			{
 				/* read it bottom up */
@@ -1226,7 +1177,7 @@ process_brushcache(STREAM s, uint16 flags)
 			Bpp = colour_code - 2;
 			brush_data.colour_code = colour_code;
 			brush_data.data_size = 8 * 8 * Bpp;
-			brush_data.data = xmalloc(8 * 8 * Bpp);
+			brush_data.data = data;
 			if (size == 16 + 4 * Bpp)
 			{
 				in_uint8p(s, comp_brush, 16 + 4 * Bpp);
@@ -1249,6 +1200,14 @@ process_brushcache(STREAM s, uint16 flags)
 	}
 }
 
+static void
+profile_decode(ORDER_PROFILE * profile, double start, int bytes)
+{
+	profile->count++;
+	profile->bytes += bytes;
+	profile->decode += order_profile_clock() - start;
+}
+
 /* Process a secondary order */
 static void
 process_secondary_order(STREAM s)
@@ -1260,6 +1219,10 @@ process_secondary_order(STREAM s)
 	uint16 flags;
 	uint8 type;
 	uint8 *next_order;
+	double start = 0;
+
+	if (g_order_profile)
+		start = order_profile_clock();
 
 	in_uint16_le(s, length);
 	in_uint16_le(s, flags);	/* used by bmpcache2 */
@@ -1282,7 +1245,10 @@ process_secondary_order(STREAM s)
 			break;
 
 		case RDP_ORDER_FONTCACHE:
-			process_fontcache(s);
+			if (g_use_rdp5)
+				process_fontcache2(s, flags);
+			else
+				process_fontcache(s);
 			break;
 
 		case RDP_ORDER_RAW_BMPCACHE2:
@@ -1299,61 +1265,203 @@ process_secondary_order(STREAM s)
 
 		default:
 			unimpl("secondary order %d\n", type);
+			s->p = next_order;
+			return;
 	}
 
+	/* includes creating the bitmaps and glyphs in the ui */
+	if (g_order_profile)
+		profile_decode(&g_secondary_profile[type], start, (sint16) length + 13);
 	s->p = next_order;
 }
 
+/* Send drawing orders to an offscreen bitmap, or to the screen */
+static void
+set_surface(uint16 id)
+{
+	RD_HBITMAP bitmap = NULL;
+
+	if (id != OFFSCREEN_SCREEN)
+	{
+		bitmap = cache_get_offscreen(id);
+		if (bitmap == NULL)
+			return;
+	}
+
+	ui_set_surface(bitmap);
+	g_surface = id;
+}
+
+/* Replace or remove an offscreen bitmap, leaving it first if it is
+   being drawn on */
+static void
+put_offscreen(uint16 id, RD_HBITMAP bitmap)
+{
+	if (id == g_surface)
+		set_surface(OFFSCREEN_SCREEN);
+
+	cache_put_offscreen(id, bitmap);
+}
+
+/* Process a switch surface order */
+static void
+process_switch_surface(STREAM s)
+{
+	uint16 id;
+
+	in_uint16_le(s, id);
+
+	DEBUG(("SWITCH_SURFACE(id=%d)\n", id));
+
+	set_surface(id);
+}
+
+/* Process a create offscreen bitmap order */
+static void
+process_create_offscreen(STREAM s)
+{
+	uint16 flags, id, cx, cy, count, idx, i;
+
+	in_uint16_le(s, flags);
+	in_uint16_le(s, cx);
+	in_uint16_le(s, cy);
+	id = flags & ~OFFSCREEN_DELETE_LIST;
+
+	DEBUG(("CREATE_OFFSCREEN(id=%d,cx=%d,cy=%d,flags=0x%x)\n", id, cx, cy, flags));
+
+	if (flags & OFFSCREEN_DELETE_LIST)
+	{
+		in_uint16_le(s, count);
+		for (i = 0; i < count; i++)
+		{
+			in_uint16_le(s, idx);
+			put_offscreen(idx, NULL);
+		}
+	}
+
+	if (id >= OFFSCREEN_CACHE_ENTRIES)
+	{
+		error("create offscreen %d\n", id);
+		return;
+	}
+
+	if ((cx == 0) || (cy == 0))
+	{
+		error("offscreen bitmap %d is %dx%d\n", id, cx, cy);
+		return;
+	}
+
+	put_offscreen(id, ui_create_surface(cx, cy));
+}
+
+/* Process an alternate secondary order. These have no length field,
+   so one that is not known ends the PDU. */
+static RD_BOOL
+process_altsec_order(STREAM s, uint8 order_flags)
+{
+	uint8 type = order_flags >> 2;
+
+	switch (type)
+	{
+		case RDP_ORDER_SWITCH_SURFACE:
+			process_switch_surface(s);
+			break;
+
+		case RDP_ORDER_CREATE_OFFSCREEN:
+			process_create_offscreen(s);
+			break;
+
+		default:
+			unimpl("alternate secondary order %d\n", type);
+			return False;
+	}
+
+	return True;
+}
+
+/* Append an orders update to the recording, which starts with the
+   desktop size and depth. Each update is its order count and length,
+   32 bit little endian, and the orders as they are parsed. */
+static void
+record_orders(STREAM s, uint16 num_orders)
+{
+	struct stream header;
+	uint8 buf[8];
+
+	if (g_order_record == NULL)
+	{
+		g_order_record = fopen(g_order_record_file, "wb");
+		if (g_order_record == NULL)
+		{
+			perror(g_order_record_file);
+			g_order_record_file = NULL;
+			return;
+		}
+		fprintf(g_order_record, "rdesktop orders %d %d %d\n", g_width, g_height,
+			g_server_depth);
+	}
+
+	header.p = buf;
+	out_uint32_le(&header, num_orders);
+	out_uint32_le(&header, s->end - s->p);
+	fwrite(buf, sizeof(buf), 1, g_order_record);
+	fwrite(s->p, s->end - s->p, 1, g_order_record);
+}
+
 /* Process an order PDU */
 void
 process_orders(STREAM s, uint16 num_orders)
 {
 	RDP_ORDER_STATE *os = &g_order_state;
+	ORDER_SCHEMA *schema;
 	uint32 present;
 	uint8 order_flags;
 	int size, processed = 0;
 	RD_BOOL delta;
+	double start = 0;
+	uint8 *begin;
+
+	if (g_order_record_file != NULL)
+		record_orders(s, num_orders);
 
 	while (processed < num_orders)
 	{
+		begin = s->p;
 		in_uint8(s, order_flags);
 
 		if (!(order_flags & RDP_ORDER_STANDARD))
 		{
-			error("order parsing failed\n");
-			break;
-		}
+			if (!(order_flags & RDP_ORDER_SECONDARY))
+			{
+				error("order parsing failed\n");
+				break;
+			}
 
-		if (order_flags & RDP_ORDER_SECONDARY)
+			dlist_flush();
+			if (!process_altsec_order(s, order_flags))
+				break;
+		}
+		else if (order_flags & RDP_ORDER_SECONDARY)
 		{
+			/* recorded orders may use what this replaces */
+			dlist_flush();
 			process_secondary_order(s);
 		}
 		else
 		{
+			if (g_order_profile)
+				start = order_profile_clock();
+
 			if (order_flags & RDP_ORDER_CHANGE)
 			{
 				in_uint8(s, os->order_type);
 			}
 
-			switch (os->order_type)
-			{
-				case RDP_ORDER_TRIBLT:
-				case RDP_ORDER_TEXT2:
-					size = 3;
-					break;
-
-				case RDP_ORDER_PATBLT:
-				case RDP_ORDER_MEMBLT:
-				case RDP_ORDER_LINE:
-				case RDP_ORDER_POLYGON2:
-				case RDP_ORDER_ELLIPSE2:
-					size = 2;
-					break;
-
-				default:
-					size = 1;
-			}
+			if (g_order_profile)
+				dlist_set_order(os->order_type);
 
+			schema = order_get_schema(os->order_type);
+			size = (schema != NULL) ? schema->present_size : 1;
 			rdp_in_present(s, &present, order_flags, size);
 
 			if (order_flags & RDP_ORDER_BOUNDS)
@@ -1361,11 +1469,11 @@ process_orders(STREAM s, uint16 num_orders)
 				if (!(order_flags & RDP_ORDER_LASTBOUNDS))
 					rdp_parse_bounds(s, &os->bounds);
 
-				ui_set_clip(os->bounds.left,
-					    os->bounds.top,
-					    os->bounds.right -
-					    os->bounds.left + 1,
-					    os->bounds.bottom - os->bounds.top + 1);
+				dlist_set_clip(os->bounds.left,
+					       os->bounds.top,
+					       os->bounds.right -
+					       os->bounds.left + 1,
+					       os->bounds.bottom - os->bounds.top + 1);
 			}
 
 			delta = order_flags & RDP_ORDER_DELTA;
@@ -1428,17 +1536,32 @@ process_orders(STREAM s, uint16 num_orders)
 					process_text2(s, &os->text2, present, delta);
 					break;
 
+				case RDP_ORDER_FAST_INDEX:
+					process_fast_index(s, &os->fast_index, present, delta);
+					break;
+
+				case RDP_ORDER_FAST_GLYPH:
+					process_fast_glyph(s, &os->fast_glyph, present, delta);
+					break;
+
 				default:
 					unimpl("order %d\n", os->order_type);
+					dlist_flush();
 					return;
 			}
 
 			if (order_flags & RDP_ORDER_BOUNDS)
-				ui_reset_clip();
+				dlist_reset_clip();
+
+			if (g_order_profile)
+				profile_decode(&g_primary_profile[os->order_type], start,
+					       s->p - begin);
 		}
 
 		processed++;
 	}
+
+	dlist_flush();
 #if 0
 	/* not true when RDP_COMPRESSION is set */
 	if (s->p != g_next_packet)
@@ -1453,4 +1576,146 @@ reset_order_state(void)
 {
 	memset(&g_order_state, 0, sizeof(g_order_state));
 	g_order_state.order_type = RDP_ORDER_PATBLT;
+	if (g_surface != OFFSCREEN_SCREEN)
+		set_surface(OFFSCREEN_SCREEN);
+}
+
+
+/* PROFILE */
+static char *g_secondary_names[NUM_ELEMENTS(g_secondary_profile)] = {
+	"raw_bmpcache", "colcache", "bmpcache", "fontcache",
+	"raw_bmpcache2", "bmpcache2", NULL, "brushcache"
+};
+
+/* Monotonic time in nanoseconds */
+double
+order_profile_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Account for replaying a command recorded by a primary order */
+void
+order_profile_draw(uint8 order, double start)
+{
+	g_primary_profile[order].draw += order_profile_clock() - start;
+}
+
+static void
+dump_profile(FILE * fp, long now, char *kind, char *name, ORDER_PROFILE * profile, double total)
+{
+	double spent;
+
+	if (!profile->count)
+		return;
+
+	spent = profile->decode + profile->draw;
+	fprintf(fp, "orderstats time=%ld kind=%s order=%s count=%u bytes=%u decode_us=%.0f "
+		"draw_us=%.0f avg_ns=%.0f share=%.1f%%\n", now, kind, name, profile->count,
+		profile->bytes, profile->decode / 1000, profile->draw / 1000,
+		spent / profile->count, total ? spent * 100 / total : 0);
+}
+
+/* Write the counters and timers of all order types that were seen */
+void
+order_dump_profile(FILE * fp)
+{
+	long now = (long) time(NULL);
+	double total = 0;
+	unsigned int n;
+
+	for (n = 0; n < NUM_ELEMENTS(g_primary_profile); n++)
+		total += g_primary_profile[n].decode + g_primary_profile[n].draw;
+	for (n = 0; n < NUM_ELEMENTS(g_secondary_profile); n++)
+		total += g_secondary_profile[n].decode;
+
+	for (n = 0; n < NUM_ELEMENTS(g_primary_profile); n++)
+		dump_profile(fp, now, "primary", g_order_schema[n].name, &g_primary_profile[n],
+			     total);
+	for (n = 0; n < NUM_ELEMENTS(g_secondary_profile); n++)
+		dump_profile(fp, now, "secondary", g_secondary_names[n], &g_secondary_profile[n],
+			     total);
+	fflush(fp);
+}
+
+/* REPLAY */
+/* Open a recording, and take the desktop size and depth from it */
+RD_BOOL
+order_replay_open(char *filename)
+{
+	char line[64];
+
+	g_order_replay = fopen(filename, "rb");
+	if (g_order_replay == NULL)
+	{
+		perror(filename);
+		return False;
+	}
+
+	if ((fgets(line, sizeof(line), g_order_replay) == NULL)
+	    || (sscanf(line, "rdesktop orders %d %d %d", &g_width, &g_height,
+		       &g_server_depth) != 3))
+	{
+		error("%s is not an order recording\n", filename);
+		fclose(g_order_replay);
+		g_order_replay = NULL;
+		return False;
+	}
+
+	return True;
+}
+
+/* Draw the recorded updates one after the other, as fast as they can be
+   parsed and drawn, and report how long it took */
+void
+order_replay(void)
+{
+	struct stream s, header;
+	uint8 buf[8];
+	uint32 count, length, updates = 0, orders = 0, bytes = 0;
+	double start, elapsed;
+
+	memset(&s, 0, sizeof(s));
+	reset_order_state();
+
+	start = order_profile_clock();
+	while (fread(buf, sizeof(buf), 1, g_order_replay) == 1)
+	{
+		header.p = buf;
+		in_uint32_le(&header, count);
+		in_uint32_le(&header, length);
+
+		if (length > s.size)
+		{
+			s.data = (uint8 *) xrealloc(s.data, length);
+			s.size = length;
+		}
+		if (fread(s.data, 1, length, g_order_replay) != length)
+		{
+			warning("order recording ends inside an update\n");
+			break;
+		}
+		s.p = s.data;
+		s.end = s.data + length;
+
+		ui_begin_update();
+		process_orders(&s, count);
+		ui_end_update();
+
+		updates++;
+		orders += count;
+		bytes += length;
+	}
+	ui_sync();
+	elapsed = order_profile_clock() - start;
+
+	fprintf(stderr, "orderreplay updates=%u orders=%u bytes=%u time_ms=%.1f orders_per_s=%.0f\n",
+		updates, orders, bytes, elapsed / 1e6, elapsed ? orders * 1e9 / elapsed : 0);
+
+	xfree(s.data);
+	fclose(g_order_replay);
+	g_order_replay = NULL;
 }
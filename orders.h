@@ -36,9 +36,11 @@ enum RDP_ORDER_TYPE
 	RDP_ORDER_DESKSAVE = 11,
 	RDP_ORDER_MEMBLT = 13,
 	RDP_ORDER_TRIBLT = 14,
+	RDP_ORDER_FAST_INDEX = 19,
 	RDP_ORDER_POLYGON = 20,
 	RDP_ORDER_POLYGON2 = 21,
 	RDP_ORDER_POLYLINE = 22,
+	RDP_ORDER_FAST_GLYPH = 24,
 	RDP_ORDER_ELLIPSE = 25,
 	RDP_ORDER_ELLIPSE2 = 26,
 	RDP_ORDER_TEXT2 = 27
@@ -55,6 +57,12 @@ enum RDP_SECONDARY_ORDER_TYPE
 	RDP_ORDER_BRUSHCACHE = 7
 };
 
+enum RDP_ALTSEC_ORDER_TYPE
+{
+	RDP_ORDER_SWITCH_SURFACE = 0,
+	RDP_ORDER_CREATE_OFFSCREEN = 1
+};
+
 typedef struct _DESTBLT_ORDER
 {
 	sint16 x;
@@ -266,6 +274,140 @@ typedef struct _TEXT2_ORDER
 }
 TEXT2_ORDER;
 
+/* FAST_GLYPH has the same fields, with a single glyph as its text */
+typedef struct _FAST_INDEX_ORDER
+{
+	uint8 font;
+	uint8 charinc;
+	uint8 flags;
+	uint32 bgcolour;
+	uint32 fgcolour;
+	sint16 clipleft;
+	sint16 cliptop;
+	sint16 clipright;
+	sint16 clipbottom;
+	sint16 boxleft;
+	sint16 boxtop;
+	sint16 boxright;
+	sint16 boxbottom;
+	sint16 x;
+	sint16 y;
+	uint8 length;
+	uint8 text[MAX_TEXT];
+
+}
+FAST_INDEX_ORDER;
+
+/*
+ * Order schema: the fields of each primary order in wire order, as
+ * F(presence bit, kind, member). COORD fields are sent as one byte
+ * deltas when the order has the delta flag. BRUSH and PEN take five and
+ * three presence bits from the given one on, DATA and TEXT are a length
+ * byte and that many bytes, and GLYPH is left to the order to parse.
+ * orders.c generates the parsers and the schema table from these.
+ */
+enum ORDER_FIELD_KIND
+{
+	OF_COORD,
+	OF_UINT8,
+	OF_UINT16,
+	OF_UINT32,
+	OF_COLOUR,
+	OF_COLOUR_B0,		/* single bytes of a colour */
+	OF_COLOUR_B1,
+	OF_COLOUR_B2,
+	OF_BRUSH,
+	OF_PEN,
+	OF_DATA,		/* datasize and data */
+	OF_TEXT,		/* length and text */
+	OF_GLYPH
+};
+
+#define DESTBLT_SCHEMA(F) \
+	F(0, COORD, x) F(1, COORD, y) F(2, COORD, cx) F(3, COORD, cy) \
+	F(4, UINT8, opcode)
+
+#define PATBLT_SCHEMA(F) \
+	F(0, COORD, x) F(1, COORD, y) F(2, COORD, cx) F(3, COORD, cy) \
+	F(4, UINT8, opcode) F(5, COLOUR, bgcolour) F(6, COLOUR, fgcolour) \
+	F(7, BRUSH, brush)
+
+#define SCREENBLT_SCHEMA(F) \
+	F(0, COORD, x) F(1, COORD, y) F(2, COORD, cx) F(3, COORD, cy) \
+	F(4, UINT8, opcode) F(5, COORD, srcx) F(6, COORD, srcy)
+
+#define LINE_SCHEMA(F) \
+	F(0, UINT16, mixmode) F(1, COORD, startx) F(2, COORD, starty) \
+	F(3, COORD, endx) F(4, COORD, endy) F(5, COLOUR, bgcolour) \
+	F(6, UINT8, opcode) F(7, PEN, pen)
+
+#define RECT_SCHEMA(F) \
+	F(0, COORD, x) F(1, COORD, y) F(2, COORD, cx) F(3, COORD, cy) \
+	F(4, COLOUR_B0, colour) F(5, COLOUR_B1, colour) F(6, COLOUR_B2, colour)
+
+#define DESKSAVE_SCHEMA(F) \
+	F(0, UINT32, offset) F(1, COORD, left) F(2, COORD, top) \
+	F(3, COORD, right) F(4, COORD, bottom) F(5, UINT8, action)
+
+#define MEMBLT_SCHEMA(F) \
+	F(0, UINT8, cache_id) F(0, UINT8, colour_table) \
+	F(1, COORD, x) F(2, COORD, y) F(3, COORD, cx) F(4, COORD, cy) \
+	F(5, UINT8, opcode) F(6, COORD, srcx) F(7, COORD, srcy) \
+	F(8, UINT16, cache_idx)
+
+#define TRIBLT_SCHEMA(F) \
+	F(0, UINT8, cache_id) F(0, UINT8, colour_table) \
+	F(1, COORD, x) F(2, COORD, y) F(3, COORD, cx) F(4, COORD, cy) \
+	F(5, UINT8, opcode) F(6, COORD, srcx) F(7, COORD, srcy) \
+	F(8, COLOUR, bgcolour) F(9, COLOUR, fgcolour) F(10, BRUSH, brush) \
+	F(15, UINT16, cache_idx) F(16, UINT16, unknown)
+
+#define POLYGON_SCHEMA(F) \
+	F(0, COORD, x) F(1, COORD, y) F(2, UINT8, opcode) F(3, UINT8, fillmode) \
+	F(4, COLOUR, fgcolour) F(5, UINT8, npoints) F(6, DATA, data)
+
+#define POLYGON2_SCHEMA(F) \
+	F(0, COORD, x) F(1, COORD, y) F(2, UINT8, opcode) F(3, UINT8, fillmode) \
+	F(4, COLOUR, bgcolour) F(5, COLOUR, fgcolour) F(6, BRUSH, brush) \
+	F(11, UINT8, npoints) F(12, DATA, data)
+
+#define POLYLINE_SCHEMA(F) \
+	F(0, COORD, x) F(1, COORD, y) F(2, UINT8, opcode) \
+	F(4, COLOUR, fgcolour) F(5, UINT8, lines) F(6, DATA, data)
+
+#define ELLIPSE_SCHEMA(F) \
+	F(0, COORD, left) F(1, COORD, top) F(2, COORD, right) F(3, COORD, bottom) \
+	F(4, UINT8, opcode) F(5, UINT8, fillmode) F(6, COLOUR, fgcolour)
+
+#define ELLIPSE2_SCHEMA(F) \
+	F(0, COORD, left) F(1, COORD, top) F(2, COORD, right) F(3, COORD, bottom) \
+	F(4, UINT8, opcode) F(5, UINT8, fillmode) F(6, COLOUR, bgcolour) \
+	F(7, COLOUR, fgcolour) F(8, BRUSH, brush)
+
+#define TEXT2_SCHEMA(F) \
+	F(0, UINT8, font) F(1, UINT8, flags) F(2, UINT8, opcode) F(3, UINT8, mixmode) \
+	F(4, COLOUR, fgcolour) F(5, COLOUR, bgcolour) \
+	F(6, UINT16, clipleft) F(7, UINT16, cliptop) \
+	F(8, UINT16, clipright) F(9, UINT16, clipbottom) \
+	F(10, UINT16, boxleft) F(11, UINT16, boxtop) \
+	F(12, UINT16, boxright) F(13, UINT16, boxbottom) \
+	F(14, BRUSH, brush) F(19, UINT16, x) F(20, UINT16, y) F(21, TEXT, text)
+
+#define FAST_TEXT_SCHEMA(F) \
+	F(0, UINT8, font) F(1, UINT8, charinc) F(1, UINT8, flags) \
+	F(2, COLOUR, fgcolour) F(3, COLOUR, bgcolour) \
+	F(4, COORD, clipleft) F(5, COORD, cliptop) \
+	F(6, COORD, clipright) F(7, COORD, clipbottom) \
+	F(8, COORD, boxleft) F(9, COORD, boxtop) \
+	F(10, COORD, boxright) F(11, COORD, boxbottom) \
+	F(12, COORD, x) F(13, COORD, y)
+
+#define FAST_INDEX_SCHEMA(F) \
+	FAST_TEXT_SCHEMA(F) F(14, TEXT, text)
+
+#define FAST_GLYPH_SCHEMA(F) \
+	FAST_TEXT_SCHEMA(F) F(14, GLYPH, data)
+
 typedef struct _RDP_ORDER_STATE
 {
 	uint8 order_type;
@@ -285,6 +427,8 @@ typedef struct _RDP_ORDER_STATE
 	ELLIPSE_ORDER ellipse;
 	ELLIPSE2_ORDER ellipse2;
 	TEXT2_ORDER text2;
+	FAST_INDEX_ORDER fast_index;
+	FAST_INDEX_ORDER fast_glyph;
 
 }
 RDP_ORDER_STATE;
@@ -27,11 +27,12 @@ extern "C" {
 /* bitmap.c */
 RD_BOOL bitmap_decompress(uint8 * output, int width, int height, uint8 * input, int size, int Bpp);
 /* cache.c */
+void cache_resize_bitmap(uint8 id, int cells);
 void cache_rebuild_bmpcache_linked_list(uint8 id, sint16 * idx, int count);
-void cache_bump_bitmap(uint8 id, uint16 idx, int bump);
 void cache_evict_bitmap(uint8 id);
 RD_HBITMAP cache_get_bitmap(uint8 id, uint16 idx);
 void cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap);
+void cache_preload_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap);
 void cache_save_state(void);
 FONTGLYPH *cache_get_font(uint8 font, uint16 character);
 void cache_put_font(uint8 font, uint16 character, uint16 offset, uint16 baseline, uint16 width,
@@ -43,12 +44,21 @@ void cache_put_desktop(uint32 offset, int cx, int cy, int scanline, int bytes_pe
 		       uint8 * data);
 RD_HCURSOR cache_get_cursor(uint16 cache_idx);
 void cache_put_cursor(uint16 cache_idx, RD_HCURSOR cursor);
+RD_HBITMAP cache_get_offscreen(uint16 cache_idx);
+void cache_put_offscreen(uint16 cache_idx, RD_HBITMAP bitmap);
 BRUSHDATA *cache_get_brush_data(uint8 colour_code, uint8 idx);
 void cache_put_brush_data(uint8 colour_code, uint8 idx, BRUSHDATA * brush_data);
+void cache_dump_stats(FILE * fp);
 /* channels.c */
+void channel_set_mcs_id(VCHANNEL * channel, uint16 mcs_id);
+void channel_clear_mcs_ids(void);
 VCHANNEL *channel_register(char *name, uint32 flags, void (*callback) (STREAM));
 STREAM channel_init(VCHANNEL * channel, uint32 length);
 void channel_send(STREAM s, VCHANNEL * channel);
+void channel_queue(STREAM s, VCHANNEL * channel);
+RD_BOOL channel_send_queued(void);
+void channel_send_pending(void);
+void channel_reset_state(void);
 void channel_process(STREAM s, uint16 mcs_channel);
 /* cliprdr.c */
 void cliprdr_send_simple_native_format_announce(uint32 format);
@@ -57,6 +67,37 @@ void cliprdr_send_data_request(uint32 format);
 void cliprdr_send_data(uint8 * data, uint32 length);
 void cliprdr_set_mode(const char *optarg);
 RD_BOOL cliprdr_init(void);
+/* drdynvc.c */
+DVCHANNEL *dvc_register(char *name, void (*callback) (STREAM), void (*notify) (RD_BOOL));
+STREAM dvc_init(DVCHANNEL * channel, uint32 length);
+void dvc_send(STREAM s, DVCHANNEL * channel);
+RD_BOOL drdynvc_init(void);
+void drdynvc_reset_state(void);
+/* dlist.c */
+void dlist_set_order(uint8 order);
+void dlist_set_clip(int x, int y, int cx, int cy);
+void dlist_reset_clip(void);
+void dlist_destblt(uint8 opcode, int x, int y, int cx, int cy);
+void dlist_patblt(uint8 opcode, int x, int y, int cx, int cy, BRUSH * brush, int bgcolour,
+		  int fgcolour);
+void dlist_screenblt(uint8 opcode, int x, int y, int cx, int cy, int srcx, int srcy);
+void dlist_memblt(uint8 opcode, int x, int y, int cx, int cy, uint8 cache_id, uint16 cache_idx,
+		  int srcx, int srcy);
+void dlist_triblt(uint8 opcode, int x, int y, int cx, int cy, uint8 cache_id, uint16 cache_idx,
+		  int srcx, int srcy, BRUSH * brush, int bgcolour, int fgcolour);
+void dlist_line(uint8 opcode, int startx, int starty, int endx, int endy, PEN * pen);
+void dlist_rect(int x, int y, int cx, int cy, int colour);
+void dlist_polygon(uint8 opcode, uint8 fillmode, RD_POINT * points, int npoints, BRUSH * brush,
+		   int bgcolour, int fgcolour);
+void dlist_polyline(uint8 opcode, RD_POINT * points, int npoints, PEN * pen);
+void dlist_ellipse(uint8 opcode, uint8 fillmode, int x, int y, int cx, int cy, BRUSH * brush,
+		   int bgcolour, int fgcolour);
+void dlist_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y, int clipx,
+		     int clipy, int clipcx, int clipcy, int boxx, int boxy, int boxcx, int boxcy,
+		     BRUSH * brush, int bgcolour, int fgcolour, uint8 * text, uint8 length);
+void dlist_desktop_save(uint32 offset, int x, int y, int cx, int cy);
+void dlist_desktop_restore(uint32 offset, int x, int y, int cx, int cy);
+void dlist_flush(void);
 /* disk.c */
 int disk_enum_devices(uint32 * id, char *optarg);
 RD_NTSTATUS disk_query_information(RD_NTHANDLE handle, uint32 info_class, STREAM out);
@@ -70,6 +111,8 @@ int mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 *
 /* ewmhints.c */
 int get_current_workarea(uint32 * x, uint32 * y, uint32 * width, uint32 * height);
 void ewmh_init(void);
+/* fuzz.c */
+STREAM fuzz_handler(STREAM data);
 /* iso.c */
 STREAM iso_init(int length);
 void iso_send(STREAM s);
@@ -90,6 +133,12 @@ void mcs_reset_state(void);
 /* orders.c */
 void process_orders(STREAM s, uint16 num_orders);
 void reset_order_state(void);
+ORDER_SCHEMA *order_get_schema(uint8 type);
+double order_profile_clock(void);
+void order_profile_draw(uint8 order, double start);
+void order_dump_profile(FILE * fp);
+RD_BOOL order_replay_open(char *filename);
+void order_replay(void);
 /* parallel.c */
 int parallel_enum_devices(uint32 * id, char *optarg);
 /* printer.c */
@@ -102,8 +151,25 @@ void pstcache_touch_bitmap(uint8 cache_id, uint16 cache_idx, uint32 stamp);
 RD_BOOL pstcache_load_bitmap(uint8 cache_id, uint16 cache_idx);
 RD_BOOL pstcache_save_bitmap(uint8 cache_id, uint16 cache_idx, uint8 * key, uint8 width,
 			     uint8 height, uint16 length, uint8 * data);
+void pstcache_flush(void);
+void pstcache_precache(void);
 int pstcache_enumerate(uint8 id, HASH_KEY * keylist);
 RD_BOOL pstcache_init(uint8 cache_id);
+/* raster.c */
+void raster_set_clip(SURFACE * s, int x, int y, int cx, int cy);
+void raster_reset_clip(SURFACE * s);
+RD_BOOL raster_clip(SURFACE * dst, int *x, int *y, int *cx, int *cy, SURFACE * src, int *srcx,
+		    int *srcy);
+void raster_blt(SURFACE * dst, uint8 rop, int x, int y, int cx, int cy, SURFACE * src, int srcx,
+		int srcy, PATTERN * pattern);
+void raster_stipple(SURFACE * dst, int x, int y, int cx, int cy, uint8 * mask, int scanline,
+		    int maskx, int masky, uint32 fgcolour, uint32 bgcolour, RD_BOOL opaque);
+void raster_line(SURFACE * dst, uint8 rop, int startx, int starty, int endx, int endy,
+		 RD_BOOL draw_last, uint32 colour);
+void raster_polygon(SURFACE * dst, uint8 rop, uint8 fillmode, RD_POINT * points, int npoints,
+		    PATTERN * pattern);
+void raster_ellipse(SURFACE * dst, uint8 rop, uint8 fillmode, int x, int y, int cx, int cy,
+		    PATTERN * pattern);
 /* rdesktop.c */
 int main(int argc, char *argv[]);
 void generate_random(uint8 * random);
@@ -126,17 +192,24 @@ char *l_to_a(long N, int base);
 int load_licence(unsigned char **data);
 void save_licence(unsigned char *data, int length);
 RD_BOOL rd_pstcache_mkdir(void);
+void rd_check_cache_stats(void);
 int rd_open_file(char *filename);
 void rd_close_file(int fd);
 int rd_read_file(int fd, void *ptr, int len);
 int rd_write_file(int fd, void *ptr, int len);
 int rd_lseek_file(int fd, int offset);
 RD_BOOL rd_lock_file(int fd, int start, int len);
+RD_BOOL rd_lock_file_wait(int fd, int start, int len);
+void rd_unlock_file(int fd, int start, int len);
+void *rd_map_file(int fd, uint32 length);
+void rd_unmap_file(void *ptr, uint32 length);
 /* rdp5.c */
 void rdp5_process(STREAM s);
 /* rdp.c */
 void rdp_out_unistr(STREAM s, char *string, int len);
 int rdp_in_unistr(STREAM s, char *string, int str_len, int in_len);
+void rdp_flush_input(RD_BOOL force);
+void rdp_input_timeout(struct timeval *tv);
 void rdp_send_input(uint32 time, uint16 message_type, uint16 device_flags, uint16 param1,
 		    uint16 param2);
 void rdp_send_client_window_status(int status);
@@ -187,6 +260,8 @@ void sec_decrypt(uint8 * data, int length);
 STREAM sec_init(uint32 flags, int maxlen);
 void sec_send_to_channel(STREAM s, uint32 flags, uint16 channel);
 void sec_send(STREAM s, uint32 flags);
+STREAM sec_fp_init(int maxlen);
+void sec_fp_send(STREAM s, int num_events);
 void sec_process_mcs_data(STREAM s);
 STREAM sec_recv(uint8 * rdpver);
 RD_BOOL sec_connect(char *server, char *username, RD_BOOL reconnect);
@@ -197,12 +272,31 @@ int serial_enum_devices(uint32 * id, char *optarg);
 RD_BOOL serial_get_event(RD_NTHANDLE handle, uint32 * result);
 RD_BOOL serial_get_timeout(RD_NTHANDLE handle, uint32 length, uint32 * timeout,
 			   uint32 * itv_timeout);
+/* shadow.c */
+void shadow_init(int width, int height, int Bpp, RD_BOOL big_endian);
+SURFACE *shadow_surface(void);
+uint32 shadow_checksum(void);
+void shadow_set_clip(int x, int y, int cx, int cy);
+void shadow_invalidate(int x, int y, int cx, int cy);
+RD_BOOL shadow_get_stale(int *x, int *y, int *cx, int *cy);
+void shadow_load(int x, int y, int cx, int cy, uint8 * data, int stride);
+void shadow_put_image(int x, int y, int cx, int cy, uint8 * data, int stride);
+void shadow_fill(int x, int y, int cx, int cy, uint32 colour);
+void shadow_blt(uint8 rop, int x, int y, int cx, int cy, SURFACE * src, int srcx, int srcy,
+		PATTERN * pattern);
+void shadow_stipple(int x, int y, int cx, int cy, uint8 * mask, int scanline, int maskx, int masky,
+		    uint32 fgcolour, uint32 bgcolour, RD_BOOL opaque);
+void shadow_polygon(uint8 rop, uint8 fillmode, RD_POINT * points, int npoints, PATTERN * pattern);
+void shadow_line(uint8 rop, int startx, int starty, int endx, int endy, uint32 colour);
+void shadow_polyline(uint8 rop, RD_POINT * points, int npoints, uint32 colour);
+void shadow_ellipse(uint8 rop, uint8 fillmode, int x, int y, int cx, int cy, PATTERN * pattern);
 /* tcp.c */
 STREAM tcp_init(uint32 maxlen);
 void tcp_send(STREAM s);
 STREAM tcp_recv(STREAM s, uint32 length);
 RD_BOOL tcp_connect(char *server);
 void tcp_disconnect(void);
+int tcp_get_socket(void);
 char *tcp_get_address(void);
 void tcp_reset_state(void);
 /* xclip.c */
@@ -243,10 +337,21 @@ void xwin_toggle_fullscreen(void);
 int ui_select(int rdp_socket);
 void ui_move_pointer(int x, int y);
 RD_HBITMAP ui_create_bitmap(int width, int height, uint8 * data);
+uint8 *ui_translate_bitmap(int width, int height, uint8 * data);
+RD_HBITMAP ui_create_translated_bitmap(int width, int height, uint8 * tdata);
+uint32 ui_get_bitmap_size(RD_HBITMAP bmp);
+RD_HBITMAP ui_create_surface(int width, int height);
+void ui_set_surface(RD_HBITMAP surface);
+void ui_paint_translated_bitmap(int x, int y, int cx, int cy, int width, int height,
+				uint8 * tdata);
 void ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * data);
 void ui_destroy_bitmap(RD_HBITMAP bmp);
 RD_HGLYPH ui_create_glyph(int width, int height, uint8 * data);
 void ui_destroy_glyph(RD_HGLYPH glyph);
+RD_HGLYPH ui_create_font_glyph(uint8 font, int offset, int baseline, int width, int height,
+			       uint8 * data);
+void ui_destroy_font_glyph(uint8 font, RD_HGLYPH glyph);
+void ui_destroy_brush(RD_HBRUSH brush);
 RD_HCURSOR ui_create_cursor(unsigned int x, unsigned int y, int width, int height, uint8 * andmask,
 			    uint8 * xormask, int bpp);
 void ui_set_cursor(RD_HCURSOR cursor);
@@ -281,6 +386,7 @@ void ui_desktop_save(uint32 offset, int x, int y, int cx, int cy);
 void ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy);
 void ui_begin_update(void);
 void ui_end_update(void);
+void ui_sync(void);
 void ui_seamless_begin(RD_BOOL hidden);
 void ui_seamless_end();
 void ui_seamless_hide_desktop(void);
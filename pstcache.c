@@ -19,10 +19,32 @@
 
 #include "rdesktop.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
 #define MAX_CELL_SIZE		0x1000	/* pixels */
 
+/* The cache file is shared by all clients on the host. It starts with a
+   PSTCACHE_HEADER, followed by a hash table of PSTCACHE_SLOTs that finds
+   cells by their key and, page aligned, a log that cells are appended
+   to, wrapping around when it is full. Readers do not lock; they check
+   that the log has not wrapped over a cell while they copied it. Writers
+   take turns with a lock on the first byte of the file. */
+#define PSTCACHE_MAGIC		0x63706472	/* "rdpc" */
+#define PSTCACHE_VERSION	3
+#define PSTCACHE_NUM_SLOTS	32768	/* a power of two */
+#define PSTCACHE_MAX_PROBES	16
+
 #define IS_PERSISTENT(id) (id < 8 && g_pstcache_fd[id] > 0)
 
+#ifdef __GNUC__
+#define MEMORY_BARRIER()	__sync_synchronize()
+#else
+#define MEMORY_BARRIER()
+#endif
+
 extern int g_server_depth;
 extern RD_BOOL g_bitmap_cache;
 extern RD_BOOL g_bitmap_cache_persist_enable;
@@ -33,29 +55,487 @@ int g_pstcache_Bpp;
 RD_BOOL g_pstcache_enumerated = False;
 uint8 zero_key[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 
+static volatile PSTCACHE_HEADER *g_pstcache_hdr[8];
+static PSTCACHE_SLOT *g_pstcache_slots[8];
+static uint8 *g_pstcache_log[8];
+static CELLHEADER *g_pstcache_cells[8];	/* the keys this session uses, by cell */
+static uint32 g_pstcache_cell_size;
+static uint8 *g_pstcache_buffer = NULL;
+
+typedef struct _MRU_ENTRY
+{
+	uint32 stamp;
+	sint16 idx;
+}
+MRU_ENTRY;
+
+#ifdef HAVE_PTHREAD
+/* Saved bitmaps are written to the file by a background thread, so that
+   the page faults and copying stay off the receive path. Until a cell has
+   been written, its queue entry holds the current content. */
+#define PSTCACHE_QUEUE_SIZE	64
+
+typedef struct _PSTCACHE_WRITE
+{
+	uint8 cache_id;
+	uint16 cache_idx;
+	CELLHEADER cellhdr;
+	uint8 *data;
+}
+PSTCACHE_WRITE;
+
+static PSTCACHE_WRITE g_pstcache_queue[PSTCACHE_QUEUE_SIZE];
+static int g_pstcache_queue_head, g_pstcache_queue_count;
+static RD_BOOL g_pstcache_writing = False;	/* head entry is being written */
+static RD_BOOL g_pstcache_writer_started = False;
+static pthread_mutex_t g_pstcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_pstcache_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_pstcache_written = PTHREAD_COND_INITIALIZER;
+#endif
+
+/* Precached cells are read and converted to the display's format by
+   worker threads in MRU order, and uploaded by the main thread a batch
+   at a time between PDUs. Entry n of the list is for cell n. */
+#define PRECACHE_BATCH		16
+#define PRECACHE_MAX_WORKERS	4
+
+#define PRECACHE_QUEUED		0
+#define PRECACHE_LOADING	1
+#define PRECACHE_READY		2
+#define PRECACHE_DONE		3
+
+typedef struct _PRECACHE_ITEM
+{
+	HASH_KEY key;
+	uint8 state;
+	uint8 width, height;
+	uint8 *data;
+}
+PRECACHE_ITEM;
+
+static PRECACHE_ITEM *g_precache = NULL;
+static uint8 g_precache_id;
+static int g_precache_count, g_precache_next, g_precache_upload;
+static int g_precache_workers = 0;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t g_precache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PRECACHE_LOCK()		pthread_mutex_lock(&g_precache_lock)
+#define PRECACHE_UNLOCK()	pthread_mutex_unlock(&g_precache_lock)
+#else
+#define PRECACHE_LOCK()
+#define PRECACHE_UNLOCK()
+#endif
+
+typedef struct _SLOT_ENTRY
+{
+	uint32 stamp;
+	uint32 age;
+	int slot;
+}
+SLOT_ENTRY;
+
+static uint32
+hash_key(uint8 * key)
+{
+	uint32 h;
+
+	h = (key[0] | (key[1] << 8) | (key[2] << 16) | (key[3] << 24)) ^
+		(key[4] | (key[5] << 8) | (key[6] << 16) | (key[7] << 24));
+	h *= 0x9e3779b1;
+	return h ^ (h >> 16);
+}
+
+static CELLHEADER *
+log_cell(uint8 id, uint32 offset)
+{
+	return (CELLHEADER *) (g_pstcache_log[id] + (offset & (g_pstcache_hdr[id]->log_size - 1)));
+}
+
+/* A cell is intact as long as the log has not come round to it again */
+static RD_BOOL
+log_valid(uint8 id, uint32 offset)
+{
+	return (uint32) (g_pstcache_hdr[id]->head - offset) <= g_pstcache_hdr[id]->log_size;
+}
+
+/* Find the slot of a key that is still in the log */
+static PSTCACHE_SLOT *
+find_slot(uint8 id, uint8 * key, uint32 * offset)
+{
+	PSTCACHE_SLOT *slot;
+	uint32 h, n;
+
+	h = hash_key(key);
+	for (n = 0; n < PSTCACHE_MAX_PROBES; n++)
+	{
+		slot = &g_pstcache_slots[id][(h + n) & (PSTCACHE_NUM_SLOTS - 1)];
+		if (memcmp(slot->key, key, sizeof(HASH_KEY)) != 0)
+			continue;
+
+		*offset = slot->offset;
+		if (!log_valid(id, *offset)
+		    || (memcmp(log_cell(id, *offset)->key, key, sizeof(HASH_KEY)) != 0))
+			return NULL;
+
+		return slot;
+	}
+
+	return NULL;
+}
+
+/* Copy a cell out of the log */
+static RD_BOOL
+read_cell(uint8 id, uint8 * key, CELLHEADER * cellhdr, uint8 * data)
+{
+	uint32 offset;
+	CELLHEADER *rec;
+
+	if (find_slot(id, key, &offset) == NULL)
+		return False;
+
+	rec = log_cell(id, offset);
+	memcpy(cellhdr, rec, sizeof(CELLHEADER));
+	/* other clients write the log too, so trust no sizes in it */
+	if ((cellhdr->length == 0) || (cellhdr->length > g_pstcache_cell_size)
+	    || (cellhdr->length != cellhdr->width * cellhdr->height * g_pstcache_Bpp))
+		return False;
+
+	memcpy(data, (uint8 *) (rec + 1), cellhdr->length);
+
+	/* another client may have overwritten it meanwhile */
+	MEMORY_BARRIER();
+	return log_valid(id, offset)
+		&& (memcmp(cellhdr->key, key, sizeof(HASH_KEY)) == 0);
+}
+
+/* Append a cell to the log and point its key's slot at it */
+static void
+write_cell(uint8 id, CELLHEADER * cellhdr, uint8 * data)
+{
+	volatile PSTCACHE_HEADER *hdr = g_pstcache_hdr[id];
+	PSTCACHE_SLOT *slot, *best = NULL;
+	uint32 need, head, pos, h, n, age, best_age = 0;
+
+	need = (sizeof(CELLHEADER) + cellhdr->length + 3) & ~3;
+	if (!rd_lock_file_wait(g_pstcache_fd[id], 0, 1))
+		return;
+
+	/* cells do not wrap around the end of the log */
+	head = hdr->head;
+	pos = head & (hdr->log_size - 1);
+	if (pos + need > hdr->log_size)
+		head += hdr->log_size - pos;
+
+	/* claim the space before overwriting it, so readers notice */
+	hdr->head = head + need;
+	MEMORY_BARRIER();
+
+	memcpy(log_cell(id, head), cellhdr, sizeof(CELLHEADER));
+	memcpy((uint8 *) (log_cell(id, head) + 1), data, cellhdr->length);
+	MEMORY_BARRIER();
+
+	/* reuse the slot of the key, else a free one, else the oldest */
+	h = hash_key(cellhdr->key);
+	for (n = 0; n < PSTCACHE_MAX_PROBES; n++)
+	{
+		slot = &g_pstcache_slots[id][(h + n) & (PSTCACHE_NUM_SLOTS - 1)];
+		if (memcmp(slot->key, cellhdr->key, sizeof(HASH_KEY)) == 0)
+		{
+			best = slot;
+			break;
+		}
+
+		if (memcmp(slot->key, zero_key, sizeof(HASH_KEY)) == 0 || !log_valid(id, slot->offset))
+			age = 0xffffffff;
+		else
+			age = head - slot->offset;
+
+		if ((best == NULL) || (age > best_age))
+		{
+			best = slot;
+			best_age = age;
+		}
+	}
+
+	best->offset = head;
+	best->stamp = 0;
+	memcpy(best->key, cellhdr->key, sizeof(HASH_KEY));
+
+	rd_unlock_file(g_pstcache_fd[id], 0, 1);
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+writer_thread(void *arg)
+{
+	PSTCACHE_WRITE *entry;
+
+	UNUSED(arg);
+
+	pthread_mutex_lock(&g_pstcache_lock);
+	while (1)
+	{
+		while (g_pstcache_queue_count == 0)
+			pthread_cond_wait(&g_pstcache_queued, &g_pstcache_lock);
+
+		entry = &g_pstcache_queue[g_pstcache_queue_head];
+		g_pstcache_writing = True;
+		pthread_mutex_unlock(&g_pstcache_lock);
+
+		write_cell(entry->cache_id, &entry->cellhdr, entry->data);
+
+		pthread_mutex_lock(&g_pstcache_lock);
+		g_pstcache_writing = False;
+		g_pstcache_queue_head = (g_pstcache_queue_head + 1) % PSTCACHE_QUEUE_SIZE;
+		g_pstcache_queue_count--;
+		pthread_cond_broadcast(&g_pstcache_written);
+	}
+
+	return NULL;
+}
+
+/* Find the newest queued write of a cell. Call with the lock held. */
+static PSTCACHE_WRITE *
+find_pending(uint8 cache_id, uint16 cache_idx)
+{
+	PSTCACHE_WRITE *entry;
+	int n;
+
+	for (n = g_pstcache_queue_count - 1; n >= 0; n--)
+	{
+		entry = &g_pstcache_queue[(g_pstcache_queue_head + n) % PSTCACHE_QUEUE_SIZE];
+		if ((entry->cache_id == cache_id) && (entry->cache_idx == cache_idx))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static RD_BOOL
+start_writer(void)
+{
+	pthread_t thread;
+	int n;
+
+	if (g_pstcache_writer_started)
+		return True;
+
+	for (n = 0; n < PSTCACHE_QUEUE_SIZE; n++)
+		g_pstcache_queue[n].data = (uint8 *) xmalloc(g_pstcache_cell_size);
+
+	if (pthread_create(&thread, NULL, writer_thread, NULL) != 0)
+	{
+		for (n = 0; n < PSTCACHE_QUEUE_SIZE; n++)
+			xfree(g_pstcache_queue[n].data);
+		warning("Could not start persistent bitmap cache writer, writing synchronously\n");
+		return False;
+	}
+
+	pthread_detach(thread);
+	g_pstcache_writer_started = True;
+	return True;
+}
+#endif
+
+/* Read a cell and convert it; touches nothing shared with other threads */
+static RD_BOOL
+precache_prepare(PRECACHE_ITEM * item)
+{
+	CELLHEADER cellhdr;
+	uint8 *data;
+
+	data = (uint8 *) xmalloc(g_pstcache_cell_size);
+	if (!read_cell(g_precache_id, item->key, &cellhdr, data))
+	{
+		xfree(data);
+		return False;
+	}
+
+	item->width = cellhdr.width;
+	item->height = cellhdr.height;
+	item->data = ui_translate_bitmap(cellhdr.width, cellhdr.height, data);
+	if (item->data != data)
+		xfree(data);
+	return True;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+precache_thread(void *arg)
+{
+	PRECACHE_ITEM *item;
+	RD_BOOL ok;
+
+	UNUSED(arg);
+
+	pthread_mutex_lock(&g_precache_lock);
+	while (g_precache_next < g_precache_count)
+	{
+		item = &g_precache[g_precache_next++];
+		item->state = PRECACHE_LOADING;
+		pthread_mutex_unlock(&g_precache_lock);
+
+		ok = precache_prepare(item);
+
+		pthread_mutex_lock(&g_precache_lock);
+		item->state = ok ? PRECACHE_READY : PRECACHE_DONE;
+	}
+
+	g_precache_workers--;
+	pthread_mutex_unlock(&g_precache_lock);
+	return NULL;
+}
+#endif
+
+/* Queue the first count cells for precaching */
+static void
+precache_start(uint8 id, int count)
+{
+	int n;
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+	long workers;
+#endif
+
+	if (count == 0)
+		return;
+
+	g_precache = (PRECACHE_ITEM *) xmalloc(count * sizeof(PRECACHE_ITEM));
+	for (n = 0; n < count; n++)
+	{
+		memcpy(g_precache[n].key, g_pstcache_cells[id][n].key, sizeof(HASH_KEY));
+		g_precache[n].state = PRECACHE_QUEUED;
+		g_precache[n].data = NULL;
+	}
+
+	g_precache_id = id;
+	g_precache_count = count;
+	g_precache_next = g_precache_upload = 0;
+
+#ifdef HAVE_PTHREAD
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+	workers = MAX(MIN(workers, PRECACHE_MAX_WORKERS), 1);
+
+	/* without workers, pstcache_precache reads the cells itself */
+	pthread_mutex_lock(&g_precache_lock);
+	while (workers--)
+	{
+		if (pthread_create(&thread, NULL, precache_thread, NULL) != 0)
+			break;
+		pthread_detach(thread);
+		g_precache_workers++;
+	}
+	pthread_mutex_unlock(&g_precache_lock);
+#endif
+}
+
+/* Turn a prepared cell into a bitmap, unless the server has reused the
+   cell for another bitmap meanwhile */
+static RD_HBITMAP
+precache_bitmap(uint16 cache_idx)
+{
+	PRECACHE_ITEM *item = &g_precache[cache_idx];
+	RD_HBITMAP bitmap = NULL;
+
+	if (memcmp(item->key, g_pstcache_cells[g_precache_id][cache_idx].key, sizeof(HASH_KEY)) == 0)
+		bitmap = ui_create_translated_bitmap(item->width, item->height, item->data);
+
+	xfree(item->data);
+	item->data = NULL;
+	item->state = PRECACHE_DONE;
+	return bitmap;
+}
+
+/* Upload a batch of precached bitmaps; called between PDUs */
+void
+pstcache_precache(void)
+{
+	PRECACHE_ITEM *item;
+	RD_HBITMAP bitmap;
+	int n = 0, state;
+
+	if (g_precache == NULL)
+		return;
+
+	while ((n < PRECACHE_BATCH) && (g_precache_upload < g_precache_count))
+	{
+		item = &g_precache[g_precache_upload];
+
+		PRECACHE_LOCK();
+		state = item->state;
+		if ((state == PRECACHE_QUEUED) && (g_precache_workers == 0))
+		{
+			g_precache_next++;
+			PRECACHE_UNLOCK();
+			state = precache_prepare(item) ? PRECACHE_READY : PRECACHE_DONE;
+			PRECACHE_LOCK();
+			item->state = state;
+		}
+		PRECACHE_UNLOCK();
+
+		/* keep to MRU order */
+		if ((state == PRECACHE_QUEUED) || (state == PRECACHE_LOADING))
+			break;
+
+		if (state == PRECACHE_READY)
+		{
+			bitmap = precache_bitmap(g_precache_upload);
+			if (bitmap != NULL)
+				cache_preload_bitmap(g_precache_id, g_precache_upload, bitmap);
+			n++;
+		}
+
+		g_precache_upload++;
+	}
+
+	if (g_precache_upload == g_precache_count)
+	{
+		DEBUG_RDP5(("Precached %d bitmaps.\n", g_precache_count));
+		PRECACHE_LOCK();
+		xfree(g_precache);
+		g_precache = NULL;
+		g_precache_count = g_precache_next = g_precache_upload = 0;
+		PRECACHE_UNLOCK();
+	}
+}
+
 
 /* Update mru stamp/index for a bitmap */
 void
 pstcache_touch_bitmap(uint8 cache_id, uint16 cache_idx, uint32 stamp)
 {
-	int fd;
+	CELLHEADER *cellhdr;
+	PSTCACHE_SLOT *slot;
+	uint32 offset;
 
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return;
 
-	fd = g_pstcache_fd[cache_id];
-	rd_lseek_file(fd, 12 + cache_idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_write_file(fd, &stamp, sizeof(stamp));
+	cellhdr = &g_pstcache_cells[cache_id][cache_idx];
+	cellhdr->stamp = stamp;
+	if ((stamp == 0) || (cellhdr->length == 0))
+		return;
+
+	/* Stamps are handed out in order, so the shared stamps order the
+	   bitmaps of the last client to exit after those of earlier ones.
+	   Two clients exiting at once may mix their orders, which is
+	   harmless. */
+	slot = find_slot(cache_id, cellhdr->key, &offset);
+	if (slot != NULL)
+		slot->stamp = ++g_pstcache_hdr[cache_id]->clock;
 }
 
 /* Load a bitmap from the persistent cache */
 RD_BOOL
 pstcache_load_bitmap(uint8 cache_id, uint16 cache_idx)
 {
-	uint8 *celldata;
-	int fd;
 	CELLHEADER cellhdr;
 	RD_HBITMAP bitmap;
+	int state;
+#ifdef HAVE_PTHREAD
+	PSTCACHE_WRITE *entry;
+#endif
 
 	if (!g_bitmap_cache_persist_enable)
 		return False;
@@ -63,17 +543,56 @@ pstcache_load_bitmap(uint8 cache_id, uint16 cache_idx)
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return False;
 
-	fd = g_pstcache_fd[cache_id];
-	rd_lseek_file(fd, cache_idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_read_file(fd, &cellhdr, sizeof(CELLHEADER));
-	celldata = (uint8 *) xmalloc(cellhdr.length);
-	rd_read_file(fd, celldata, cellhdr.length);
+	/* Needed before its turn to be precached */
+	if ((g_precache != NULL) && (cache_id == g_precache_id)
+	    && (cache_idx >= g_precache_upload) && (cache_idx < g_precache_count))
+	{
+		PRECACHE_LOCK();
+		state = g_precache[cache_idx].state;
+		PRECACHE_UNLOCK();
+
+		if ((state == PRECACHE_READY) && ((bitmap = precache_bitmap(cache_idx)) != NULL))
+		{
+			DEBUG(("Load bitmap from precache: id=%d, idx=%d, bmp=%p)\n", cache_id,
+			       cache_idx, bitmap));
+			cache_put_bitmap(cache_id, cache_idx, bitmap);
+			return True;
+		}
+	}
+
+#ifdef HAVE_PTHREAD
+	if (g_pstcache_writer_started)
+	{
+		pthread_mutex_lock(&g_pstcache_lock);
+		entry = find_pending(cache_id, cache_idx);
+		if (entry != NULL)
+		{
+			bitmap = ui_create_bitmap(entry->cellhdr.width, entry->cellhdr.height,
+						  entry->data);
+			pthread_mutex_unlock(&g_pstcache_lock);
+			DEBUG(("Load bitmap from write queue: id=%d, idx=%d, bmp=%p)\n", cache_id,
+			       cache_idx, bitmap));
+			cache_put_bitmap(cache_id, cache_idx, bitmap);
+			return True;
+		}
+		pthread_mutex_unlock(&g_pstcache_lock);
+	}
+#endif
+
+	if (g_pstcache_cells[cache_id][cache_idx].length == 0)
+		return False;
+
+	if (!read_cell(cache_id, g_pstcache_cells[cache_id][cache_idx].key, &cellhdr,
+		       g_pstcache_buffer))
+	{
+		DEBUG(("Bitmap no longer in cache file: id=%d, idx=%d\n", cache_id, cache_idx));
+		return False;
+	}
 
-	bitmap = ui_create_bitmap(cellhdr.width, cellhdr.height, celldata);
+	bitmap = ui_create_bitmap(cellhdr.width, cellhdr.height, g_pstcache_buffer);
 	DEBUG(("Load bitmap from disk: id=%d, idx=%d, bmp=%p)\n", cache_id, cache_idx, bitmap));
 	cache_put_bitmap(cache_id, cache_idx, bitmap);
 
-	xfree(celldata);
 	return True;
 }
 
@@ -82,35 +601,112 @@ RD_BOOL
 pstcache_save_bitmap(uint8 cache_id, uint16 cache_idx, uint8 * key,
 		     uint8 width, uint8 height, uint16 length, uint8 * data)
 {
-	int fd;
 	CELLHEADER cellhdr;
+#ifdef HAVE_PTHREAD
+	PSTCACHE_WRITE *entry;
+	int n;
+#endif
 
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return False;
 
+	if (length > g_pstcache_cell_size)
+		return False;
+
 	memcpy(cellhdr.key, key, sizeof(HASH_KEY));
 	cellhdr.width = width;
 	cellhdr.height = height;
 	cellhdr.length = length;
 	cellhdr.stamp = 0;
+	memcpy(&g_pstcache_cells[cache_id][cache_idx], &cellhdr, sizeof(CELLHEADER));
+
+#ifdef HAVE_PTHREAD
+	if (g_pstcache_writer_started)
+	{
+		pthread_mutex_lock(&g_pstcache_lock);
+
+		/* A queued write of the same cell that has not been picked up
+		   yet is simply replaced */
+		entry = find_pending(cache_id, cache_idx);
+		if ((entry == &g_pstcache_queue[g_pstcache_queue_head]) && g_pstcache_writing)
+			entry = NULL;
 
-	fd = g_pstcache_fd[cache_id];
-	rd_lseek_file(fd, cache_idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_write_file(fd, &cellhdr, sizeof(CELLHEADER));
-	rd_write_file(fd, data, length);
+		if (entry == NULL)
+		{
+			while (g_pstcache_queue_count == PSTCACHE_QUEUE_SIZE)
+				pthread_cond_wait(&g_pstcache_written, &g_pstcache_lock);
+
+			n = (g_pstcache_queue_head + g_pstcache_queue_count) % PSTCACHE_QUEUE_SIZE;
+			entry = &g_pstcache_queue[n];
+			entry->cache_id = cache_id;
+			entry->cache_idx = cache_idx;
+			g_pstcache_queue_count++;
+			pthread_cond_signal(&g_pstcache_queued);
+		}
 
+		memcpy(&entry->cellhdr, &cellhdr, sizeof(CELLHEADER));
+		memcpy(entry->data, data, length);
+		pthread_mutex_unlock(&g_pstcache_lock);
+		return True;
+	}
+#endif
+
+	write_cell(cache_id, &cellhdr, data);
 	return True;
 }
 
+/* Wait until all saved bitmaps are in the cache file */
+void
+pstcache_flush(void)
+{
+#ifdef HAVE_PTHREAD
+	if (!g_pstcache_writer_started)
+		return;
+
+	pthread_mutex_lock(&g_pstcache_lock);
+	while (g_pstcache_queue_count > 0)
+		pthread_cond_wait(&g_pstcache_written, &g_pstcache_lock);
+	pthread_mutex_unlock(&g_pstcache_lock);
+#endif
+}
+
+static int
+mru_compare(const void *a, const void *b)
+{
+	const MRU_ENTRY *ea = (const MRU_ENTRY *) a;
+	const MRU_ENTRY *eb = (const MRU_ENTRY *) b;
+
+	if (ea->stamp != eb->stamp)
+		return (ea->stamp < eb->stamp) ? -1 : 1;
+	return ea->idx - eb->idx;
+}
+
+/* Most recently used first, then most recently written */
+static int
+slot_compare(const void *a, const void *b)
+{
+	const SLOT_ENTRY *ea = (const SLOT_ENTRY *) a;
+	const SLOT_ENTRY *eb = (const SLOT_ENTRY *) b;
+
+	if (ea->stamp != eb->stamp)
+		return (ea->stamp > eb->stamp) ? -1 : 1;
+	if (ea->age != eb->age)
+		return (ea->age < eb->age) ? -1 : 1;
+	return ea->slot - eb->slot;
+}
+
 /* List the bitmap keys from the persistent cache file */
 int
 pstcache_enumerate(uint8 id, HASH_KEY * keylist)
 {
-	int fd, n;
+	int n, count, precache = 0;
 	uint16 idx;
-	sint16 mru_idx[0xa00];
-	uint32 mru_stamp[0xa00];
-	CELLHEADER cellhdr;
+	uint32 head;
+	sint16 mru_idx[BMPCACHE2_NUM_PSTCELLS];
+	MRU_ENTRY mru[BMPCACHE2_NUM_PSTCELLS];
+	SLOT_ENTRY *slots;
+	PSTCACHE_SLOT *slot;
+	CELLHEADER *cellhdr;
 
 	if (!(g_bitmap_cache && g_bitmap_cache_persist_enable && IS_PERSISTENT(id)))
 		return 0;
@@ -120,38 +716,53 @@ pstcache_enumerate(uint8 id, HASH_KEY * keylist)
 		return 0;
 
 	DEBUG_RDP5(("Persistent bitmap cache enumeration... "));
-	for (idx = 0; idx < BMPCACHE2_NUM_PSTCELLS; idx++)
+
+	/* The file holds more keys than the server has cells; offer the
+	   ones used most recently by any client */
+	slots = (SLOT_ENTRY *) xmalloc(PSTCACHE_NUM_SLOTS * sizeof(SLOT_ENTRY));
+	head = g_pstcache_hdr[id]->head;
+	count = 0;
+	for (n = 0; n < PSTCACHE_NUM_SLOTS; n++)
 	{
-		fd = g_pstcache_fd[id];
-		rd_lseek_file(fd, idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-		if (rd_read_file(fd, &cellhdr, sizeof(CELLHEADER)) <= 0)
-			break;
+		slot = &g_pstcache_slots[id][n];
+		if ((memcmp(slot->key, zero_key, sizeof(HASH_KEY)) == 0) || !log_valid(id, slot->offset)
+		    || (memcmp(log_cell(id, slot->offset)->key, slot->key, sizeof(HASH_KEY)) != 0))
+			continue;
+
+		slots[count].stamp = slot->stamp;
+		slots[count].age = head - slot->offset;
+		slots[count].slot = n;
+		count++;
+	}
 
-		if (memcmp(cellhdr.key, zero_key, sizeof(HASH_KEY)) != 0)
-		{
-			memcpy(keylist[idx], cellhdr.key, sizeof(HASH_KEY));
+	qsort(slots, count, sizeof(SLOT_ENTRY), slot_compare);
 
-			/* Pre-cache (not possible for 8 bit colour depth cause it needs a colourmap) */
-			if (g_bitmap_cache_precache && cellhdr.stamp && g_server_depth > 8)
-				pstcache_load_bitmap(id, idx);
+	for (idx = 0; idx < MIN(count, BMPCACHE2_NUM_PSTCELLS); idx++)
+	{
+		slot = &g_pstcache_slots[id][slots[idx].slot];
+		cellhdr = &g_pstcache_cells[id][idx];
+		memcpy(cellhdr, log_cell(id, slot->offset), sizeof(CELLHEADER));
+		cellhdr->stamp = slots[idx].stamp;
 
-			/* Sort by stamp */
-			for (n = idx; n > 0 && cellhdr.stamp < mru_stamp[n - 1]; n--)
-			{
-				mru_idx[n] = mru_idx[n - 1];
-				mru_stamp[n] = mru_stamp[n - 1];
-			}
+		memcpy(keylist[idx], cellhdr->key, sizeof(HASH_KEY));
 
-			mru_idx[n] = idx;
-			mru_stamp[n] = cellhdr.stamp;
-		}
-		else
-		{
-			break;
-		}
+		/* Pre-cache (not possible for 8 bit colour depth cause it needs a colourmap).
+		   The stamped cells come first. */
+		if (g_bitmap_cache_precache && cellhdr->stamp && g_server_depth > 8)
+			precache = idx + 1;
+
+		mru[idx].stamp = cellhdr->stamp;
+		mru[idx].idx = idx;
 	}
 
+	xfree(slots);
 	DEBUG_RDP5(("%d cached bitmaps.\n", idx));
+	precache_start(id, precache);
+
+	/* Sort by stamp */
+	qsort(mru, idx, sizeof(MRU_ENTRY), mru_compare);
+	for (n = 0; n < idx; n++)
+		mru_idx[n] = mru[n].idx;
 
 	cache_rebuild_bmpcache_linked_list(id, mru_idx, idx);
 	g_pstcache_enumerated = True;
@@ -164,6 +775,9 @@ pstcache_init(uint8 cache_id)
 {
 	int fd;
 	char filename[256];
+	uint32 slot_offset, log_offset, log_size;
+	PSTCACHE_HEADER *hdr;
+	uint8 *map;
 
 	if (g_pstcache_enumerated)
 		return True;
@@ -187,13 +801,67 @@ pstcache_init(uint8 cache_id)
 	if (fd == -1)
 		return False;
 
-	if (!rd_lock_file(fd, 0, 0))
+	/* Room for twice the server's cells, so that a cell offered to the
+	   server is unlikely to be overwritten by other clients before it
+	   is used. The file is sparse until it fills up. */
+	g_pstcache_cell_size = MAX_CELL_SIZE * g_pstcache_Bpp;
+	log_size = 1;
+	while (log_size < 2 * BMPCACHE2_NUM_PSTCELLS * g_pstcache_cell_size)
+		log_size <<= 1;
+	slot_offset = sizeof(PSTCACHE_HEADER);
+	log_offset = (slot_offset + PSTCACHE_NUM_SLOTS * sizeof(PSTCACHE_SLOT) + 4095) & ~4095;
+
+	map = (uint8 *) rd_map_file(fd, log_offset + log_size);
+	if (map == NULL)
+	{
+		rd_close_file(fd);
+		return False;
+	}
+
+	if (!rd_lock_file_wait(fd, 0, 1))
 	{
-		warning("Persistent bitmap caching is disabled. (The file is already in use)\n");
+		rd_unmap_file(map, log_offset + log_size);
 		rd_close_file(fd);
 		return False;
 	}
 
+	/* Files in any other layout, including that of older versions, are
+	   started over */
+	hdr = (PSTCACHE_HEADER *) map;
+	if ((hdr->magic != PSTCACHE_MAGIC) || (hdr->version != PSTCACHE_VERSION)
+	    || (hdr->Bpp != g_pstcache_Bpp) || (hdr->num_slots != PSTCACHE_NUM_SLOTS)
+	    || (hdr->log_size != log_size) || (hdr->slot_offset != slot_offset)
+	    || (hdr->log_offset != log_offset))
+	{
+		DEBUG(("persistent bitmap cache file has an unknown layout, clearing it\n"));
+		hdr->magic = 0;
+		memset(map + slot_offset, 0, PSTCACHE_NUM_SLOTS * sizeof(PSTCACHE_SLOT));
+		hdr->version = PSTCACHE_VERSION;
+		hdr->Bpp = g_pstcache_Bpp;
+		hdr->num_slots = PSTCACHE_NUM_SLOTS;
+		hdr->log_size = log_size;
+		hdr->slot_offset = slot_offset;
+		hdr->log_offset = log_offset;
+		hdr->head = 0;
+		hdr->clock = 0;
+		hdr->magic = PSTCACHE_MAGIC;
+	}
+
+	rd_unlock_file(fd, 0, 1);
+
+	if (g_pstcache_cells[cache_id] == NULL)
+		g_pstcache_cells[cache_id] =
+			(CELLHEADER *) xmalloc(BMPCACHE2_NUM_PSTCELLS * sizeof(CELLHEADER));
+	memset(g_pstcache_cells[cache_id], 0, BMPCACHE2_NUM_PSTCELLS * sizeof(CELLHEADER));
+
+	g_pstcache_buffer = (uint8 *) xrealloc(g_pstcache_buffer, g_pstcache_cell_size);
+
+	g_pstcache_hdr[cache_id] = hdr;
+	g_pstcache_slots[cache_id] = (PSTCACHE_SLOT *) (map + slot_offset);
+	g_pstcache_log[cache_id] = map + log_offset;
 	g_pstcache_fd[cache_id] = fd;
+#ifdef HAVE_PTHREAD
+	start_writer();
+#endif
 	return True;
 }
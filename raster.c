@@ -0,0 +1,628 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Software raster operations
+   Copyright (C) the rdesktop developers
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rdesktop.h"
+
+/*
+ * Drawing into SURFACEs in memory. Ternary raster operations are bitwise,
+ * so they are evaluated on the bytes of a pattern row (P), a source row
+ * (S) and a destination row (D), whatever the pixel format. Patterns and
+ * colours are expanded into rows in the format of the destination first.
+ */
+
+static uint8 *g_pat_row = NULL;
+static uint8 *g_src_row = NULL;
+static int g_row_size = 0;
+
+static void
+reserve_rows(int size)
+{
+	if (size <= g_row_size)
+		return;
+
+	g_pat_row = (uint8 *) xrealloc(g_pat_row, size);
+	g_src_row = (uint8 *) xrealloc(g_src_row, size);
+	g_row_size = size;
+}
+
+static void
+colour_bytes(SURFACE * s, uint32 colour, uint8 * out)
+{
+	int i;
+
+	for (i = 0; i < s->Bpp; i++)
+	{
+		if (s->big_endian)
+			out[i] = colour >> ((s->Bpp - 1 - i) * 8);
+		else
+			out[i] = colour >> (i * 8);
+	}
+}
+
+/* Expand the pattern into a row of cx pixels starting at x, y */
+static void
+pattern_row(SURFACE * dst, PATTERN * pattern, int x, int y, int cx, uint8 * out)
+{
+	uint8 fg[4], bg[4], bits, *tile;
+	int Bpp = dst->Bpp;
+	int i, col, done, total;
+
+	colour_bytes(dst, pattern->fgcolour, fg);
+	colour_bytes(dst, pattern->bgcolour, bg);
+
+	/* one period of the pattern, then repeat it */
+	for (i = 0; (i < 8) && (i < cx); i++)
+	{
+		col = (x + i - pattern->xorigin) & 7;
+		if (pattern->tile != NULL)
+		{
+			tile = pattern->tile->data
+				+ ((y - pattern->yorigin) & 7) * pattern->tile->stride;
+			memcpy(out + i * Bpp, tile + col * Bpp, Bpp);
+		}
+		else if (pattern->mask != NULL)
+		{
+			bits = pattern->mask[(y - pattern->yorigin) & 7];
+			memcpy(out + i * Bpp, (bits & (0x80 >> col)) ? fg : bg, Bpp);
+		}
+		else
+		{
+			memcpy(out + i * Bpp, fg, Bpp);
+		}
+	}
+
+	done = i * Bpp;
+	total = cx * Bpp;
+	while (done < total)
+	{
+		i = MIN(done, total - done);
+		memcpy(out + done, out, i);
+		done += i;
+	}
+}
+
+/* The common ROPs are written out, so that the compiler can keep them
+   tight. Unless the platform needs aligned access, they work a word at
+   a time and finish off byte by byte. */
+#define D	(*(rop_t *) (d + i))
+#define S	(*(rop_t *) (s + i))
+#define P	(*(rop_t *) (p + i))
+
+#define ROP_PASS(type, expr) \
+{ \
+	typedef type rop_t; \
+	for (; i + (int) sizeof(rop_t) <= n; i += sizeof(rop_t)) \
+		D = (rop_t) (expr); \
+}
+
+#ifdef NEED_ALIGN
+#define ROP(expr)	{ ROP_PASS(uint8, expr) } break;
+#else
+#define ROP(expr)	{ ROP_PASS(uint32, expr) ROP_PASS(uint8, expr) } break;
+#endif
+
+/* Any other ROP, as the sum of the minterms it has set */
+static void
+rop_generic(uint8 rop, uint8 * d, uint8 * s, uint8 * p, int n)
+{
+	uint32 r, t;
+	int i = 0, m, k;
+
+	while (i < n)
+	{
+#ifdef NEED_ALIGN
+		k = 1;
+#else
+		k = (i + 4 <= n) ? 4 : 1;
+#endif
+		r = 0;
+		for (m = 0; m < 8; m++)
+		{
+			if (!(rop & (1 << m)))
+				continue;
+
+			if (k == 4)
+			{
+				t = (m & 4) ? *(uint32 *) (p + i) : ~*(uint32 *) (p + i);
+				t &= (m & 2) ? *(uint32 *) (s + i) : ~*(uint32 *) (s + i);
+				t &= (m & 1) ? *(uint32 *) (d + i) : ~*(uint32 *) (d + i);
+			}
+			else
+			{
+				t = (m & 4) ? p[i] : ~p[i];
+				t &= (m & 2) ? s[i] : ~s[i];
+				t &= (m & 1) ? d[i] : ~d[i];
+			}
+			r |= t;
+		}
+
+		if (k == 4)
+			*(uint32 *) (d + i) = r;
+		else
+			d[i] = (uint8) r;
+		i += k;
+	}
+}
+
+static void
+rop_row(uint8 rop, uint8 * d, uint8 * s, uint8 * p, int n)
+{
+	int i = 0;
+
+	switch (rop)
+	{
+		case 0x00:	/* BLACKNESS */
+			memset(d, 0, n);
+			break;
+		case 0xff:	/* WHITENESS */
+			memset(d, 0xff, n);
+			break;
+		case 0xaa:	/* D */
+			break;
+		case 0xcc:	/* SRCCOPY */
+			memcpy(d, s, n);
+			break;
+		case 0xf0:	/* PATCOPY */
+			memcpy(d, p, n);
+			break;
+		case 0x55:	/* DSTINVERT */
+			ROP(~D);
+		case 0x33:	/* NOTSRCCOPY */
+			ROP(~S);
+		case 0x0f:	/* PATNOT */
+			ROP(~P);
+		case 0x66:	/* SRCINVERT */
+			ROP(D ^ S);
+		case 0x88:	/* SRCAND */
+			ROP(D & S);
+		case 0xee:	/* SRCPAINT */
+			ROP(D | S);
+		case 0x44:	/* SRCERASE */
+			ROP(S & ~D);
+		case 0x11:	/* NOTSRCERASE */
+			ROP(~(D | S));
+		case 0x99:	/* DSxn */
+			ROP(~(D ^ S));
+		case 0x22:	/* DSna */
+			ROP(D & ~S);
+		case 0xbb:	/* MERGEPAINT */
+			ROP(D | ~S);
+		case 0x5a:	/* PATINVERT */
+			ROP(D ^ P);
+		case 0xa5:	/* PDxn */
+			ROP(~(D ^ P));
+		case 0xa0:	/* DPa */
+			ROP(D & P);
+		case 0xfa:	/* DPo */
+			ROP(D | P);
+		case 0x0a:	/* DPna */
+			ROP(D & ~P);
+		case 0xc0:	/* MERGECOPY */
+			ROP(S & P);
+		case 0xfb:	/* PATPAINT */
+			ROP(D | P | ~S);
+		case 0x69:	/* PDSxxn */
+			ROP(~(P ^ D ^ S));
+		case 0x96:	/* DSPxx */
+			ROP(D ^ S ^ P);
+		case 0xb8:	/* PSDPxax */
+			ROP(((D ^ P) & S) ^ P);
+		case 0xe2:	/* DSPDxax */
+			ROP(((P ^ D) & S) ^ D);
+		case 0xca:	/* DPSDxax */
+			ROP(((S ^ D) & P) ^ D);
+		default:
+			rop_generic(rop, d, s, p, n);
+	}
+}
+
+#undef D
+#undef S
+#undef P
+
+void
+raster_set_clip(SURFACE * s, int x, int y, int cx, int cy)
+{
+	s->clip_x1 = MAX(x, 0);
+	s->clip_y1 = MAX(y, 0);
+	s->clip_x2 = MIN(x + cx, s->width);
+	s->clip_y2 = MIN(y + cy, s->height);
+}
+
+void
+raster_reset_clip(SURFACE * s)
+{
+	raster_set_clip(s, 0, 0, s->width, s->height);
+}
+
+/* Intersect a rectangle with the clip rectangle of the destination and,
+   if there is a source, with the source surface. The source position
+   moves along with the top left corner. */
+RD_BOOL
+raster_clip(SURFACE * dst, int *x, int *y, int *cx, int *cy, SURFACE * src, int *srcx,
+	    int *srcy)
+{
+	int x1 = MAX(*x, dst->clip_x1);
+	int y1 = MAX(*y, dst->clip_y1);
+	int x2 = MIN(*x + *cx, dst->clip_x2);
+	int y2 = MIN(*y + *cy, dst->clip_y2);
+
+	if (src != NULL)
+	{
+		x1 = MAX(x1, *x - *srcx);
+		y1 = MAX(y1, *y - *srcy);
+		x2 = MIN(x2, *x - *srcx + src->width);
+		y2 = MIN(y2, *y - *srcy + src->height);
+	}
+
+	if ((x1 >= x2) || (y1 >= y2))
+		return False;
+
+	if (src != NULL)
+	{
+		*srcx += x1 - *x;
+		*srcy += y1 - *y;
+	}
+
+	*x = x1;
+	*y = y1;
+	*cx = x2 - x1;
+	*cy = y2 - y1;
+	return True;
+}
+
+/* Apply a ternary ROP to a rectangle. The source must be in the format of
+   the destination, and may be the destination itself. */
+void
+raster_blt(SURFACE * dst, uint8 rop, int x, int y, int cx, int cy,
+	   SURFACE * src, int srcx, int srcy, PATTERN * pattern)
+{
+	uint8 *d, *s;
+	RD_BOOL use_p, solid;
+	int n, dir;
+
+	if (!ROP3_USES_S(rop))
+		src = NULL;
+	else if (src == NULL)
+		return;
+
+	use_p = ROP3_USES_P(rop);
+	if (use_p && (pattern == NULL))
+		return;
+
+	if (!raster_clip(dst, &x, &y, &cx, &cy, src, &srcx, &srcy))
+		return;
+
+	n = cx * dst->Bpp;
+	reserve_rows(n);
+
+	/* a solid pattern is the same on every row */
+	solid = use_p && (pattern->tile == NULL) && (pattern->mask == NULL);
+	if (solid)
+		pattern_row(dst, pattern, x, y, cx, g_pat_row);
+
+	dir = 1;
+	if ((src == dst) && (srcy < y))
+	{
+		/* bottom up, so the source is read before it is overwritten */
+		y += cy - 1;
+		srcy += cy - 1;
+		dir = -1;
+	}
+
+	while (cy--)
+	{
+		d = dst->data + y * dst->stride + x * dst->Bpp;
+		s = d;
+		if (src != NULL)
+		{
+			s = src->data + srcy * src->stride + srcx * src->Bpp;
+			if (src == dst)
+			{
+				memcpy(g_src_row, s, n);
+				s = g_src_row;
+			}
+		}
+
+		if (use_p && !solid)
+			pattern_row(dst, pattern, x, y, cx, g_pat_row);
+
+		rop_row(rop, d, s, g_pat_row, n);
+		y += dir;
+		srcy += dir;
+	}
+}
+
+/* Draw a monochrome mask in the foreground colour. Clear bits are drawn
+   in the background colour if opaque is set, otherwise they are left
+   alone. Mask pixel maskx, masky goes to x, y. */
+void
+raster_stipple(SURFACE * dst, int x, int y, int cx, int cy, uint8 * mask, int scanline,
+	       int maskx, int masky, uint32 fgcolour, uint32 bgcolour, RD_BOOL opaque)
+{
+	uint8 fg[4], bg[4], *row, *out;
+	int Bpp = dst->Bpp;
+	int ox = x, oy = y;
+	int i, bit;
+
+	if (!raster_clip(dst, &x, &y, &cx, &cy, NULL, NULL, NULL))
+		return;
+
+	maskx += x - ox;
+	masky += y - oy;
+	colour_bytes(dst, fgcolour, fg);
+	colour_bytes(dst, bgcolour, bg);
+
+	while (cy--)
+	{
+		row = mask + masky * scanline;
+		out = dst->data + y * dst->stride + x * Bpp;
+		for (i = 0; i < cx; i++)
+		{
+			bit = maskx + i;
+			if (row[bit >> 3] & (0x80 >> (bit & 7)))
+				memcpy(out, fg, Bpp);
+			else if (opaque)
+				memcpy(out, bg, Bpp);
+			out += Bpp;
+		}
+
+		y++;
+		masky++;
+	}
+}
+
+static void
+span(SURFACE * dst, uint8 rop, int x1, int x2, int y, PATTERN * pattern)
+{
+	if (x1 < x2)
+		raster_blt(dst, rop, x1, y, x2 - x1, 1, NULL, 0, 0, pattern);
+}
+
+/* A thin line in the given colour. The end point is left out unless
+   draw_last is set, so that the joints of a polyline are drawn once. */
+void
+raster_line(SURFACE * dst, uint8 rop, int startx, int starty, int endx, int endy,
+	    RD_BOOL draw_last, uint32 colour)
+{
+	PATTERN pen;
+	int dx, dy, sx, sy, err, e2, runx, lastx, runy;
+
+	pen.fgcolour = pen.bgcolour = colour;
+	pen.mask = NULL;
+	pen.tile = NULL;
+	pen.xorigin = pen.yorigin = 0;
+
+	dx = abs(endx - startx);
+	dy = -abs(endy - starty);
+	sx = (startx < endx) ? 1 : -1;
+	sy = (starty < endy) ? 1 : -1;
+	err = dx + dy;
+
+	if (!draw_last && (startx == endx) && (starty == endy))
+		return;
+
+	/* pixels on the same scanline are drawn as one span */
+	runx = lastx = startx;
+	runy = starty;
+	while (True)
+	{
+		if (!draw_last && (startx == endx) && (starty == endy))
+			break;
+
+		if (starty != runy)
+		{
+			span(dst, rop, MIN(runx, lastx), MAX(runx, lastx) + 1, runy, &pen);
+			runx = startx;
+			runy = starty;
+		}
+		lastx = startx;
+
+		if ((startx == endx) && (starty == endy))
+			break;
+
+		e2 = 2 * err;
+		if (e2 >= dy)
+		{
+			err += dy;
+			startx += sx;
+		}
+		if (e2 <= dx)
+		{
+			err += dx;
+			starty += sy;
+		}
+	}
+
+	span(dst, rop, MIN(runx, lastx), MAX(runx, lastx) + 1, runy, &pen);
+}
+
+/* floor(a / b) for b > 0 */
+static long
+floor_div(long a, long b)
+{
+	return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+/* Fill a polygon given as a point list in the style of CoordModePrevious.
+   A pixel is inside if its centre is; centres on an edge belong to the
+   interior on their right. */
+void
+raster_polygon(SURFACE * dst, uint8 rop, uint8 fillmode, RD_POINT * points, int npoints,
+	       PATTERN * pattern)
+{
+	int *px, *py, *cross, *dirs;
+	int i, j, k, ncross, x0, y0, x1, y1, y, miny, maxy, winding, t;
+	long dy;
+
+	if (npoints < 2)
+		return;
+
+	px = (int *) xmalloc(sizeof(int) * npoints * 4);
+	py = px + npoints;
+	cross = py + npoints;
+	dirs = cross + npoints;
+
+	px[0] = points[0].x;
+	py[0] = miny = maxy = points[0].y;
+	for (i = 1; i < npoints; i++)
+	{
+		px[i] = px[i - 1] + points[i].x;
+		py[i] = py[i - 1] + points[i].y;
+		miny = MIN(miny, py[i]);
+		maxy = MAX(maxy, py[i]);
+	}
+
+	miny = MAX(miny, dst->clip_y1);
+	maxy = MIN(maxy, dst->clip_y2);
+
+	for (y = miny; y < maxy; y++)
+	{
+		/* crossings of the scanline through the pixel centres */
+		ncross = 0;
+		for (i = 0; i < npoints; i++)
+		{
+			j = (i + 1) % npoints;
+			x0 = px[i];
+			y0 = py[i];
+			x1 = px[j];
+			y1 = py[j];
+			if (y0 == y1)
+				continue;
+
+			dirs[ncross] = (y0 < y1) ? 1 : -1;
+			if (y0 > y1)
+			{
+				t = x0, x0 = x1, x1 = t;
+				t = y0, y0 = y1, y1 = t;
+			}
+
+			if ((y < y0) || (y >= y1))
+				continue;
+
+			/* first pixel whose centre is at or right of the edge */
+			dy = y1 - y0;
+			cross[ncross] = (int) -floor_div(-(2 * x0 * dy + (2 * (y - y0) + 1)
+							   * (long) (x1 - x0) - dy), 2 * dy);
+			ncross++;
+		}
+
+		/* insertion sort, the lists are short */
+		for (i = 1; i < ncross; i++)
+		{
+			for (k = i; (k > 0) && (cross[k - 1] > cross[k]); k--)
+			{
+				t = cross[k], cross[k] = cross[k - 1], cross[k - 1] = t;
+				t = dirs[k], dirs[k] = dirs[k - 1], dirs[k - 1] = t;
+			}
+		}
+
+		if (fillmode == WINDING)
+		{
+			winding = 0;
+			for (i = 0; i < ncross - 1; i++)
+			{
+				winding += dirs[i];
+				if (winding != 0)
+					span(dst, rop, cross[i], cross[i + 1], y, pattern);
+			}
+		}
+		else
+		{
+			for (i = 0; i + 1 < ncross; i += 2)
+				span(dst, rop, cross[i], cross[i + 1], y, pattern);
+		}
+	}
+
+	xfree(px);
+}
+
+/* The pixels of a row whose centres are inside the ellipse that fits the
+   box; right is exclusive */
+static RD_BOOL
+ellipse_span(int x, int y, int cx, int cy, int row, int *left, int *right)
+{
+	double a = cx / 2.0, b = cy / 2.0, u, v, w;
+	int i;
+
+	if ((row < y) || (row >= y + cy))
+		return False;
+
+	v = (row + 0.5 - y - b) / b;
+	w = 1.0 - v * v;
+
+	for (i = 0; i < (cx + 1) / 2; i++)
+	{
+		u = (i + 0.5 - a) / a;
+		if (u * u <= w)
+		{
+			*left = x + i;
+			*right = x + cx - i;
+			return True;
+		}
+	}
+
+	return False;
+}
+
+/* Fill an ellipse, or with a fillmode of 0 draw its outline, which like
+   XDrawArc reaches one pixel further right and down */
+void
+raster_ellipse(SURFACE * dst, uint8 rop, uint8 fillmode, int x, int y, int cx, int cy,
+	       PATTERN * pattern)
+{
+	int row, l, r, pl, pr, nl, nr, innerl, innerr;
+	RD_BOOL prev, next;
+
+	if (fillmode != 0)
+	{
+		for (row = MAX(y, dst->clip_y1); row < MIN(y + cy, dst->clip_y2); row++)
+			if (ellipse_span(x, y, cx, cy, row, &l, &r))
+				span(dst, rop, l, r, row, pattern);
+		return;
+	}
+
+	cx++;
+	cy++;
+	for (row = MAX(y, dst->clip_y1); row < MIN(y + cy, dst->clip_y2); row++)
+	{
+		if (!ellipse_span(x, y, cx, cy, row, &l, &r))
+			continue;
+
+		/* the outline is what is not covered by both neighbour rows */
+		prev = ellipse_span(x, y, cx, cy, row - 1, &pl, &pr);
+		next = ellipse_span(x, y, cx, cy, row + 1, &nl, &nr);
+		if (!prev || !next)
+		{
+			span(dst, rop, l, r, row, pattern);
+			continue;
+		}
+
+		innerl = MAX(MAX(pl, nl), l + 1);
+		innerr = MIN(MIN(pr, nr), r - 1);
+		if (innerl >= innerr)
+		{
+			span(dst, rop, l, r, row, pattern);
+			continue;
+		}
+
+		span(dst, rop, l, innerl, row, pattern);
+		span(dst, rop, innerr, r, row, pattern);
+	}
+}
@@ -25,6 +25,7 @@
 #include <pwd.h>		/* getpwuid */
 #include <termios.h>		/* tcgetattr tcsetattr */
 #include <sys/stat.h>		/* stat */
+#include <sys/mman.h>		/* mmap munmap */
 #include <sys/time.h>		/* gettimeofday */
 #include <sys/times.h>		/* times */
 #include <ctype.h>		/* toupper */
@@ -85,6 +86,8 @@ RD_BOOL g_sendmotion = True;
 RD_BOOL g_bitmap_cache = True;
 RD_BOOL g_bitmap_cache_persist_enable = False;
 RD_BOOL g_bitmap_cache_precache = True;
+int g_bmpcache_cells[3] = { BMPCACHE2_C0_CELLS, BMPCACHE2_C1_CELLS, BMPCACHE2_C2_CELLS };
+uint32 g_bmpcache_max_bytes = 0;
 RD_BOOL g_encryption = True;
 RD_BOOL g_packet_encryption = True;
 RD_BOOL g_desktop_save = True;	/* desktop save order */
@@ -99,6 +102,17 @@ RD_BOOL g_numlock_sync = False;
 RD_BOOL g_lspci_enabled = False;
 RD_BOOL g_owncolmap = False;
 RD_BOOL g_ownbackstore = True;	/* We can't rely on external BackingStore */
+RD_BOOL g_shadow_framebuffer = False;
+RD_BOOL g_recv_thread = True;
+int g_channel_share[CHANNEL_PRIORITIES] = { 3, 1 };
+int g_motion_delay = 100;
+RD_BOOL g_cache_stats = False;
+char *g_cache_stats_file = NULL;
+RD_BOOL g_order_profile = False;
+char *g_order_profile_file = NULL;
+char *g_order_record_file = NULL;
+char *g_order_replay_file = NULL;
+static volatile sig_atomic_t g_cache_stats_requested = 0;
 RD_BOOL g_seamless_rdp = False;
 RD_BOOL g_user_quit = False;
 uint32 g_embed_wnd;
@@ -225,6 +239,20 @@ usage(char *program)
 	fprintf(stderr,
 		"                   \"AKS\"              -> Device vendor name                 \n");
 #endif
+	fprintf(stderr, "   -o: set an advanced option (this flag can be repeated)\n");
+	fprintf(stderr,
+		"         '-o shadow': keep a client side copy of the screen for desktop saves\n");
+	fprintf(stderr, "         '-o bmpcache=<c0>,<c1>,<c2>': bitmap cache cells\n");
+	fprintf(stderr, "         '-o bmpcache-mem=<MB>': memory limit for persistently cached bitmaps\n");
+	fprintf(stderr, "         '-o stats[=<file>]': write cache statistics on exit\n");
+	fprintf(stderr, "         '-o profile[=<file>]': write time spent per order type on exit\n");
+	fprintf(stderr, "         '-o record=<file>': write the drawing orders received to a file\n");
+	fprintf(stderr, "         '-o replay=<file>': draw recorded orders without a server, and time it\n");
+	fprintf(stderr, "                              with '-o shadow', also checksum the screen\n");
+	fprintf(stderr, "         '-o singlethread': receive from the network on the main thread\n");
+	fprintf(stderr,
+		"         '-o chanshare=<interactive>,<bulk>': send bandwidth shares of channels\n");
+	fprintf(stderr, "         '-o motion-delay=<ms>': hold pointer motion to merge it (0 = off)\n");
 	fprintf(stderr, "   -0: attach to console\n");
 	fprintf(stderr, "   -4: use RDP version 4\n");
 	fprintf(stderr, "   -5: use RDP version 5 (default)\n");
@@ -359,10 +387,54 @@ handle_disconnect_reason(RD_BOOL deactivated, uint16 reason)
 	return retval;
 }
 
+static void
+request_cache_stats(int sig)
+{
+	UNUSED(sig);
+	g_cache_stats_requested = 1;
+}
+
+/* Write statistics, to stderr unless a file was given */
+static void
+dump_stats(char *filename, void (*dump) (FILE *))
+{
+	FILE *fp = stderr;
+
+	if (filename != NULL)
+	{
+		fp = fopen(filename, "a");
+		if (fp == NULL)
+		{
+			perror(filename);
+			return;
+		}
+	}
+
+	dump(fp);
+
+	if (fp != stderr)
+		fclose(fp);
+}
+
+/* Called from the main loop; dumps the statistics after a SIGUSR1 */
+void
+rd_check_cache_stats(void)
+{
+	if (!g_cache_stats_requested)
+		return;
+
+	g_cache_stats_requested = 0;
+	dump_stats(g_cache_stats_file, cache_dump_stats);
+	if (g_order_profile)
+		dump_stats(g_order_profile_file, order_dump_profile);
+}
+
 static void
 rdesktop_reset_state(void)
 {
 	rdp_reset_state();
+	channel_reset_state();
+	drdynvc_reset_state();
 #ifdef WITH_SCARD
 	scard_reset_state();
 #endif
@@ -469,7 +541,7 @@ main(int argc, char *argv[])
 	struct passwd *pw;
 	uint32 flags, ext_disc_reason = 0;
 	char *p;
-	int c;
+	int c, i;
 	char *locale = NULL;
 	int username_option = 0;
 	RD_BOOL geometry_option = False;
@@ -495,6 +567,10 @@ main(int argc, char *argv[])
 	act.sa_flags = 0;
 	sigaction(SIGPIPE, &act, NULL);
 
+	/* Dump cache statistics on SIGUSR1 */
+	act.sa_handler = request_cache_stats;
+	sigaction(SIGUSR1, &act, NULL);
+
 	flags = RDP_LOGON_NORMAL;
 	prompt_password = False;
 	domain[0] = password[0] = shell[0] = directory[0] = 0;
@@ -509,7 +585,7 @@ main(int argc, char *argv[])
 #endif
 
 	while ((c = getopt(argc, argv,
-			   VNCOPT "Au:L:d:s:c:p:n:k:g:fbBeEmzCDKS:T:NX:a:x:Pr:045h?")) != -1)
+			   VNCOPT "Au:L:d:s:c:p:n:k:g:fbBeEmzCDKS:T:NX:a:x:Pr:o:045h?")) != -1)
 	{
 		switch (c)
 		{
@@ -833,6 +909,86 @@ main(int argc, char *argv[])
 				}
 				break;
 
+			case 'o':
+				if (str_startswith(optarg, "shadow"))
+				{
+					g_shadow_framebuffer = True;
+				}
+				else if (str_startswith(optarg, "singlethread"))
+				{
+					g_recv_thread = False;
+				}
+				else if (str_startswith(optarg, "profile"))
+				{
+					g_order_profile = True;
+					if (optarg[7] == '=')
+						g_order_profile_file = xstrdup(optarg + 8);
+				}
+				else if (str_startswith(optarg, "record="))
+				{
+					g_order_record_file = xstrdup(optarg + 7);
+				}
+				else if (str_startswith(optarg, "replay="))
+				{
+					g_order_replay_file = xstrdup(optarg + 7);
+				}
+				else if (str_startswith(optarg, "stats"))
+				{
+					g_cache_stats = True;
+					if (optarg[5] == '=')
+						g_cache_stats_file = xstrdup(optarg + 6);
+				}
+				else if (str_startswith(optarg, "bmpcache-mem="))
+				{
+					g_bmpcache_max_bytes = strtol(optarg + 13, NULL, 10) * 1024 * 1024;
+				}
+				else if (str_startswith(optarg, "motion-delay="))
+				{
+					g_motion_delay = strtol(optarg + 13, &p, 10);
+					if ((g_motion_delay < 0) || (g_motion_delay > 1000) || (*p != '\0'))
+					{
+						error("invalid motion delay: %s\n", optarg + 13);
+						return EX_USAGE;
+					}
+				}
+				else if (str_startswith(optarg, "chanshare="))
+				{
+					p = optarg + 10;
+					for (i = 0; i < CHANNEL_PRIORITIES; i++)
+					{
+						g_channel_share[i] = strtol(p, &p, 10);
+						if ((g_channel_share[i] <= 0) || (g_channel_share[i] > 100)
+						    || (*p != ((i < CHANNEL_PRIORITIES - 1) ? ',' : '\0')))
+						{
+							error("invalid channel shares: %s\n", optarg + 10);
+							return EX_USAGE;
+						}
+						p++;
+					}
+				}
+				else if (str_startswith(optarg, "bmpcache="))
+				{
+					p = optarg + 9;
+					for (i = 0; i < (int) NUM_ELEMENTS(g_bmpcache_cells); i++)
+					{
+						/* cell 0x7fff is the waiting list */
+						g_bmpcache_cells[i] = strtol(p, &p, 10);
+						if ((g_bmpcache_cells[i] <= 0) || (g_bmpcache_cells[i] >= 0x7fff)
+						    || (*p != ((i < 2) ? ',' : '\0')))
+						{
+							error("invalid bitmap cache sizes: %s\n", optarg + 9);
+							return EX_USAGE;
+						}
+						p++;
+					}
+				}
+				else
+				{
+					error("unknown option -o %s\n", optarg);
+					return EX_USAGE;
+				}
+				break;
+
 			case '0':
 				g_console_session = True;
 				break;
@@ -853,14 +1009,26 @@ main(int argc, char *argv[])
 		}
 	}
 
-	if (argc - optind != 1)
+	/* only bitmaps that can be loaded again are ever evicted */
+	if (g_bmpcache_max_bytes && !g_bitmap_cache_persist_enable)
+		warning("-o bmpcache-mem has no effect without -P\n");
+
+	/* a replay needs no server */
+	if (argc - optind != ((g_order_replay_file != NULL) ? 0 : 1))
 	{
 		usage(argv[0]);
 		return EX_USAGE;
 	}
 
-	STRNCPY(server, argv[optind], sizeof(server));
-	parse_server_and_port(server);
+	if (g_order_replay_file != NULL)
+	{
+		STRNCPY(server, g_order_replay_file, sizeof(server));
+	}
+	else
+	{
+		STRNCPY(server, argv[optind], sizeof(server));
+		parse_server_and_port(server);
+	}
 
 	if (g_seamless_rdp)
 	{
@@ -971,9 +1139,26 @@ main(int argc, char *argv[])
 	return EX_OK;
 #else
 
+	if ((g_order_replay_file != NULL) && !order_replay_open(g_order_replay_file))
+		return EX_NOINPUT;
+
 	if (!ui_init())
 		return EX_OSERR;
 
+	if (g_order_replay_file != NULL)
+	{
+		if (!ui_create_window())
+			return EX_OSERR;
+		order_replay();
+		if (g_shadow_framebuffer)
+			fprintf(stderr, "orderreplay checksum=%08x\n", shadow_checksum());
+		ui_destroy_window();
+		if (g_order_profile)
+			dump_stats(g_order_profile_file, order_dump_profile);
+		ui_deinit();
+		return EX_OK;
+	}
+
 #ifdef WITH_RDPSND
 	if (g_rdpsnd)
 	{
@@ -986,6 +1171,7 @@ main(int argc, char *argv[])
 		lspci_init();
 
 	rdpdr_init();
+	drdynvc_init();
 
 	while (1)
 	{
@@ -1040,6 +1226,10 @@ main(int argc, char *argv[])
 	}
 
 	cache_save_state();
+	if (g_cache_stats)
+		dump_stats(g_cache_stats_file, cache_dump_stats);
+	if (g_order_profile)
+		dump_stats(g_order_profile_file, order_dump_profile);
 	ui_deinit();
 
 	if (g_user_quit)
@@ -1749,3 +1939,64 @@ rd_lock_file(int fd, int start, int len)
 		return False;
 	return True;
 }
+
+/* do a write lock on a file, waiting for other holders to release it */
+RD_BOOL
+rd_lock_file_wait(int fd, int start, int len)
+{
+	struct flock lock;
+
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = len;
+	if (fcntl(fd, F_SETLKW, &lock) == -1)
+		return False;
+	return True;
+}
+
+/* release a lock taken with rd_lock_file(_wait) */
+void
+rd_unlock_file(int fd, int start, int len)
+{
+	struct flock lock;
+
+	lock.l_type = F_UNLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = len;
+	fcntl(fd, F_SETLK, &lock);
+}
+
+/* map a file into memory, growing it to the given length first */
+void *
+rd_map_file(int fd, uint32 length)
+{
+	struct stat st;
+	void *ptr;
+
+	if (fstat(fd, &st) == -1)
+		return NULL;
+
+	if ((st.st_size < length) && (ftruncate(fd, length) == -1))
+	{
+		perror("ftruncate");
+		return NULL;
+	}
+
+	ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+	{
+		perror("mmap");
+		return NULL;
+	}
+
+	return ptr;
+}
+
+/* unmap a file mapped with rd_map_file */
+void
+rd_unmap_file(void *ptr, uint32 length)
+{
+	munmap(ptr, length);
+}
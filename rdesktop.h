@@ -168,6 +168,10 @@
 #define MAX(x,y)		(((x) > (y)) ? (x) : (y))
 #endif
 
+#define NUM_ELEMENTS(array)	(sizeof(array) / sizeof(array[0]))
+
+#define UNUSED(param)		((void) (param))
+
 /* timeval macros */
 #ifndef timerisset
 #define timerisset(tvp)\
@@ -26,6 +26,10 @@
 #include "rdesktop.h"
 #include "ssl.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #ifdef HAVE_ICONV
 #ifdef HAVE_ICONV_H
 #include <iconv.h>
@@ -52,6 +56,7 @@ extern int g_width;
 extern int g_height;
 extern RD_BOOL g_bitmap_cache;
 extern RD_BOOL g_bitmap_cache_persist_enable;
+extern int g_bmpcache_cells[];
 extern RD_BOOL g_numlock_sync;
 extern RD_BOOL g_pending_resize;
 
@@ -74,6 +79,54 @@ extern uint32 g_reconnect_logonid;
 extern char g_reconnect_random[16];
 extern RD_BOOL g_has_reconnect_random;
 extern uint8 g_client_random[SEC_RANDOM_SIZE];
+extern int g_motion_delay;
+
+/* The rectangles of a bitmap update are decompressed and converted to
+   the display's format by a pool of worker threads and the main thread
+   together, and then painted in order by the main thread. */
+#define BITMAP_MAX_WORKERS	8
+
+typedef struct _BITMAP_UPDATE
+{
+	uint16 left, top, cx, cy;
+	uint16 width, height, Bpp, compress;
+	uint8 *data;
+	uint32 size;
+	uint8 *tdata;		/* NULL if decoding failed */
+}
+BITMAP_UPDATE;
+
+static BITMAP_UPDATE *g_bitmap_updates = NULL;
+static int g_bitmap_updates_size = 0;
+
+#ifdef HAVE_PTHREAD
+static int g_bitmap_count, g_bitmap_next, g_bitmap_decoded;
+static RD_BOOL g_bitmap_workers_started = False;
+static pthread_mutex_t g_bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_bitmap_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_bitmap_done = PTHREAD_COND_INITIALIZER;
+#endif
+
+/* Input events are collected while X events are processed and then sent
+   several to a PDU, as fast-path input if the server takes it. A run of
+   pointer motion events is reduced to its last position, which is held
+   for up to g_motion_delay milliseconds. */
+#define INPUT_BATCH_EVENTS	15	/* the most a fast-path header can count */
+
+typedef struct _INPUT_EVENT
+{
+	uint32 time;
+	uint16 message_type;
+	uint16 device_flags;
+	uint16 param1;
+	uint16 param2;
+}
+INPUT_EVENT;
+
+static INPUT_EVENT g_input_events[INPUT_BATCH_EVENTS];
+static int g_num_input_events = 0;
+static struct timeval g_input_deadline;
+static RD_BOOL g_fastpath_input = False;
 
 #if WITH_DEBUG
 static uint32 g_packetno;
@@ -519,27 +572,187 @@ rdp_send_synchronise(void)
 	rdp_send_data(s, RDP_DATA_PDU_SYNCHRONISE);
 }
 
-/* Send a single input event */
-void
-rdp_send_input(uint32 time, uint16 message_type, uint16 device_flags, uint16 param1, uint16 param2)
+#define IS_MOTION(event)	(((event)->message_type == RDP_INPUT_MOUSE) \
+				 && ((event)->device_flags == MOUSE_FLAG_MOVE))
+
+/* Send the waiting input events as one slow-path input PDU */
+static void
+rdp_send_input_pdu(void)
 {
+	INPUT_EVENT *event;
 	STREAM s;
+	int i;
 
-	s = rdp_init_data(16);
+	s = rdp_init_data(4 + 12 * g_num_input_events);
 
-	out_uint16_le(s, 1);	/* number of events */
+	out_uint16_le(s, g_num_input_events);	/* number of events */
 	out_uint16(s, 0);	/* pad */
 
-	out_uint32_le(s, time);
-	out_uint16_le(s, message_type);
-	out_uint16_le(s, device_flags);
-	out_uint16_le(s, param1);
-	out_uint16_le(s, param2);
+	for (i = 0; i < g_num_input_events; i++)
+	{
+		event = &g_input_events[i];
+		out_uint32_le(s, event->time);
+		out_uint16_le(s, event->message_type);
+		out_uint16_le(s, event->device_flags);
+		out_uint16_le(s, event->param1);
+		out_uint16_le(s, event->param2);
+	}
 
 	s_mark_end(s);
 	rdp_send_data(s, RDP_DATA_PDU_INPUT);
 }
 
+/* Send the waiting input events as one fast-path input PDU. Returns
+   False if some event has no fast-path form. */
+static RD_BOOL
+rdp_send_fastpath_input(void)
+{
+	INPUT_EVENT *event;
+	uint8 flags;
+	STREAM s;
+	int i;
+
+	for (i = 0; i < g_num_input_events; i++)
+	{
+		switch (g_input_events[i].message_type)
+		{
+			case RDP_INPUT_SCANCODE:
+			case RDP_INPUT_MOUSE:
+			case RDP_INPUT_SYNCHRONIZE:
+				break;
+			default:
+				return False;
+		}
+	}
+
+	s = sec_fp_init(7 * g_num_input_events);
+
+	for (i = 0; i < g_num_input_events; i++)
+	{
+		event = &g_input_events[i];
+		switch (event->message_type)
+		{
+			case RDP_INPUT_SCANCODE:
+				flags = 0;
+				if (event->device_flags & KBD_FLAG_UP)
+					flags |= FASTPATH_INPUT_KBDFLAGS_RELEASE;
+				if (event->device_flags & KBD_FLAG_EXT)
+					flags |= FASTPATH_INPUT_KBDFLAGS_EXTENDED;
+				out_uint8(s, (FASTPATH_INPUT_EVENT_SCANCODE << 5) | flags);
+				out_uint8(s, event->param1);
+				break;
+
+			case RDP_INPUT_MOUSE:
+				out_uint8(s, FASTPATH_INPUT_EVENT_MOUSE << 5);
+				out_uint16_le(s, event->device_flags);
+				out_uint16_le(s, event->param1);
+				out_uint16_le(s, event->param2);
+				break;
+
+			case RDP_INPUT_SYNCHRONIZE:
+				/* the toggle key states fit in the event flags */
+				out_uint8(s, (FASTPATH_INPUT_EVENT_SYNC << 5) | (event->param1 & 0x1f));
+				break;
+		}
+	}
+
+	s_mark_end(s);
+	sec_fp_send(s, g_num_input_events);
+	return True;
+}
+
+/* Send the waiting input events. A motion event at the end is held back
+   until its time is up, unless force is set. */
+void
+rdp_flush_input(RD_BOOL force)
+{
+	INPUT_EVENT held;
+	struct timeval now;
+	RD_BOOL hold = False;
+
+	if (g_num_input_events == 0)
+		return;
+
+	if (!force && IS_MOTION(&g_input_events[g_num_input_events - 1]))
+	{
+		gettimeofday(&now, NULL);
+		hold = timercmp(&now, &g_input_deadline, <);
+	}
+
+	if (hold)
+	{
+		if (g_num_input_events == 1)
+			return;
+		held = g_input_events[--g_num_input_events];
+	}
+
+	if (!g_fastpath_input || !rdp_send_fastpath_input())
+		rdp_send_input_pdu();
+	g_num_input_events = 0;
+
+	if (hold)
+		g_input_events[g_num_input_events++] = held;
+}
+
+/* Shorten a select() timeout to when a held motion event is due */
+void
+rdp_input_timeout(struct timeval *tv)
+{
+	struct timeval now, left;
+
+	if (g_num_input_events == 0)
+		return;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&g_input_deadline, &now, <))
+		timerclear(&left);
+	else
+		timersub(&g_input_deadline, &now, &left);
+
+	if (timercmp(&left, tv, <))
+		*tv = left;
+}
+
+/* Queue an input event, to be sent by rdp_flush_input */
+void
+rdp_send_input(uint32 time, uint16 message_type, uint16 device_flags, uint16 param1, uint16 param2)
+{
+	INPUT_EVENT *event;
+	struct timeval delay;
+
+	if ((g_num_input_events > 0) && (message_type == RDP_INPUT_MOUSE)
+	    && (device_flags == MOUSE_FLAG_MOVE))
+	{
+		event = &g_input_events[g_num_input_events - 1];
+		if (IS_MOTION(event))
+		{
+			/* replace the position that has not been sent yet */
+			event->time = time;
+			event->param1 = param1;
+			event->param2 = param2;
+			return;
+		}
+	}
+
+	if (g_num_input_events == INPUT_BATCH_EVENTS)
+		rdp_flush_input(True);
+
+	event = &g_input_events[g_num_input_events++];
+	event->time = time;
+	event->message_type = message_type;
+	event->device_flags = device_flags;
+	event->param1 = param1;
+	event->param2 = param2;
+
+	if (IS_MOTION(event))
+	{
+		gettimeofday(&g_input_deadline, NULL);
+		delay.tv_sec = g_motion_delay / 1000;
+		delay.tv_usec = (g_motion_delay % 1000) * 1000;
+		timeradd(&g_input_deadline, &delay, &g_input_deadline);
+	}
+}
+
 /* Send a client window information PDU */
 void
 rdp_send_client_window_status(int status)
@@ -697,9 +910,11 @@ rdp_out_order_caps(STREAM s)
 	order_caps[11] = (g_desktop_save ? 1 : 0);	/* desksave */
 	order_caps[13] = 1;	/* memblt */
 	order_caps[14] = 1;	/* triblt */
+	order_caps[19] = 1;	/* fast index */
 	order_caps[20] = (g_polygon_ellipse_orders ? 1 : 0);	/* polygon */
 	order_caps[21] = (g_polygon_ellipse_orders ? 1 : 0);	/* polygon2 */
 	order_caps[22] = 1;	/* polyline */
+	order_caps[24] = 1;	/* fast glyph */
 	order_caps[25] = (g_polygon_ellipse_orders ? 1 : 0);	/* ellipse */
 	order_caps[26] = (g_polygon_ellipse_orders ? 1 : 0);	/* ellipse2 */
 	order_caps[27] = 1;	/* text2 */
@@ -730,6 +945,9 @@ rdp_out_bmpcache_caps(STREAM s)
 	out_uint16_le(s, RDP_CAPLEN_BMPCACHE);
 
 	Bpp = (g_server_depth + 7) / 8;	/* bytes per pixel */
+	cache_resize_bitmap(0, 0x258);
+	cache_resize_bitmap(1, 0x12c);
+	cache_resize_bitmap(2, 0x106);
 	out_uint8s(s, 24);	/* unused */
 	out_uint16_le(s, 0x258);	/* entries */
 	out_uint16_le(s, 0x100 * Bpp);	/* max cell size */
@@ -751,15 +969,20 @@ rdp_out_bmpcache2_caps(STREAM s)
 	out_uint16_be(s, 3);	/* number of caches in this set */
 
 	/* max cell size for cache 0 is 16x16, 1 = 32x32, 2 = 64x64, etc */
-	out_uint32_le(s, BMPCACHE2_C0_CELLS);
-	out_uint32_le(s, BMPCACHE2_C1_CELLS);
+	cache_resize_bitmap(0, g_bmpcache_cells[0]);
+	out_uint32_le(s, g_bmpcache_cells[0]);
+	cache_resize_bitmap(1, g_bmpcache_cells[1]);
+	out_uint32_le(s, g_bmpcache_cells[1]);
 	if (pstcache_init(2))
 	{
+		/* g_bmpcache_cells[2] of them are kept in memory */
+		cache_resize_bitmap(2, BMPCACHE2_NUM_PSTCELLS);
 		out_uint32_le(s, BMPCACHE2_NUM_PSTCELLS | BMPCACHE2_FLAG_PERSIST);
 	}
 	else
 	{
-		out_uint32_le(s, BMPCACHE2_C2_CELLS);
+		cache_resize_bitmap(2, g_bmpcache_cells[2]);
+		out_uint32_le(s, g_bmpcache_cells[2]);
 	}
 	out_uint8s(s, 20);	/* other bitmap caches not used */
 }
@@ -844,33 +1067,61 @@ rdp_out_brushcache_caps(STREAM s)
 	out_uint32_le(s, 1);	/* cache type */
 }
 
-static uint8 caps_0x0d[] = {
-	0x01, 0x00, 0x00, 0x00, 0x09, 0x04, 0x00, 0x00,
-	0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x0C, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00
-};
+/* Output glyph cache capability set */
+static void
+rdp_out_glyphcache_caps(STREAM s)
+{
+	static uint16 cell_sizes[10] = { 4, 4, 8, 8, 16, 32, 64, 128, 256, 2048 };
+	int i;
+
+	out_uint16_le(s, RDP_CAPSET_GLYPHCACHE);
+	out_uint16_le(s, RDP_CAPLEN_GLYPHCACHE);
+
+	for (i = 0; i < 10; i++)
+	{
+		out_uint16_le(s, GLYPH_CACHE_ENTRIES);
+		out_uint16_le(s, cell_sizes[i]);
+	}
+
+	out_uint16_le(s, FRAGMENT_CACHE_ENTRIES);
+	out_uint16_le(s, 256);	/* max fragment size */
+	/* rev2 glyph cache orders with rdp5, see process_orders */
+	out_uint16_le(s, g_use_rdp5 ? GLYPH_SUPPORT_ENCODE : GLYPH_SUPPORT_FULL);
+	out_uint16(s, 0);	/* pad */
+}
+
+/* Output offscreen bitmap cache capability set */
+static void
+rdp_out_offscreen_caps(STREAM s)
+{
+	out_uint16_le(s, RDP_CAPSET_OFFSCREEN);
+	out_uint16_le(s, RDP_CAPLEN_OFFSCREEN);
+	out_uint32_le(s, 1);	/* support level */
+	out_uint16_le(s, OFFSCREEN_CACHE_SIZE);
+	out_uint16_le(s, OFFSCREEN_CACHE_ENTRIES);
+}
+
+/* Output input capability set */
+static void
+rdp_out_input_caps(STREAM s)
+{
+	out_uint16_le(s, RDP_CAPSET_INPUT);
+	out_uint16_le(s, RDP_CAPLEN_INPUT);
+
+	out_uint16_le(s, INPUT_FLAG_SCANCODES |
+		      (g_fastpath_input ? INPUT_FLAG_FASTPATH_INPUT2 : 0));
+	out_uint16(s, 0);	/* pad */
+	out_uint32_le(s, 0x409);	/* keyboard layout */
+	out_uint32_le(s, 4);	/* keyboard type */
+	out_uint32_le(s, 0);	/* keyboard subtype */
+	out_uint32_le(s, 12);	/* function keys */
+	out_uint8s(s, 64);	/* IME file name */
+}
 
 static uint8 caps_0x0c[] = { 0x01, 0x00, 0x00, 0x00 };
 
 static uint8 caps_0x0e[] = { 0x01, 0x00, 0x00, 0x00 };
 
-static uint8 caps_0x10[] = {
-	0xFE, 0x00, 0x04, 0x00, 0xFE, 0x00, 0x04, 0x00,
-	0xFE, 0x00, 0x08, 0x00, 0xFE, 0x00, 0x08, 0x00,
-	0xFE, 0x00, 0x10, 0x00, 0xFE, 0x00, 0x20, 0x00,
-	0xFE, 0x00, 0x40, 0x00, 0xFE, 0x00, 0x80, 0x00,
-	0xFE, 0x00, 0x00, 0x01, 0x40, 0x00, 0x00, 0x08,
-	0x00, 0x01, 0x00, 0x01, 0x02, 0x00, 0x00, 0x00
-};
-
 /* Output unknown capability sets */
 static void
 rdp_out_unknown_caps(STREAM s, uint16 id, uint16 length, uint8 * caps)
@@ -888,18 +1139,22 @@ rdp_send_confirm_active(void)
 {
 	STREAM s;
 	uint32 sec_flags = g_encryption ? (RDP5_FLAG | SEC_ENCRYPT) : RDP5_FLAG;
+	uint16 num_caps = 0xe;
 	uint16 caplen =
 		RDP_CAPLEN_GENERAL + RDP_CAPLEN_BITMAP + RDP_CAPLEN_ORDER +
 		RDP_CAPLEN_COLCACHE +
 		RDP_CAPLEN_ACTIVATE + RDP_CAPLEN_CONTROL +
 		RDP_CAPLEN_SHARE +
-		RDP_CAPLEN_BRUSHCACHE + 0x58 + 0x08 + 0x08 + 0x34 /* unknown caps */  +
+		RDP_CAPLEN_BRUSHCACHE + RDP_CAPLEN_GLYPHCACHE +
+		RDP_CAPLEN_INPUT + 0x08 + 0x08 /* unknown caps */  +
 		4 /* w2k fix, sessionid */ ;
 
 	if (g_use_rdp5)
 	{
 		caplen += RDP_CAPLEN_BMPCACHE2;
 		caplen += RDP_CAPLEN_NEWPOINTER;
+		caplen += RDP_CAPLEN_OFFSCREEN;
+		num_caps++;
 	}
 	else
 	{
@@ -919,7 +1174,7 @@ rdp_send_confirm_active(void)
 	out_uint16_le(s, caplen);
 
 	out_uint8p(s, RDP_SOURCE, sizeof(RDP_SOURCE));
-	out_uint16_le(s, 0xe);	/* num_caps */
+	out_uint16_le(s, num_caps);
 	out_uint8s(s, 2);	/* pad */
 
 	rdp_out_general_caps(s);
@@ -929,6 +1184,7 @@ rdp_send_confirm_active(void)
 	{
 		rdp_out_bmpcache2_caps(s);
 		rdp_out_newpointer_caps(s);
+		rdp_out_offscreen_caps(s);
 	}
 	else
 	{
@@ -941,10 +1197,10 @@ rdp_send_confirm_active(void)
 	rdp_out_share_caps(s);
 	rdp_out_brushcache_caps(s);
 
-	rdp_out_unknown_caps(s, 0x0d, 0x58, caps_0x0d);	/* CAPSTYPE_INPUT */
+	rdp_out_input_caps(s);
 	rdp_out_unknown_caps(s, 0x0c, 0x08, caps_0x0c);	/* CAPSTYPE_SOUND */
 	rdp_out_unknown_caps(s, 0x0e, 0x08, caps_0x0e);	/* CAPSTYPE_FONT */
-	rdp_out_unknown_caps(s, 0x10, 0x34, caps_0x10);	/* CAPSTYPE_GLYPHCACHE */
+	rdp_out_glyphcache_caps(s);
 
 	s_mark_end(s);
 	sec_send(s, sec_flags);
@@ -997,6 +1253,17 @@ rdp_process_bitmap_caps(STREAM s)
 	}
 }
 
+/* Process an input capability set */
+static void
+rdp_process_input_caps(STREAM s)
+{
+	uint16 flags;
+
+	in_uint16_le(s, flags);
+	g_fastpath_input = (flags & (INPUT_FLAG_FASTPATH_INPUT | INPUT_FLAG_FASTPATH_INPUT2)) != 0;
+	DEBUG(("Server %s fast-path input\n", g_fastpath_input ? "accepts" : "does not accept"));
+}
+
 /* Process server capabilities */
 static void
 rdp_process_server_caps(STREAM s, uint16 length)
@@ -1006,6 +1273,7 @@ rdp_process_server_caps(STREAM s, uint16 length)
 	uint16 ncapsets, capset_type, capset_length;
 
 	start = s->p;
+	g_fastpath_input = False;
 
 	in_uint16_le(s, ncapsets);
 	in_uint8s(s, 2);	/* pad */
@@ -1029,6 +1297,10 @@ rdp_process_server_caps(STREAM s, uint16 length)
 			case RDP_CAPSET_BITMAP:
 				rdp_process_bitmap_caps(s);
 				break;
+
+			case RDP_CAPSET_INPUT:
+				rdp_process_input_caps(s);
+				break;
 		}
 
 		s->p = next;
@@ -1193,74 +1465,194 @@ process_pointer_pdu(STREAM s)
 	}
 }
 
+/* Decompress and translate one rectangle; uses nothing but the update */
+static void
+decode_bitmap_update(BITMAP_UPDATE * update)
+{
+	uint8 *bmpdata;
+	int line, y;
+
+	line = update->width * update->Bpp;
+	bmpdata = (uint8 *) xmalloc(line * update->height);
+
+	if (!update->compress)
+	{
+		/* uncompressed bitmaps are sent bottom up */
+		for (y = 0; y < update->height; y++)
+			memcpy(&bmpdata[(update->height - y - 1) * line], update->data + y * line,
+			       line);
+	}
+	else if (!bitmap_decompress(bmpdata, update->width, update->height, update->data,
+				    update->size, update->Bpp))
+	{
+		DEBUG_RDP5(("Failed to decompress data\n"));
+		xfree(bmpdata);
+		update->tdata = NULL;
+		return;
+	}
+
+	update->tdata = ui_translate_bitmap(update->width, update->height, bmpdata);
+	if (update->tdata != bmpdata)
+		xfree(bmpdata);
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+bitmap_worker(void *arg)
+{
+	BITMAP_UPDATE *update;
+
+	UNUSED(arg);
+
+	pthread_mutex_lock(&g_bitmap_lock);
+	while (1)
+	{
+		while (g_bitmap_next >= g_bitmap_count)
+			pthread_cond_wait(&g_bitmap_queued, &g_bitmap_lock);
+
+		update = &g_bitmap_updates[g_bitmap_next++];
+		pthread_mutex_unlock(&g_bitmap_lock);
+
+		decode_bitmap_update(update);
+
+		pthread_mutex_lock(&g_bitmap_lock);
+		if (++g_bitmap_decoded == g_bitmap_count)
+			pthread_cond_signal(&g_bitmap_done);
+	}
+
+	return NULL;
+}
+
+/* One worker per additional processor */
+static void
+start_bitmap_workers(void)
+{
+	pthread_t thread;
+	long workers;
+
+	g_bitmap_workers_started = True;
+
+	workers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	workers = MIN(workers, BITMAP_MAX_WORKERS);
+	while (workers-- > 0)
+	{
+		if (pthread_create(&thread, NULL, bitmap_worker, NULL) != 0)
+			break;
+		pthread_detach(thread);
+	}
+}
+#endif
+
+/* Decode the first count entries of g_bitmap_updates */
+static void
+decode_bitmap_updates(int count)
+{
+#ifdef HAVE_PTHREAD
+	BITMAP_UPDATE *update;
+
+	if (count > 1)
+	{
+		if (!g_bitmap_workers_started)
+			start_bitmap_workers();
+
+		pthread_mutex_lock(&g_bitmap_lock);
+		g_bitmap_count = count;
+		g_bitmap_next = g_bitmap_decoded = 0;
+		pthread_cond_broadcast(&g_bitmap_queued);
+
+		/* help out rather than sit idle */
+		while (g_bitmap_next < g_bitmap_count)
+		{
+			update = &g_bitmap_updates[g_bitmap_next++];
+			pthread_mutex_unlock(&g_bitmap_lock);
+
+			decode_bitmap_update(update);
+
+			pthread_mutex_lock(&g_bitmap_lock);
+			g_bitmap_decoded++;
+		}
+
+		while (g_bitmap_decoded < g_bitmap_count)
+			pthread_cond_wait(&g_bitmap_done, &g_bitmap_lock);
+		pthread_mutex_unlock(&g_bitmap_lock);
+		return;
+	}
+#endif
+
+	while (count--)
+		decode_bitmap_update(&g_bitmap_updates[count]);
+}
+
 /* Process bitmap updates */
 void
 process_bitmap_updates(STREAM s)
 {
 	uint16 num_updates;
-	uint16 left, top, right, bottom, width, height;
-	uint16 cx, cy, bpp, Bpp, compress, bufsize, size;
-	uint8 *data, *bmpdata;
+	uint16 right, bottom, bpp, bufsize, size;
+	BITMAP_UPDATE *update;
 	int i;
 
 	in_uint16_le(s, num_updates);
 
+	if (num_updates > g_bitmap_updates_size)
+	{
+		g_bitmap_updates = (BITMAP_UPDATE *) xrealloc(g_bitmap_updates,
+							      num_updates * sizeof(BITMAP_UPDATE));
+		g_bitmap_updates_size = num_updates;
+	}
+
 	for (i = 0; i < num_updates; i++)
 	{
-		in_uint16_le(s, left);
-		in_uint16_le(s, top);
+		update = &g_bitmap_updates[i];
+
+		in_uint16_le(s, update->left);
+		in_uint16_le(s, update->top);
 		in_uint16_le(s, right);
 		in_uint16_le(s, bottom);
-		in_uint16_le(s, width);
-		in_uint16_le(s, height);
+		in_uint16_le(s, update->width);
+		in_uint16_le(s, update->height);
 		in_uint16_le(s, bpp);
-		Bpp = (bpp + 7) / 8;
-		in_uint16_le(s, compress);
+		update->Bpp = (bpp + 7) / 8;
+		in_uint16_le(s, update->compress);
 		in_uint16_le(s, bufsize);
 
-		cx = right - left + 1;
-		cy = bottom - top + 1;
+		update->cx = right - update->left + 1;
+		update->cy = bottom - update->top + 1;
 
 		DEBUG(("BITMAP_UPDATE(l=%d,t=%d,r=%d,b=%d,w=%d,h=%d,Bpp=%d,cmp=%d)\n",
-		       left, top, right, bottom, width, height, Bpp, compress));
+		       update->left, update->top, right, bottom, update->width, update->height,
+		       update->Bpp, update->compress));
 
-		if (!compress)
+		if (!update->compress)
 		{
-			int y;
-			bmpdata = (uint8 *) xmalloc(width * height * Bpp);
-			for (y = 0; y < height; y++)
-			{
-				in_uint8a(s, &bmpdata[(height - y - 1) * (width * Bpp)],
-					  width * Bpp);
-			}
-			ui_paint_bitmap(left, top, cx, cy, width, height, bmpdata);
-			xfree(bmpdata);
-			continue;
+			update->size = update->width * update->height * update->Bpp;
 		}
-
-
-		if (compress & 0x400)
+		else if (update->compress & 0x400)
 		{
-			size = bufsize;
+			update->size = bufsize;
 		}
 		else
 		{
 			in_uint8s(s, 2);	/* pad */
 			in_uint16_le(s, size);
 			in_uint8s(s, 4);	/* line_size, final_size */
+			update->size = size;
 		}
-		in_uint8p(s, data, size);
-		bmpdata = (uint8 *) xmalloc(width * height * Bpp);
-		if (bitmap_decompress(bmpdata, width, height, data, size, Bpp))
-		{
-			ui_paint_bitmap(left, top, cx, cy, width, height, bmpdata);
-		}
-		else
-		{
-			DEBUG_RDP5(("Failed to decompress data\n"));
-		}
+		in_uint8p(s, update->data, update->size);
+	}
 
-		xfree(bmpdata);
+	/* the rectangles are independent until they are painted */
+	decode_bitmap_updates(num_updates);
+
+	for (i = 0; i < num_updates; i++)
+	{
+		update = &g_bitmap_updates[i];
+		if (update->tdata == NULL)
+			continue;
+
+		ui_paint_translated_bitmap(update->left, update->top, update->cx, update->cy,
+					   update->width, update->height, update->tdata);
+		xfree(update->tdata);
 	}
 }
 
@@ -1623,6 +2015,7 @@ rdp_loop(RD_BOOL * deactivated, uint32 * ext_disc_reason)
 			default:
 				unimpl("PDU %d\n", type);
 		}
+		pstcache_precache();
 		cont = g_next_packet < s->end;
 	}
 	return True;
@@ -1646,6 +2039,7 @@ rdp_reset_state(void)
 {
 	g_next_packet = NULL;	/* reset the packet information */
 	g_rdp_shareid = 0;
+	g_num_input_events = 0;
 	sec_reset_state();
 }
 
@@ -1653,5 +2047,6 @@ rdp_reset_state(void)
 void
 rdp_disconnect(void)
 {
+	pstcache_flush();
 	sec_disconnect();
 }
@@ -847,7 +847,12 @@ rdpdr_init()
 				 CHANNEL_OPTION_INITIALIZED | CHANNEL_OPTION_COMPRESS_RDP,
 				 rdpdr_process);
 
-	return (rdpdr_channel != NULL);
+	if (rdpdr_channel == NULL)
+		return False;
+
+	/* file and printer data must not hold up clipboard and seamless */
+	rdpdr_channel->priority = CHANNEL_PRIORITY_BULK;
+	return True;
 }
 
 /* Add file descriptors of pending io request to select() */
@@ -382,6 +382,52 @@ sec_send(STREAM s, uint32 flags)
 	sec_send_hooked(s, flags);
 }
 
+/* Initialise fast-path input packet */
+STREAM
+sec_fp_init(int maxlen)
+{
+	int hdrlen = g_encryption ? 11 : 3;
+	STREAM s;
+
+	s = tcp_init(maxlen + hdrlen);
+	s_push_layer(s, sec_hdr, hdrlen);
+
+	return s;
+}
+
+/* Transmit fast-path input packet, which skips the ISO and MCS layers */
+void
+sec_fp_send(STREAM s, int num_events)
+{
+	int length, datalen;
+
+#ifdef WITH_SCARD
+	scard_lock(SCARD_LOCK_SEC);
+#endif
+	s_pop_layer(s, sec_hdr);
+	length = s->end - s->p;
+
+	out_uint8(s, (num_events << 2) | (g_encryption ? FASTPATH_INPUT_ENCRYPTED : 0));
+	out_uint16_be(s, 0x8000 | length);	/* always the two byte form */
+
+	if (g_encryption)
+	{
+		datalen = s->end - s->p - 8;
+
+		/* call to fuzzer here */
+		s = fuzz_handler(s);
+
+		sec_sign(s->p, 8, g_sec_sign_key, g_rc4_key_len, s->p + 8, datalen);
+		sec_encrypt(s->p + 8, datalen);
+	}
+
+	tcp_send(s);
+
+#ifdef WITH_SCARD
+	scard_unlock(SCARD_LOCK_SEC);
+#endif
+}
+
 
 /* Transfer the client random to the server */
 static void
@@ -739,6 +785,29 @@ sec_process_srv_info(STREAM s)
 	}
 }
 
+/* Process SRV_CHANNELS, take the MCS channel ids assigned by the server */
+static void
+sec_process_srv_channels(STREAM s)
+{
+	uint16 count, mcs_id;
+	unsigned int i;
+
+	in_uint8s(s, 2);	/* global channel id */
+	in_uint16_le(s, count);
+
+	if (count != g_num_channels)
+		warning("Server assigned %d of %d virtual channels\n", count, g_num_channels);
+
+	/* the ids are in the order the channels were requested, and
+	   channels past the end of the list have none */
+	channel_clear_mcs_ids();
+	for (i = 0; (i < count) && (i < g_num_channels) && s_check_rem(s, 2); i++)
+	{
+		in_uint16_le(s, mcs_id);
+		DEBUG_RDP5(("Channel %.8s is MCS channel %d\n", g_channels[i].name, mcs_id));
+		channel_set_mcs_id(&g_channels[i], mcs_id);
+	}
+}
 
 /* Process connect response data blob */
 void
@@ -774,9 +843,7 @@ sec_process_mcs_data(STREAM s)
 				break;
 
 			case SEC_TAG_SRV_CHANNELS:
-				/* FIXME: We should parse this information and
-				   use it to map RDP5 channels to MCS 
-				   channels */
+				sec_process_srv_channels(s);
 				break;
 
 			default:
@@ -882,7 +949,7 @@ sec_connect(char *server, char *username, RD_BOOL reconnect)
 	struct stream mcs_data;
 
 	/* We exchange some RDP data during the MCS-Connect */
-	mcs_data.size = 512;
+	mcs_data.size = 512 + MAX_CHANNELS * 12;
 	mcs_data.p = mcs_data.data = (uint8 *) xmalloc(mcs_data.size);
 	sec_out_mcs_data(&mcs_data);
 
@@ -0,0 +1,288 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Client side shadow framebuffer
+   Copyright (C) the rdesktop developers
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rdesktop.h"
+
+/*
+ * The shadow framebuffer keeps a copy of the session screen in the pixel
+ * format of the display, so that it can be read without asking the X
+ * server. Drawing operations the ui does not mirror mark the tiles they
+ * touch as stale, and the ui reloads those before reading them.
+ */
+
+#define TILE_SIZE	64
+
+static SURFACE g_shadow;
+static uint8 *g_stale = NULL;
+static int g_tiles_x, g_tiles_y;
+
+/* Mark the tiles touched by a rectangle as stale, or the tiles it covers
+   completely as fresh. The rectangle must be within the framebuffer. */
+static void
+mark_tiles(int x, int y, int cx, int cy, RD_BOOL stale)
+{
+	int tx1, ty1, tx2, ty2, tx, ty;
+
+	if (stale)
+	{
+		tx1 = x / TILE_SIZE;
+		ty1 = y / TILE_SIZE;
+		tx2 = (x + cx + TILE_SIZE - 1) / TILE_SIZE;
+		ty2 = (y + cy + TILE_SIZE - 1) / TILE_SIZE;
+	}
+	else
+	{
+		/* tiles cut off by the framebuffer edge count as covered */
+		tx1 = (x + TILE_SIZE - 1) / TILE_SIZE;
+		ty1 = (y + TILE_SIZE - 1) / TILE_SIZE;
+		tx2 = (x + cx == g_shadow.width) ? g_tiles_x : (x + cx) / TILE_SIZE;
+		ty2 = (y + cy == g_shadow.height) ? g_tiles_y : (y + cy) / TILE_SIZE;
+	}
+
+	for (ty = ty1; ty < ty2; ty++)
+		for (tx = tx1; tx < tx2; tx++)
+			g_stale[ty * g_tiles_x + tx] = stale;
+}
+
+static RD_BOOL
+any_stale(int x, int y, int cx, int cy)
+{
+	int tx1, ty1, tx2, ty2, tx, ty;
+
+	tx1 = x / TILE_SIZE;
+	ty1 = y / TILE_SIZE;
+	tx2 = (x + cx + TILE_SIZE - 1) / TILE_SIZE;
+	ty2 = (y + cy + TILE_SIZE - 1) / TILE_SIZE;
+
+	for (ty = ty1; ty < ty2; ty++)
+		for (tx = tx1; tx < tx2; tx++)
+			if (g_stale[ty * g_tiles_x + tx])
+				return True;
+
+	return False;
+}
+
+/* (Re)allocate the framebuffer. All of it starts out stale. */
+void
+shadow_init(int width, int height, int Bpp, RD_BOOL big_endian)
+{
+	g_shadow.width = width;
+	g_shadow.height = height;
+	g_shadow.Bpp = Bpp;
+	g_shadow.stride = width * Bpp;
+	g_shadow.data = (uint8 *) xrealloc(g_shadow.data, g_shadow.stride * height);
+	memset(g_shadow.data, 0, g_shadow.stride * height);
+	g_shadow.big_endian = big_endian;
+	raster_reset_clip(&g_shadow);
+
+	g_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	g_tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+	g_stale = (uint8 *) xrealloc(g_stale, g_tiles_x * g_tiles_y);
+	memset(g_stale, True, g_tiles_x * g_tiles_y);
+}
+
+SURFACE *
+shadow_surface(void)
+{
+	return &g_shadow;
+}
+
+/* FNV-1a hash of the whole framebuffer, stale tiles included, so that two
+   runs of the same drawing can be compared */
+uint32
+shadow_checksum(void)
+{
+	uint32 hash = 2166136261U;
+	uint8 *p = g_shadow.data;
+	uint8 *end = g_shadow.data + g_shadow.stride * g_shadow.height;
+
+	while (p < end)
+		hash = (hash ^ *(p++)) * 16777619U;
+
+	return hash;
+}
+
+void
+shadow_set_clip(int x, int y, int cx, int cy)
+{
+	raster_set_clip(&g_shadow, x, y, cx, cy);
+}
+
+/* Something we do not mirror was drawn here */
+void
+shadow_invalidate(int x, int y, int cx, int cy)
+{
+	if (raster_clip(&g_shadow, &x, &y, &cx, &cy, NULL, NULL, NULL))
+		mark_tiles(x, y, cx, cy, True);
+}
+
+/* Shrink a rectangle to the stale tiles within it. Returns False if
+   it is entirely up to date. */
+RD_BOOL
+shadow_get_stale(int *x, int *y, int *cx, int *cy)
+{
+	int tx1, ty1, tx2, ty2, tx, ty;
+	int minx, miny, maxx, maxy;
+
+	minx = g_tiles_x;
+	miny = g_tiles_y;
+	maxx = maxy = -1;
+
+	tx1 = MAX(*x, 0) / TILE_SIZE;
+	ty1 = MAX(*y, 0) / TILE_SIZE;
+	tx2 = MIN((*x + *cx + TILE_SIZE - 1) / TILE_SIZE, g_tiles_x);
+	ty2 = MIN((*y + *cy + TILE_SIZE - 1) / TILE_SIZE, g_tiles_y);
+
+	for (ty = ty1; ty < ty2; ty++)
+	{
+		for (tx = tx1; tx < tx2; tx++)
+		{
+			if (!g_stale[ty * g_tiles_x + tx])
+				continue;
+
+			minx = MIN(minx, tx);
+			miny = MIN(miny, ty);
+			maxx = MAX(maxx, tx);
+			maxy = MAX(maxy, ty);
+		}
+	}
+
+	if (maxx < 0)
+		return False;
+
+	*x = minx * TILE_SIZE;
+	*y = miny * TILE_SIZE;
+	*cx = MIN((maxx + 1) * TILE_SIZE, g_shadow.width) - *x;
+	*cy = MIN((maxy + 1) * TILE_SIZE, g_shadow.height) - *y;
+	return True;
+}
+
+/* Reload part of the framebuffer from the screen, ignoring the clip */
+void
+shadow_load(int x, int y, int cx, int cy, uint8 * data, int stride)
+{
+	uint8 *out = g_shadow.data + y * g_shadow.stride + x * g_shadow.Bpp;
+
+	mark_tiles(x, y, cx, cy, False);
+
+	while (cy--)
+	{
+		memcpy(out, data, cx * g_shadow.Bpp);
+		out += g_shadow.stride;
+		data += stride;
+	}
+}
+
+/* Draw an image; data points at the pixel that goes to x, y */
+void
+shadow_put_image(int x, int y, int cx, int cy, uint8 * data, int stride)
+{
+	SURFACE image;
+
+	image.data = data;
+	image.width = cx;
+	image.height = cy;
+	image.Bpp = g_shadow.Bpp;
+	image.stride = stride;
+	image.big_endian = g_shadow.big_endian;
+	shadow_blt(0xcc, x, y, cx, cy, &image, 0, 0, NULL);
+}
+
+void
+shadow_fill(int x, int y, int cx, int cy, uint32 colour)
+{
+	PATTERN pattern;
+
+	pattern.fgcolour = pattern.bgcolour = colour;
+	pattern.mask = NULL;
+	pattern.tile = NULL;
+	pattern.xorigin = pattern.yorigin = 0;
+	shadow_blt(0xf0, x, y, cx, cy, NULL, 0, 0, &pattern);
+}
+
+/* Any ternary ROP; the source may be the framebuffer itself */
+void
+shadow_blt(uint8 rop, int x, int y, int cx, int cy, SURFACE * src, int srcx, int srcy,
+	   PATTERN * pattern)
+{
+	if (!ROP3_USES_S(rop))
+		src = NULL;
+
+	if (!raster_clip(&g_shadow, &x, &y, &cx, &cy, src, &srcx, &srcy))
+		return;
+
+	if ((src == &g_shadow) && any_stale(srcx, srcy, cx, cy))
+	{
+		mark_tiles(x, y, cx, cy, True);
+		return;
+	}
+
+	/* tiles that were stale stay so if the result depends on them */
+	raster_blt(&g_shadow, rop, x, y, cx, cy, src, srcx, srcy, pattern);
+	if (!ROP3_USES_D(rop))
+		mark_tiles(x, y, cx, cy, False);
+}
+
+void
+shadow_stipple(int x, int y, int cx, int cy, uint8 * mask, int scanline, int maskx, int masky,
+	       uint32 fgcolour, uint32 bgcolour, RD_BOOL opaque)
+{
+	raster_stipple(&g_shadow, x, y, cx, cy, mask, scanline, maskx, masky,
+		       fgcolour, bgcolour, opaque);
+	if (opaque && raster_clip(&g_shadow, &x, &y, &cx, &cy, NULL, NULL, NULL))
+		mark_tiles(x, y, cx, cy, False);
+}
+
+void
+shadow_polygon(uint8 rop, uint8 fillmode, RD_POINT * points, int npoints, PATTERN * pattern)
+{
+	raster_polygon(&g_shadow, rop, fillmode, points, npoints, pattern);
+}
+
+void
+shadow_line(uint8 rop, int startx, int starty, int endx, int endy, uint32 colour)
+{
+	raster_line(&g_shadow, rop, startx, starty, endx, endy, True, colour);
+}
+
+/* Connected lines given in the style of CoordModePrevious */
+void
+shadow_polyline(uint8 rop, RD_POINT * points, int npoints, uint32 colour)
+{
+	int i, x, y;
+
+	if (npoints < 1)
+		return;
+
+	x = points[0].x;
+	y = points[0].y;
+	for (i = 1; i < npoints; i++)
+	{
+		raster_line(&g_shadow, rop, x, y, x + points[i].x, y + points[i].y,
+			    i == npoints - 1, colour);
+		x += points[i].x;
+		y += points[i].y;
+	}
+}
+
+void
+shadow_ellipse(uint8 rop, uint8 fillmode, int x, int y, int cx, int cy, PATTERN * pattern)
+{
+	raster_ellipse(&g_shadow, rop, fillmode, x, y, cx, cy, pattern);
+}
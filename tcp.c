@@ -27,10 +27,16 @@
 #include <netinet/tcp.h>	/* TCP_NODELAY */
 #include <arpa/inet.h>		/* inet_addr */
 #include <errno.h>		/* errno */
+#include <fcntl.h>		/* fcntl O_NONBLOCK */
 #endif
 
 #include "rdesktop.h"
 
+#if defined(HAVE_PTHREAD) && defined(__GNUC__) && !defined(_WIN32)
+#include <pthread.h>
+#define WITH_RECV_THREAD
+#endif
+
 #ifdef _WIN32
 #define socklen_t int
 #define TCP_CLOSE(_sck) closesocket(_sck)
@@ -57,6 +63,214 @@ static struct stream g_in;
 static struct stream g_out[STREAM_COUNT];
 int g_tcp_port_rdp = TCP_PORT_RDP;
 extern RD_BOOL g_user_quit;
+extern RD_BOOL g_recv_thread;
+
+#ifdef WITH_RECV_THREAD
+/*
+ * A separate thread reads the socket into a ring, so that the network is
+ * drained while the main thread decodes and draws. The ring has a single
+ * producer and a single consumer: each side only writes its own index, so
+ * no lock is needed. A side that finds the ring empty or full sets its
+ * waiting flag and sleeps on a pipe, which the other side writes to when
+ * it sees the flag. While the ring is full the socket is not read, and
+ * TCP flow control holds back the server.
+ *
+ * Only socket reads happen on the receive thread. The ISO and MCS
+ * headers are parsed and the data decrypted on the main thread, by the
+ * callers of tcp_recv: the decryption state is shared with licensing and
+ * redirection, and what follows it creates X resources.
+ */
+#define RECV_RING_SIZE		(256 * 1024)	/* power of two */
+#define RECV_RING_MASK		(RECV_RING_SIZE - 1)
+#define RING_BARRIER()		__sync_synchronize()
+
+static RD_BOOL g_recv_started = False;
+static pthread_t g_recv_tid;
+static uint8 *g_ring = NULL;
+static volatile uint32 g_ring_head;	/* written by the receive thread */
+static volatile uint32 g_ring_tail;	/* written by the main thread */
+static volatile RD_BOOL g_reader_waiting, g_writer_waiting;
+static volatile RD_BOOL g_ring_closed, g_recv_stop;
+static volatile int g_recv_errno;
+static int g_ready_pipe[2];	/* wakes the main thread */
+static int g_space_pipe[2];	/* wakes the receive thread */
+
+static void
+ring_signal(int fd)
+{
+	uint8 c = 0;
+
+	while ((write(fd, &c, 1) < 0) && (errno == EINTR));
+}
+
+static void *
+recv_thread(void *arg)
+{
+	uint32 head, len;
+	uint8 c;
+	int rcvd;
+
+	UNUSED(arg);
+
+	head = g_ring_head;
+	while (!g_recv_stop)
+	{
+		if (head - g_ring_tail == RECV_RING_SIZE)
+		{
+			g_writer_waiting = True;
+			RING_BARRIER();
+			if ((head - g_ring_tail == RECV_RING_SIZE) && !g_recv_stop)
+				while ((read(g_space_pipe[0], &c, 1) < 0) && (errno == EINTR));
+			g_writer_waiting = False;
+			continue;
+		}
+
+		len = RECV_RING_SIZE - (head - g_ring_tail);
+		len = MIN(len, RECV_RING_SIZE - (head & RECV_RING_MASK));
+		rcvd = recv(g_sock, g_ring + (head & RECV_RING_MASK), len, 0);
+		if (rcvd <= 0)
+		{
+			if ((rcvd < 0) && (errno == EINTR))
+				continue;
+			g_recv_errno = (rcvd < 0) ? errno : 0;
+			break;
+		}
+
+		head += rcvd;
+		RING_BARRIER();
+		g_ring_head = head;
+		RING_BARRIER();
+		if (g_reader_waiting)
+		{
+			g_reader_waiting = False;
+			ring_signal(g_ready_pipe[1]);
+		}
+	}
+
+	g_ring_closed = True;
+	RING_BARRIER();
+	ring_signal(g_ready_pipe[1]);
+	return NULL;
+}
+
+/* Copy out up to length bytes; returns how many there were */
+static uint32
+ring_read(uint8 * out, uint32 length)
+{
+	uint32 tail, offset, len, first;
+
+	tail = g_ring_tail;
+	len = MIN(g_ring_head - tail, length);
+	RING_BARRIER();
+
+	offset = tail & RECV_RING_MASK;
+	first = MIN(len, RECV_RING_SIZE - offset);
+	memcpy(out, g_ring + offset, first);
+	memcpy(out + first, g_ring, len - first);
+
+	RING_BARRIER();
+	g_ring_tail = tail + len;
+	RING_BARRIER();
+	if (len && g_writer_waiting)
+	{
+		g_writer_waiting = False;
+		ring_signal(g_space_pipe[1]);
+	}
+
+	return len;
+}
+
+/* Handle X events until the ring has data. With poll set, return as soon
+   as waiting events are handled, even if the ring is not empty. */
+static RD_BOOL
+ring_wait(RD_BOOL poll)
+{
+	RD_BOOL closed;
+	uint8 buf[64];
+
+	g_reader_waiting = True;
+	RING_BARRIER();
+	closed = g_ring_closed;
+	RING_BARRIER();
+
+	if ((g_ring_head == g_ring_tail) && closed)
+	{
+		if (g_recv_errno)
+			error("recv: %s\n", strerror(g_recv_errno));
+		else
+			error("Connection closed\n");
+		return False;
+	}
+
+	if (poll || (g_ring_head == g_ring_tail))
+	{
+		if (poll)
+			ring_signal(g_ready_pipe[1]);
+		if (!ui_select(g_ready_pipe[0]))
+		{
+			/* User quit */
+			g_user_quit = True;
+			return False;
+		}
+		while (read(g_ready_pipe[0], buf, sizeof(buf)) > 0);
+	}
+
+	g_reader_waiting = False;
+	return True;
+}
+
+static void
+start_recv_thread(void)
+{
+	if (pipe(g_ready_pipe) != 0)
+		goto fail;
+	if (pipe(g_space_pipe) != 0)
+	{
+		close(g_ready_pipe[0]);
+		close(g_ready_pipe[1]);
+		goto fail;
+	}
+	fcntl(g_ready_pipe[0], F_SETFL, O_NONBLOCK);
+
+	if (g_ring == NULL)
+		g_ring = (uint8 *) xmalloc(RECV_RING_SIZE);
+	g_ring_head = g_ring_tail = 0;
+	g_reader_waiting = g_writer_waiting = False;
+	g_ring_closed = g_recv_stop = False;
+	g_recv_errno = 0;
+
+	if (pthread_create(&g_recv_tid, NULL, recv_thread, NULL) != 0)
+	{
+		close(g_ready_pipe[0]);
+		close(g_ready_pipe[1]);
+		close(g_space_pipe[0]);
+		close(g_space_pipe[1]);
+		goto fail;
+	}
+
+	g_recv_started = True;
+	return;
+
+      fail:
+	warning("Could not start receive thread, receiving on the main thread\n");
+}
+
+static void
+stop_recv_thread(void)
+{
+	g_recv_stop = True;
+	RING_BARRIER();
+	shutdown(g_sock, SHUT_RDWR);
+	ring_signal(g_space_pipe[1]);
+	pthread_join(g_recv_tid, NULL);
+
+	close(g_ready_pipe[0]);
+	close(g_ready_pipe[1]);
+	close(g_space_pipe[0]);
+	close(g_space_pipe[1]);
+	g_recv_started = False;
+}
+#endif
 
 /* wait till socket is ready to write or timeout */
 static RD_BOOL
@@ -161,6 +375,12 @@ tcp_recv(STREAM s, uint32 length)
 		}
 		g_in.end = g_in.p = g_in.data;
 		s = &g_in;
+
+#ifdef WITH_RECV_THREAD
+		/* handle X events between PDUs even if data keeps coming */
+		if (g_recv_started && !ring_wait(True))
+			return NULL;
+#endif
 	}
 	else
 	{
@@ -177,6 +397,23 @@ tcp_recv(STREAM s, uint32 length)
 		}
 	}
 
+#ifdef WITH_RECV_THREAD
+	if (g_recv_started)
+	{
+		while (length > 0)
+		{
+			rcvd = ring_read(s->end, length);
+			if ((rcvd == 0) && !ring_wait(False))
+				return NULL;
+
+			s->end += rcvd;
+			length -= rcvd;
+		}
+
+		return s;
+	}
+#endif
+
 	while (length > 0)
 	{
 		if (!ui_select(g_sock))
@@ -317,6 +554,11 @@ tcp_connect(char *server)
 		g_out[i].data = (uint8 *) xmalloc(g_out[i].size);
 	}
 
+#ifdef WITH_RECV_THREAD
+	if (g_recv_thread)
+		start_recv_thread();
+#endif
+
 	return True;
 }
 
@@ -324,9 +566,20 @@ tcp_connect(char *server)
 void
 tcp_disconnect(void)
 {
+#ifdef WITH_RECV_THREAD
+	if (g_recv_started)
+		stop_recv_thread();
+#endif
 	TCP_CLOSE(g_sock);
 }
 
+/* The connected socket, for callers that wait for it to take data */
+int
+tcp_get_socket(void)
+{
+	return g_sock;
+}
+
 char *
 tcp_get_address()
 {
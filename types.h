@@ -35,6 +35,7 @@ typedef void *RD_HBITMAP;
 typedef void *RD_HGLYPH;
 typedef void *RD_HCOLOURMAP;
 typedef void *RD_HCURSOR;
+typedef void *RD_HBRUSH;
 
 typedef struct _RD_POINT
 {
@@ -84,6 +85,7 @@ typedef struct _BRUSHDATA
 	uint32 colour_code;
 	uint32 data_size;
 	uint8 *data;
+	RD_HBRUSH handle;	/* created by the ui on first use */
 }
 BRUSHDATA;
 
@@ -97,6 +99,30 @@ typedef struct _BRUSH
 }
 BRUSH;
 
+/* pixels in the format of the local display */
+typedef struct _SURFACE
+{
+	uint8 *data;
+	int width;
+	int height;
+	int Bpp;
+	int stride;
+	RD_BOOL big_endian;
+	int clip_x1, clip_y1, clip_x2, clip_y2;
+}
+SURFACE;
+
+/* brush expanded for the software rasteriser */
+typedef struct _PATTERN
+{
+	uint32 fgcolour;	/* pixel for set mask bits, or a solid fill */
+	uint32 bgcolour;
+	uint8 *mask;		/* 8 rows, MSB first; NULL if solid */
+	SURFACE *tile;		/* 8x8 colour pattern, overrides the above */
+	int xorigin, yorigin;
+}
+PATTERN;
+
 typedef struct _FONTGLYPH
 {
 	sint16 offset;
@@ -132,11 +158,65 @@ typedef struct _VCHANNEL
 	uint16 mcs_id;
 	char name[8];
 	uint32 flags;
+	uint8 priority;
 	struct stream in;
 	void (*process) (STREAM);
 }
 VCHANNEL;
 
+typedef struct _DVCHANNEL
+{
+	char *name;
+	uint32 id;
+	RD_BOOL open;
+	struct stream in;
+	void (*process) (STREAM);
+	void (*notify) (RD_BOOL);
+}
+DVCHANNEL;
+
+/* One field of a primary order, see the schemas in orders.h */
+typedef struct _ORDER_FIELD
+{
+	char *name;
+	uint8 kind;
+	uint8 bit;		/* the first presence bit it uses */
+}
+ORDER_FIELD;
+
+typedef struct _ORDER_SCHEMA
+{
+	char *name;		/* NULL for unsupported order types */
+	uint32 present;		/* all presence bits the order uses */
+	int present_size;	/* bytes of the presence field */
+	ORDER_FIELD *fields;
+	int num_fields;
+}
+ORDER_SCHEMA;
+
+/* Where the time goes for one type of drawing order */
+typedef struct _ORDER_PROFILE
+{
+	uint32 count;
+	uint32 bytes;		/* of order data */
+	double decode;		/* nanoseconds */
+	double draw;		/* replaying the ui calls of primary orders */
+}
+ORDER_PROFILE;
+
+/* Counters of one cache, see cache_dump_stats */
+typedef struct _CACHE_STATS
+{
+	uint32 gets;
+	uint32 puts;
+	uint32 misses;		/* gets not served from memory */
+	uint32 evictions;
+	uint32 loads;		/* from the persistent bitmap cache */
+	uint32 count;		/* items held */
+	uint32 bytes;		/* bytes held */
+}
+CACHE_STATS;
+
 /* PSTCACHE */
 typedef uint8 HASH_KEY[8];
 
@@ -150,6 +230,28 @@ typedef struct _PSTCACHE_CELLHEADER
 }
 CELLHEADER;
 
+typedef struct _PSTCACHE_HEADER
+{
+	uint32 magic;
+	uint16 version;
+	uint16 Bpp;
+	uint32 num_slots;
+	uint32 log_size;	/* a power of two */
+	uint32 slot_offset;	/* PSTCACHE_SLOT for each key */
+	uint32 log_offset;	/* CELLHEADER followed by pixel data, in a ring */
+	uint32 head;		/* log position up to which space is claimed */
+	uint32 clock;		/* last MRU stamp handed out */
+}
+PSTCACHE_HEADER;
+
+typedef struct _PSTCACHE_SLOT
+{
+	HASH_KEY key;
+	uint32 offset;		/* log position of the cell */
+	uint32 stamp;
+}
+PSTCACHE_SLOT;
+
 #define MAX_CBSIZE 256
 
 /* RDPSND */
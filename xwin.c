@@ -32,6 +32,9 @@
 #ifdef HAVE_XRANDR
 #include <X11/extensions/Xrandr.h>
 #endif
+#ifdef HAVE_XRENDER
+#include <X11/extensions/Xrender.h>
+#endif
 
 extern int g_sizeopt;
 extern int g_width;
@@ -49,6 +52,7 @@ extern char g_title[];
    As of RDP 5.1, it may be 8, 15, 16 or 24. */
 extern int g_server_depth;
 extern int g_win_button_size;
+extern RD_BOOL g_shadow_framebuffer;
 
 Display *g_display;
 Time g_last_gesturetime;
@@ -85,8 +89,30 @@ typedef struct _seamless_window
 	char icon_buffer[32 * 32 * 4];
 
 	struct _seamless_window *next;
+	struct _seamless_window *id_next, *wnd_next;	/* hash chains */
+	int cell_x1, cell_y1, cell_x2, cell_y2;	/* grid cells it is listed in */
+	unsigned int stamp;
 } seamless_window;
 static seamless_window *g_seamless_windows = NULL;
+
+/* Seamless windows are found by id and by X window through hash tables,
+   and by position through a grid of cells over the desktop, each listing
+   the windows that overlap it */
+#define SW_HASH_SIZE	64
+#define SW_HASH(key)	(((key) ^ ((key) >> 6)) & (SW_HASH_SIZE - 1))
+#define SW_CELL_SHIFT	7
+typedef struct _sw_cell
+{
+	seamless_window **windows;
+	int count, size;
+} sw_cell;
+static seamless_window *g_sw_by_id[SW_HASH_SIZE];
+static seamless_window *g_sw_by_wnd[SW_HASH_SIZE];
+static sw_cell *g_sw_grid = NULL;
+static int g_sw_grid_w, g_sw_grid_h;
+static seamless_window **g_sw_hits = NULL;
+static int g_sw_hits_size = 0;
+static unsigned int g_sw_stamp = 0;
 static unsigned long g_seamless_focused = 0;
 static RD_BOOL g_seamless_started = False;	/* Server end is up and running */
 static RD_BOOL g_seamless_active = False;	/* We are currently in seamless mode */
@@ -152,6 +178,37 @@ static int g_red_shift_l, g_blue_shift_l, g_green_shift_l;
 extern RD_BOOL g_ownbackstore;
 static Pixmap g_backstore = 0;
 
+#ifdef HAVE_XRENDER
+/* XRender acceleration. Every font cache slot gets a glyph set of its own,
+   which acts as a server side atlas for the glyphs in that slot, so that a
+   TEXT2 run can be composited with a single request instead of a stipple
+   change and a fill per character. */
+static RD_BOOL g_xrender = False;
+static XRenderPictFormat *g_xrender_format;
+static XRenderPictFormat *g_xrender_glyph_format;
+static GlyphSet g_xrender_glyphsets[GLYPH_CACHE_FONTS];
+static Glyph g_xrender_next_glyph = 1;
+static Picture g_xrender_target = None;
+static RD_BOOL g_xrender_clip_changed = True;
+static Pixmap g_xrender_pen_pixmap = 0;
+static Picture g_xrender_pen = None;
+static unsigned long g_xrender_pen_colour;
+
+/* glyphs of the TEXT2 run being assembled */
+static XGlyphElt32 *g_text_elts = NULL;
+static unsigned int *g_text_glyphs = NULL;
+static int g_text_count = 0;
+static int g_text_size = 0;
+static int g_text_x, g_text_y;
+
+#define XRENDER_TEXT	(g_xrender)
+#else
+#define XRENDER_TEXT	False
+#define xrender_queue_glyph(font, glyph, x, y)
+#define xrender_draw_text(colour)
+#define xrender_patblt(opcode, x, y, cx, cy, brush, bgcolour, fgcolour)	False
+#endif
+
 /* Moving in single app mode */
 static RD_BOOL g_moving_wnd;
 static int g_move_x_offset = 0;
@@ -183,6 +240,62 @@ typedef struct
 }
 PixelColour;
 
+/* what ui_create_bitmap hands out */
+typedef struct
+{
+	Pixmap pixmap;
+	uint32 size;		/* bytes of pixel data */
+	SURFACE pixels;		/* translated copy for the shadow framebuffer */
+}
+xbitmap;
+
+/* font glyphs carry a copy of their bits for the shadow framebuffer */
+typedef struct
+{
+	RD_HGLYPH handle;	/* stipple, or XRender glyph id */
+	uint8 *bits;
+}
+xfontglyph;
+
+/* ui side copy of a brush from the brush cache */
+typedef struct
+{
+	Pixmap pixmap;		/* tile, or stipple for 2 colour brushes */
+	uint8 *tile;		/* translated colour brush for the shadow, on first use */
+#ifdef HAVE_XRENDER
+	Picture picture;	/* on first use */
+#endif
+}
+cached_brush;
+
+/* Offscreen bitmap that drawing orders go to, NULL for the screen.
+   Nothing drawn on it reaches the window, the seamless windows or the
+   shadow framebuffer until it is copied to the screen. */
+static xbitmap *g_surface = NULL;
+#define DRAWABLE	(g_surface ? g_surface->pixmap : g_wnd)
+#define OWNBACKSTORE	(g_ownbackstore && !g_surface)
+
+/* Draw to the seamless windows that overlap a rectangle of the desktop */
+#define ON_SEAMLESS_WINDOWS_IN(rx, ry, rcx, rcy, func, args) \
+        do { \
+                seamless_window *sw; \
+                XRectangle rect; \
+                int sw_i, sw_n; \
+		if (!g_seamless_windows || g_surface) break; \
+		sw_n = sw_windows_in(rx, ry, rcx, rcy); \
+		if (!sw_n) break; \
+                for (sw_i = 0; sw_i < sw_n; sw_i++) { \
+                    sw = g_sw_hits[sw_i]; \
+                    rect.x = g_clip_rectangle.x - sw->xoffset; \
+                    rect.y = g_clip_rectangle.y - sw->yoffset; \
+                    rect.width = g_clip_rectangle.width; \
+                    rect.height = g_clip_rectangle.height; \
+                    XSetClipRectangles(g_display, g_gc, 0, 0, &rect, 1, YXBanded); \
+                    func args; \
+                } \
+                XSetClipRectangles(g_display, g_gc, 0, 0, &g_clip_rectangle, 1, YXBanded); \
+        } while (0)
+
 #define ON_ALL_SEAMLESS_WINDOWS(func, args) \
         do { \
                 seamless_window *sw; \
@@ -221,23 +334,28 @@ seamless_XDrawLines(Drawable d, XPoint * points, int npoints, int xoffset, int y
 
 #define FILL_RECTANGLE(x,y,cx,cy)\
 { \
-	XFillRectangle(g_display, g_wnd, g_gc, x, y, cx, cy); \
-        ON_ALL_SEAMLESS_WINDOWS(XFillRectangle, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy)); \
-	if (g_ownbackstore) \
+	XFillRectangle(g_display, DRAWABLE, g_gc, x, y, cx, cy); \
+        ON_SEAMLESS_WINDOWS_IN(x, y, cx, cy, XFillRectangle, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy)); \
+	if (OWNBACKSTORE) \
 		XFillRectangle(g_display, g_backstore, g_gc, x, y, cx, cy); \
 }
 
 #define FILL_RECTANGLE_BACKSTORE(x,y,cx,cy)\
 { \
-	XFillRectangle(g_display, g_ownbackstore ? g_backstore : g_wnd, g_gc, x, y, cx, cy); \
+	XFillRectangle(g_display, OWNBACKSTORE ? g_backstore : DRAWABLE, g_gc, x, y, cx, cy); \
 }
 
 #define FILL_POLYGON(p,np)\
 { \
-	XFillPolygon(g_display, g_wnd, g_gc, p, np, Complex, CoordModePrevious); \
-	if (g_ownbackstore) \
+	XFillPolygon(g_display, DRAWABLE, g_gc, p, np, Complex, CoordModePrevious); \
+	if (OWNBACKSTORE) \
 		XFillPolygon(g_display, g_backstore, g_gc, p, np, Complex, CoordModePrevious); \
-	ON_ALL_SEAMLESS_WINDOWS(seamless_XFillPolygon, (sw->wnd, p, np, sw->xoffset, sw->yoffset)); \
+	if (g_seamless_windows && !g_surface) \
+	{ \
+		int px, py, pcx, pcy; \
+		points_extent((RD_POINT *) p, np, &px, &py, &pcx, &pcy); \
+		ON_SEAMLESS_WINDOWS_IN(px, py, pcx, pcy, seamless_XFillPolygon, (sw->wnd, p, np, sw->xoffset, sw->yoffset)); \
+	} \
 }
 
 #define DRAW_ELLIPSE(x,y,cx,cy,m)\
@@ -245,20 +363,242 @@ seamless_XDrawLines(Drawable d, XPoint * points, int npoints, int xoffset, int y
 	switch (m) \
 	{ \
 		case 0:	/* Outline */ \
-			XDrawArc(g_display, g_wnd, g_gc, x, y, cx, cy, 0, 360*64); \
-                        ON_ALL_SEAMLESS_WINDOWS(XDrawArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64)); \
-			if (g_ownbackstore) \
+			XDrawArc(g_display, DRAWABLE, g_gc, x, y, cx, cy, 0, 360*64); \
+                        ON_SEAMLESS_WINDOWS_IN(x, y, cx + 1, cy + 1, XDrawArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64)); \
+			if (OWNBACKSTORE) \
 				XDrawArc(g_display, g_backstore, g_gc, x, y, cx, cy, 0, 360*64); \
 			break; \
 		case 1: /* Filled */ \
-			XFillArc(g_display, g_wnd, g_gc, x, y, cx, cy, 0, 360*64); \
-			ON_ALL_SEAMLESS_WINDOWS(XFillArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64)); \
-			if (g_ownbackstore) \
+			XFillArc(g_display, DRAWABLE, g_gc, x, y, cx, cy, 0, 360*64); \
+			ON_SEAMLESS_WINDOWS_IN(x, y, cx, cy, XFillArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64)); \
+			if (OWNBACKSTORE) \
 				XFillArc(g_display, g_backstore, g_gc, x, y, cx, cy, 0, 360*64); \
 			break; \
 	} \
 }
 
+/* The bounding box of a CoordModePrevious point list */
+static void
+points_extent(RD_POINT * points, int npoints, int *x, int *y, int *cx, int *cy)
+{
+	int i, px, py, minx, miny, maxx, maxy;
+
+	if (npoints < 1)
+	{
+		*x = *y = *cx = *cy = 0;
+		return;
+	}
+
+	px = minx = maxx = points[0].x;
+	py = miny = maxy = points[0].y;
+	for (i = 1; i < npoints; i++)
+	{
+		px += points[i].x;
+		py += points[i].y;
+		minx = MIN(minx, px);
+		miny = MIN(miny, py);
+		maxx = MAX(maxx, px);
+		maxy = MAX(maxy, py);
+	}
+
+	*x = minx;
+	*y = miny;
+	*cx = maxx - minx + 1;
+	*cy = maxy - miny + 1;
+}
+
+static seamless_window *
+sw_get_window_by_id(unsigned long id)
+{
+	seamless_window *sw;
+	for (sw = g_sw_by_id[SW_HASH(id)]; sw; sw = sw->id_next)
+	{
+		if (sw->id == id)
+			return sw;
+	}
+	return NULL;
+}
+
+
+static seamless_window *
+sw_get_window_by_wnd(Window wnd)
+{
+	seamless_window *sw;
+	for (sw = g_sw_by_wnd[SW_HASH(wnd)]; sw; sw = sw->wnd_next)
+	{
+		if (sw->wnd == wnd)
+			return sw;
+	}
+	return NULL;
+}
+
+
+/* Work out the grid cells a window overlaps. Returns False if it is
+   entirely off the desktop. */
+static RD_BOOL
+sw_grid_cells(seamless_window * sw, int *x1, int *y1, int *x2, int *y2)
+{
+	if ((sw->xoffset + sw->width <= 0) || (sw->yoffset + sw->height <= 0)
+	    || (sw->xoffset >= g_width) || (sw->yoffset >= g_height))
+		return False;
+
+	*x1 = MAX(sw->xoffset, 0) >> SW_CELL_SHIFT;
+	*y1 = MAX(sw->yoffset, 0) >> SW_CELL_SHIFT;
+	*x2 = MIN(sw->xoffset + sw->width - 1, g_width - 1) >> SW_CELL_SHIFT;
+	*y2 = MIN(sw->yoffset + sw->height - 1, g_height - 1) >> SW_CELL_SHIFT;
+	return True;
+}
+
+
+static void
+sw_grid_add(seamless_window * sw)
+{
+	sw_cell *cell;
+	int x, y;
+
+	if (g_sw_grid == NULL)
+	{
+		g_sw_grid_w = (g_width >> SW_CELL_SHIFT) + 1;
+		g_sw_grid_h = (g_height >> SW_CELL_SHIFT) + 1;
+		g_sw_grid = (sw_cell *) xmalloc(sizeof(sw_cell) * g_sw_grid_w * g_sw_grid_h);
+		memset(g_sw_grid, 0, sizeof(sw_cell) * g_sw_grid_w * g_sw_grid_h);
+	}
+
+	if (!sw_grid_cells(sw, &sw->cell_x1, &sw->cell_y1, &sw->cell_x2, &sw->cell_y2))
+	{
+		/* an empty range */
+		sw->cell_x1 = sw->cell_y1 = 0;
+		sw->cell_x2 = sw->cell_y2 = -1;
+		return;
+	}
+
+	for (y = sw->cell_y1; y <= sw->cell_y2; y++)
+	{
+		for (x = sw->cell_x1; x <= sw->cell_x2; x++)
+		{
+			cell = &g_sw_grid[y * g_sw_grid_w + x];
+			if (cell->count == cell->size)
+			{
+				cell->size = cell->size ? cell->size * 2 : 4;
+				cell->windows = (seamless_window **) xrealloc(cell->windows,
+									       sizeof(seamless_window *)
+									       * cell->size);
+			}
+			cell->windows[cell->count++] = sw;
+		}
+	}
+}
+
+
+static void
+sw_grid_remove(seamless_window * sw)
+{
+	sw_cell *cell;
+	int x, y, i;
+
+	for (y = sw->cell_y1; y <= sw->cell_y2; y++)
+	{
+		for (x = sw->cell_x1; x <= sw->cell_x2; x++)
+		{
+			cell = &g_sw_grid[y * g_sw_grid_w + x];
+			for (i = 0; i < cell->count; i++)
+			{
+				if (cell->windows[i] == sw)
+				{
+					cell->windows[i] = cell->windows[--cell->count];
+					break;
+				}
+			}
+		}
+	}
+}
+
+
+/* Call after changing the position or size of a window */
+static void
+sw_grid_move(seamless_window * sw)
+{
+	sw_grid_remove(sw);
+	sw_grid_add(sw);
+}
+
+
+/* The desktop changed size, lay out the grid again */
+static void
+sw_grid_rebuild(void)
+{
+	seamless_window *sw;
+	int i;
+
+	if (g_sw_grid == NULL)
+		return;
+
+	for (i = 0; i < g_sw_grid_w * g_sw_grid_h; i++)
+		xfree(g_sw_grid[i].windows);
+	xfree(g_sw_grid);
+	g_sw_grid = NULL;
+
+	for (sw = g_seamless_windows; sw; sw = sw->next)
+		sw_grid_add(sw);
+}
+
+
+/* Collect the windows that overlap a rectangle of the desktop in
+   g_sw_hits, and return how many there are */
+static int
+sw_windows_in(int x, int y, int cx, int cy)
+{
+	seamless_window *sw;
+	sw_cell *cell;
+	int x1, y1, x2, y2, cellx, celly, i, n;
+
+	if ((g_sw_grid == NULL) || (cx <= 0) || (cy <= 0))
+		return 0;
+
+	x1 = MAX(x, 0) >> SW_CELL_SHIFT;
+	y1 = MAX(y, 0) >> SW_CELL_SHIFT;
+	x2 = MIN(x + cx - 1, g_width - 1);
+	y2 = MIN(y + cy - 1, g_height - 1);
+	if ((x2 < 0) || (y2 < 0))
+		return 0;
+	x2 >>= SW_CELL_SHIFT;
+	y2 >>= SW_CELL_SHIFT;
+
+	/* a window is listed in every cell it overlaps, so stamp the
+	   ones we have seen */
+	g_sw_stamp++;
+	n = 0;
+	for (celly = y1; celly <= y2; celly++)
+	{
+		for (cellx = x1; cellx <= x2; cellx++)
+		{
+			cell = &g_sw_grid[celly * g_sw_grid_w + cellx];
+			for (i = 0; i < cell->count; i++)
+			{
+				sw = cell->windows[i];
+				if (sw->stamp == g_sw_stamp)
+					continue;
+				sw->stamp = g_sw_stamp;
+
+				if ((sw->xoffset >= x + cx) || (sw->xoffset + sw->width <= x)
+				    || (sw->yoffset >= y + cy) || (sw->yoffset + sw->height <= y))
+					continue;
+
+				if (n == g_sw_hits_size)
+				{
+					g_sw_hits_size = g_sw_hits_size ? g_sw_hits_size * 2 : 16;
+					g_sw_hits = (seamless_window **) xrealloc(g_sw_hits,
+										  sizeof(seamless_window *)
+										  * g_sw_hits_size);
+				}
+				g_sw_hits[n++] = sw;
+			}
+		}
+	}
+
+	return n;
+}
+
 /* colour maps */
 extern RD_BOOL g_owncolmap;
 static Colormap g_xcolmap;
@@ -268,6 +608,59 @@ static uint32 *g_colmap = NULL;
 #define SET_FOREGROUND(col)	XSetForeground(g_display, g_gc, TRANSLATE(col));
 #define SET_BACKGROUND(col)	XSetBackground(g_display, g_gc, TRANSLATE(col));
 
+/* set while an order that is already mirrored is drawn in several steps */
+static RD_BOOL g_shadow_hold = False;
+#define SHADOW			(g_shadow_framebuffer && !g_shadow_hold && !g_surface)
+#define SHADOW_INVALIDATE(x,y,cx,cy) { if (SHADOW) shadow_invalidate(x, y, cx, cy); }
+
+/* Solid fills in a single colour are queued up and sent as one
+   XFillRectangles request per drawable. Everything else that draws
+   must flush the queue first. */
+#define MAX_FILL_RECTS	256
+static XRectangle g_fill_rects[MAX_FILL_RECTS];
+static int g_fill_count = 0;
+static unsigned long g_fill_colour;
+
+static void
+flush_fills(void)
+{
+	if (g_fill_count == 0)
+		return;
+
+	XSetForeground(g_display, g_gc, g_fill_colour);
+	XFillRectangles(g_display, DRAWABLE, g_gc, g_fill_rects, g_fill_count);
+	if (OWNBACKSTORE)
+		XFillRectangles(g_display, g_backstore, g_gc, g_fill_rects, g_fill_count);
+	g_fill_count = 0;
+}
+
+static void
+queue_fill(int x, int y, int cx, int cy, unsigned long colour)
+{
+	XRectangle *rect;
+
+	if (SHADOW)
+		shadow_fill(x, y, cx, cy, colour);
+
+	/* seamless windows each need their own offsets */
+	if ((g_seamless_windows != NULL) && !g_surface)
+	{
+		XSetForeground(g_display, g_gc, colour);
+		FILL_RECTANGLE(x, y, cx, cy);
+		return;
+	}
+
+	if ((g_fill_count == MAX_FILL_RECTS) || ((g_fill_count > 0) && (colour != g_fill_colour)))
+		flush_fills();
+
+	rect = &g_fill_rects[g_fill_count++];
+	rect->x = x;
+	rect->y = y;
+	rect->width = cx;
+	rect->height = cy;
+	g_fill_colour = colour;
+}
+
 static int rop2_map[] = {
 	GXclear,		/* 0 */
 	GXnor,			/* DPon */
@@ -290,41 +683,24 @@ static int rop2_map[] = {
 #define SET_FUNCTION(rop2)	{ if (rop2 != ROP2_COPY) XSetFunction(g_display, g_gc, rop2_map[rop2]); }
 #define RESET_FUNCTION(rop2)	{ if (rop2 != ROP2_COPY) XSetFunction(g_display, g_gc, GXcopy); }
 
-static seamless_window *
-sw_get_window_by_id(unsigned long id)
-{
-	seamless_window *sw;
-	for (sw = g_seamless_windows; sw; sw = sw->next)
-	{
-		if (sw->id == id)
-			return sw;
-	}
-	return NULL;
-}
-
-
-static seamless_window *
-sw_get_window_by_wnd(Window wnd)
-{
-	seamless_window *sw;
-	for (sw = g_seamless_windows; sw; sw = sw->next)
-	{
-		if (sw->wnd == wnd)
-			return sw;
-	}
-	return NULL;
-}
-
-
 static void
 sw_remove_window(seamless_window * win)
 {
-	seamless_window *sw, **prevnext = &g_seamless_windows;
+	seamless_window *sw, **prevnext = &g_seamless_windows, **link;
 	for (sw = g_seamless_windows; sw; sw = sw->next)
 	{
 		if (sw == win)
 		{
 			*prevnext = sw->next;
+			link = &g_sw_by_id[SW_HASH(sw->id)];
+			while (*link != sw)
+				link = &(*link)->id_next;
+			*link = sw->id_next;
+			link = &g_sw_by_wnd[SW_HASH(sw->wnd)];
+			while (*link != sw)
+				link = &(*link)->wnd_next;
+			*link = sw->wnd_next;
+			sw_grid_remove(sw);
 			sw->group->refcnt--;
 			if (sw->group->refcnt == 0)
 			{
@@ -1824,56 +2200,332 @@ error_handler(Display * dpy, XErrorEvent * eev)
 	return g_old_error_handler(dpy, eev);
 }
 
-/* Initialize the UI. This is done once per process. */
-RD_BOOL
-ui_init(void)
+/* Upload a bitmap in the display's format to a new pixmap. If copy is
+   given, it receives the pixels as well. */
+static Pixmap
+upload_pixmap(int width, int height, uint8 * tdata, SURFACE * copy)
 {
-	int screen_num;
+	XImage *image;
+	Pixmap bitmap;
+	int bitmap_pad;
 
-	g_display = XOpenDisplay(NULL);
-	if (g_display == NULL)
+	if (g_server_depth == 8)
 	{
-		error("Failed to open display: %s\n", XDisplayName(NULL));
-		return False;
+		bitmap_pad = 8;
 	}
-
+	else
 	{
-		uint16 endianess_test = 1;
-		g_host_be = !(RD_BOOL) (*(uint8 *) (&endianess_test));
+		bitmap_pad = g_bpp;
+
+		if (g_bpp == 24)
+			bitmap_pad = 32;
 	}
 
-	g_old_error_handler = XSetErrorHandler(error_handler);
-	g_xserver_be = (ImageByteOrder(g_display) == MSBFirst);
-	screen_num = DefaultScreen(g_display);
-	g_x_socket = ConnectionNumber(g_display);
-	g_screen = ScreenOfDisplay(g_display, screen_num);
-	g_depth = DefaultDepthOfScreen(g_screen);
+	bitmap = XCreatePixmap(g_display, g_wnd, width, height, g_depth);
+	image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
+			     (char *) tdata, width, height, bitmap_pad, 0);
 
-	if (!select_visual(screen_num))
-		return False;
+	XPutImage(g_display, bitmap, g_create_bitmap_gc, image, 0, 0, 0, 0, width, height);
 
-	if (g_no_translate_image)
+	if (copy != NULL)
 	{
-		DEBUG(("Performance optimization possible: avoiding image translation (colour depth conversion).\n"));
+		copy->width = width;
+		copy->height = height;
+		copy->Bpp = g_bpp / 8;
+		copy->stride = image->bytes_per_line;
+		copy->big_endian = g_xserver_be;
+		copy->data = (uint8 *) xmalloc(copy->stride * height);
+		memcpy(copy->data, tdata, copy->stride * height);
+		raster_reset_clip(copy);
 	}
 
-	if (g_server_depth > g_bpp)
-	{
-		warning("Remote desktop colour depth %d higher than display colour depth %d.\n",
-			g_server_depth, g_bpp);
-	}
+	XFree(image);
+	return bitmap;
+}
 
-	DEBUG(("RDP depth: %d, display depth: %d, display bpp: %d, X server BE: %d, host BE: %d\n",
-	       g_server_depth, g_depth, g_bpp, g_xserver_be, g_host_be));
+/* Upload a bitmap in the server's format to a new pixmap */
+static Pixmap
+create_pixmap(int width, int height, uint8 * data, SURFACE * copy)
+{
+	Pixmap bitmap;
+	uint8 *tdata;
 
-	if (!g_owncolmap)
-	{
-		g_xcolmap =
-			XCreateColormap(g_display, RootWindowOfScreen(g_screen), g_visual,
-					AllocNone);
-		if (g_depth <= 8)
-			warning("Display colour depth is %d bit: you may want to use -C for a private colourmap.\n", g_depth);
-	}
+	tdata = (g_owncolmap ? data : translate_image(width, height, data));
+	bitmap = upload_pixmap(width, height, tdata, copy);
+	if (tdata != data)
+		xfree(tdata);
+	return bitmap;
+}
+
+/* The pixmap of a brush cache entry is made on first use and kept
+   until the entry is replaced */
+static cached_brush *
+get_cached_brush(BRUSHDATA * bd)
+{
+	cached_brush *cb = (cached_brush *) bd->handle;
+
+	if (cb != NULL)
+		return cb;
+
+	cb = (cached_brush *) xmalloc(sizeof(cached_brush));
+	if (bd->colour_code > 1)
+		cb->pixmap = create_pixmap(8, 8, bd->data, NULL);
+	else
+		cb->pixmap = (Pixmap) ui_create_glyph(8, 8, bd->data);
+	cb->tile = NULL;
+#ifdef HAVE_XRENDER
+	cb->picture = None;
+#endif
+
+	bd->handle = (RD_HBRUSH) cb;
+	return cb;
+}
+
+#ifdef HAVE_XRENDER
+static Picture
+get_brush_picture(BRUSHDATA * bd)
+{
+	cached_brush *cb = get_cached_brush(bd);
+	XRenderPictureAttributes attrs;
+
+	if (cb->picture == None)
+	{
+		attrs.repeat = True;
+		cb->picture = XRenderCreatePicture(g_display, cb->pixmap,
+						   (bd->colour_code > 1) ? g_xrender_format :
+						   g_xrender_glyph_format, CPRepeat, &attrs);
+	}
+
+	return cb->picture;
+}
+
+static void
+xrender_init(void)
+{
+	int event_base, error_base;
+
+	/* pen colours are plain pixel values, so stay away from private
+	   colour maps */
+	if (g_owncolmap || !XRenderQueryExtension(g_display, &event_base, &error_base))
+		return;
+
+	g_xrender_format = XRenderFindVisualFormat(g_display, g_visual);
+	g_xrender_glyph_format = XRenderFindStandardFormat(g_display, PictStandardA1);
+	if ((g_xrender_format == NULL) || (g_xrender_glyph_format == NULL))
+		return;
+
+	DEBUG(("Using XRender for text output.\n"));
+	g_xrender = True;
+}
+
+/* Picture of the drawable that FILL_RECTANGLE_BACKSTORE paints on */
+static Picture
+xrender_get_target(void)
+{
+	if (g_xrender_target == None)
+	{
+		g_xrender_target =
+			XRenderCreatePicture(g_display, OWNBACKSTORE ? g_backstore : DRAWABLE,
+					     g_xrender_format, 0, NULL);
+		g_xrender_clip_changed = True;
+	}
+
+	if (g_xrender_clip_changed)
+	{
+		XRenderSetPictureClipRectangles(g_display, g_xrender_target, 0, 0,
+						&g_clip_rectangle, 1);
+		g_xrender_clip_changed = False;
+	}
+
+	return g_xrender_target;
+}
+
+static void
+xrender_release_target(void)
+{
+	if (g_xrender_target != None)
+	{
+		XRenderFreePicture(g_display, g_xrender_target);
+		g_xrender_target = None;
+	}
+}
+
+/* Solid source picture of the given colour */
+static Picture
+xrender_get_pen(int colour)
+{
+	XRenderPictureAttributes attrs;
+	unsigned long pixel = TRANSLATE(colour);
+
+	if (g_xrender_pen == None)
+	{
+		g_xrender_pen_pixmap = XCreatePixmap(g_display, g_wnd, 1, 1, g_depth);
+		attrs.repeat = True;
+		g_xrender_pen = XRenderCreatePicture(g_display, g_xrender_pen_pixmap,
+						     g_xrender_format, CPRepeat, &attrs);
+		g_xrender_pen_colour = ~pixel;
+	}
+
+	if (pixel != g_xrender_pen_colour)
+	{
+		XSetForeground(g_display, g_create_bitmap_gc, pixel);
+		XFillRectangle(g_display, g_xrender_pen_pixmap, g_create_bitmap_gc, 0, 0, 1, 1);
+		g_xrender_pen_colour = pixel;
+	}
+
+	return g_xrender_pen;
+}
+
+static void
+xrender_colour(unsigned long pixel, XRenderColor * colour)
+{
+	XRenderDirectFormat *format = &g_xrender_format->direct;
+
+	colour->red = ((pixel >> format->red) & format->redMask) * 0xffff / format->redMask;
+	colour->green = ((pixel >> format->green) & format->greenMask) * 0xffff / format->greenMask;
+	colour->blue = ((pixel >> format->blue) & format->blueMask) * 0xffff / format->blueMask;
+	colour->alpha = 0xffff;
+}
+
+/* Paint a cached pattern brush. Of the ROPs only plain pattern copy
+   maps onto a composite operation; the rest is left to the GC path. */
+static RD_BOOL
+xrender_patblt(uint8 opcode, int x, int y, int cx, int cy, BRUSH * brush, int bgcolour,
+	       int fgcolour)
+{
+	Picture picture, target;
+	XRenderColor colour;
+
+	if (!g_xrender || (opcode != ROP2_COPY) || (brush->style != 3) || (brush->bd == NULL))
+		return False;
+
+	picture = get_brush_picture(brush->bd);
+	target = xrender_get_target();
+
+	if (brush->bd->colour_code > 1)
+	{
+		XRenderComposite(g_display, PictOpSrc, picture, None, target,
+				 x - brush->xorigin, y - brush->yorigin, 0, 0, x, y, cx, cy);
+	}
+	else
+	{
+		/* as with the stipple, set bits take the background colour */
+		xrender_colour(TRANSLATE(fgcolour), &colour);
+		XRenderFillRectangle(g_display, PictOpSrc, target, &colour, x, y, cx, cy);
+		XRenderComposite(g_display, PictOpOver, xrender_get_pen(bgcolour), picture,
+				 target, 0, 0, x - brush->xorigin, y - brush->yorigin, x, y, cx, cy);
+	}
+
+	return True;
+}
+
+/* Add a glyph with its origin at x, y to the current text run */
+static void
+xrender_queue_glyph(uint8 font, RD_HGLYPH glyph, int x, int y)
+{
+	XGlyphElt32 *elt;
+
+	if (g_text_count == g_text_size)
+	{
+		g_text_size = g_text_size ? g_text_size * 2 : 256;
+		g_text_elts = (XGlyphElt32 *) xrealloc(g_text_elts,
+						       g_text_size * sizeof(XGlyphElt32));
+		g_text_glyphs = (unsigned int *) xrealloc(g_text_glyphs,
+							  g_text_size * sizeof(unsigned int));
+	}
+
+	/* Our glyphs do not advance the pen, so each one gets an element
+	   of its own, positioned relative to the previous element. */
+	elt = &g_text_elts[g_text_count];
+	elt->glyphset = g_xrender_glyphsets[font];
+	elt->nchars = 1;
+	elt->xOff = x - g_text_x;
+	elt->yOff = y - g_text_y;
+	g_text_glyphs[g_text_count++] = (unsigned int) (long) glyph;
+	g_text_x = x;
+	g_text_y = y;
+}
+
+/* Composite the current text run in one go */
+static void
+xrender_draw_text(int fgcolour)
+{
+	int i;
+
+	if (g_text_count == 0)
+		return;
+
+	for (i = 0; i < g_text_count; i++)
+		g_text_elts[i].chars = &g_text_glyphs[i];
+
+	XRenderCompositeText32(g_display, PictOpOver, xrender_get_pen(fgcolour),
+			       xrender_get_target(), NULL, 0, 0, 0, 0, g_text_elts, g_text_count);
+
+	g_text_count = 0;
+	g_text_x = g_text_y = 0;
+}
+#endif
+
+/* Initialize the UI. This is done once per process. */
+RD_BOOL
+ui_init(void)
+{
+	int screen_num;
+
+	g_display = XOpenDisplay(NULL);
+	if (g_display == NULL)
+	{
+		error("Failed to open display: %s\n", XDisplayName(NULL));
+		return False;
+	}
+
+	{
+		uint16 endianess_test = 1;
+		g_host_be = !(RD_BOOL) (*(uint8 *) (&endianess_test));
+	}
+
+	g_old_error_handler = XSetErrorHandler(error_handler);
+	g_xserver_be = (ImageByteOrder(g_display) == MSBFirst);
+	screen_num = DefaultScreen(g_display);
+	g_x_socket = ConnectionNumber(g_display);
+	g_screen = ScreenOfDisplay(g_display, screen_num);
+	g_depth = DefaultDepthOfScreen(g_screen);
+
+	if (!select_visual(screen_num))
+		return False;
+
+#ifdef HAVE_XRENDER
+	xrender_init();
+#endif
+
+	if (g_shadow_framebuffer && (g_bpp % 8 != 0))
+	{
+		warning("Shadow framebuffer not supported at %d bpp.\n", g_bpp);
+		g_shadow_framebuffer = False;
+	}
+
+	if (g_no_translate_image)
+	{
+		DEBUG(("Performance optimization possible: avoiding image translation (colour depth conversion).\n"));
+	}
+
+	if (g_server_depth > g_bpp)
+	{
+		warning("Remote desktop colour depth %d higher than display colour depth %d.\n",
+			g_server_depth, g_bpp);
+	}
+
+	DEBUG(("RDP depth: %d, display depth: %d, display bpp: %d, X server BE: %d, host BE: %d\n",
+	       g_server_depth, g_depth, g_bpp, g_xserver_be, g_host_be));
+
+	if (!g_owncolmap)
+	{
+		g_xcolmap =
+			XCreateColormap(g_display, RootWindowOfScreen(g_screen), g_visual,
+					AllocNone);
+		if (g_depth <= 8)
+			warning("Display colour depth is %d bit: you may want to use -C for a private colourmap.\n", g_depth);
+	}
 
 	if ((!g_ownbackstore) && (DoesBackingStore(g_screen) != Always))
 	{
@@ -2040,6 +2692,9 @@ ui_create_window(void)
 		XFillRectangle(g_display, g_backstore, g_gc, 0, 0, g_width, g_height);
 	}
 
+	if (g_shadow_framebuffer)
+		shadow_init(g_width, g_height, g_bpp / 8, g_xserver_be);
+
 	XStoreName(g_display, g_wnd, g_title);
 	ewmh_set_wm_name(g_wnd, g_title);
 
@@ -2124,6 +2779,8 @@ ui_resize_window()
 	XSizeHints *sizehints;
 	Pixmap bs;
 
+	flush_fills();
+
 	sizehints = XAllocSizeHints();
 	if (sizehints)
 	{
@@ -2139,6 +2796,10 @@ ui_resize_window()
 		XResizeWindow(g_display, g_wnd, g_width, g_height);
 	}
 
+#ifdef HAVE_XRENDER
+	xrender_release_target();
+#endif
+
 	/* create new backstore pixmap */
 	if (g_backstore != 0)
 	{
@@ -2149,14 +2810,25 @@ ui_resize_window()
 		XFreePixmap(g_display, g_backstore);
 		g_backstore = bs;
 	}
+
+	if (g_shadow_framebuffer)
+		shadow_init(g_width, g_height, g_bpp / 8, g_xserver_be);
+
+	sw_grid_rebuild();
 }
 
 void
 ui_destroy_window(void)
 {
+	flush_fills();
+
 	if (g_IC != NULL)
 		XDestroyIC(g_IC);
 
+#ifdef HAVE_XRENDER
+	xrender_release_target();
+#endif
+
 	XDestroyWindow(g_display, g_wnd);
 	g_wnd = 0;
 
@@ -2628,19 +3300,24 @@ xwin_process_events(void)
 int
 ui_select(int rdp_socket)
 {
-	int n;
+	int n, send_socket;
 	fd_set rfds, wfds;
 	struct timeval tv;
 	RD_BOOL s_timeout = False;
 
 	while (True)
 	{
+		rd_check_cache_stats();
+
 		n = (rdp_socket > g_x_socket) ? rdp_socket : g_x_socket;
 		/* Process any events already waiting */
 		if (!xwin_process_events())
 			/* User quit */
 			return 0;
 
+		/* input from the events above, motion may wait a little */
+		rdp_flush_input(False);
+
 		if (g_seamless_active)
 			sw_check_timers();
 
@@ -2649,6 +3326,15 @@ ui_select(int rdp_socket)
 		FD_SET(rdp_socket, &rfds);
 		FD_SET(g_x_socket, &rfds);
 
+		/* queued virtual channel data; rdp_socket may be the wakeup
+		   pipe of the receive thread, so ask for the socket itself */
+		send_socket = channel_send_queued() ? tcp_get_socket() : -1;
+		if (send_socket >= 0)
+		{
+			FD_SET(send_socket, &wfds);
+			n = MAX(n, send_socket);
+		}
+
 		/* default timeout */
 		tv.tv_sec = 60;
 		tv.tv_usec = 0;
@@ -2660,13 +3346,16 @@ ui_select(int rdp_socket)
 		/* add redirection handles */
 		rdpdr_add_fds(&n, &rfds, &wfds, &tv, &s_timeout);
 		seamless_select_timeout(&tv);
+		rdp_input_timeout(&tv);
 
 		n++;
 
 		switch (select(n, &rfds, &wfds, NULL, &tv))
 		{
 			case -1:
-				error("select: %s\n", strerror(errno));
+				/* signals, such as SIGUSR1 for the cache statistics */
+				if (errno != EINTR)
+					error("select: %s\n", strerror(errno));
 
 			case 0:
 #ifdef WITH_RDPSND
@@ -2685,6 +3374,9 @@ ui_select(int rdp_socket)
 
 		rdpdr_check_fds(&rfds, &wfds, (RD_BOOL) False);
 
+		if ((send_socket >= 0) && FD_ISSET(send_socket, &wfds))
+			channel_send_pending();
+
 		if (FD_ISSET(rdp_socket, &rfds))
 			return 1;
 
@@ -2700,42 +3392,79 @@ ui_move_pointer(int x, int y)
 RD_HBITMAP
 ui_create_bitmap(int width, int height, uint8 * data)
 {
-	XImage *image;
-	Pixmap bitmap;
-	uint8 *tdata;
-	int bitmap_pad;
+	xbitmap *bmp = (xbitmap *) xmalloc(sizeof(xbitmap));
 
-	if (g_server_depth == 8)
-	{
-		bitmap_pad = 8;
-	}
-	else
-	{
-		bitmap_pad = g_bpp;
+	bmp->pixels.data = NULL;
+	bmp->pixmap = create_pixmap(width, height, data,
+				    g_shadow_framebuffer ? &bmp->pixels : NULL);
+	bmp->size = width * height * ((g_bpp + 7) / 8);
+	return (RD_HBITMAP) bmp;
+}
 
-		if (g_bpp == 24)
-			bitmap_pad = 32;
-	}
+/* Convert bitmap data to the display's format, ahead of
+   ui_create_translated_bitmap or ui_paint_translated_bitmap. Does not use
+   X, so it may be called from other threads, as long as the colour map
+   does not change meanwhile. The result is data itself if no conversion
+   is needed. */
+uint8 *
+ui_translate_bitmap(int width, int height, uint8 * data)
+{
+	return (g_owncolmap ? data : translate_image(width, height, data));
+}
 
-	tdata = (g_owncolmap ? data : translate_image(width, height, data));
-	bitmap = XCreatePixmap(g_display, g_wnd, width, height, g_depth);
-	image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
-			     (char *) tdata, width, height, bitmap_pad, 0);
+RD_HBITMAP
+ui_create_translated_bitmap(int width, int height, uint8 * tdata)
+{
+	xbitmap *bmp = (xbitmap *) xmalloc(sizeof(xbitmap));
 
-	XPutImage(g_display, bitmap, g_create_bitmap_gc, image, 0, 0, 0, 0, width, height);
+	bmp->pixels.data = NULL;
+	bmp->pixmap = upload_pixmap(width, height, tdata,
+				    g_shadow_framebuffer ? &bmp->pixels : NULL);
+	bmp->size = width * height * ((g_bpp + 7) / 8);
+	return (RD_HBITMAP) bmp;
+}
 
-	XFree(image);
-	if (tdata != data)
-		xfree(tdata);
-	return (RD_HBITMAP) bitmap;
+uint32
+ui_get_bitmap_size(RD_HBITMAP bmp)
+{
+	return ((xbitmap *) bmp)->size;
+}
+
+/* An offscreen bitmap for drawing orders, with undefined content */
+RD_HBITMAP
+ui_create_surface(int width, int height)
+{
+	xbitmap *bmp = (xbitmap *) xmalloc(sizeof(xbitmap));
+
+	bmp->pixels.data = NULL;
+	bmp->pixmap = XCreatePixmap(g_display, g_wnd, width, height, g_depth);
+	bmp->size = width * height * ((g_bpp + 7) / 8);
+	return (RD_HBITMAP) bmp;
 }
 
+/* Direct drawing orders to an offscreen bitmap, or to the screen if
+   surface is NULL */
 void
-ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * data)
+ui_set_surface(RD_HBITMAP surface)
+{
+	flush_fills();
+	g_surface = (xbitmap *) surface;
+#ifdef HAVE_XRENDER
+	xrender_release_target();
+#endif
+}
+
+void
+ui_paint_translated_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * tdata)
 {
 	XImage *image;
-	uint8 *tdata;
 	int bitmap_pad;
+	xbitmap *surface;
+
+	/* bitmap updates always go to the screen */
+	flush_fills();
+	surface = g_surface;
+	g_surface = NULL;
 
 	if (g_server_depth == 8)
 	{
@@ -2749,27 +3478,39 @@ ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * dat
 			bitmap_pad = 32;
 	}
 
-	tdata = (g_owncolmap ? data : translate_image(width, height, data));
 	image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
 			     (char *) tdata, width, height, bitmap_pad, 0);
 
+	if (SHADOW)
+		shadow_put_image(x, y, cx, cy, tdata, image->bytes_per_line);
+
 	if (g_ownbackstore)
 	{
 		XPutImage(g_display, g_backstore, g_gc, image, 0, 0, x, y, cx, cy);
 		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_backstore, sw->wnd, g_gc, x, y, cx, cy,
-					 x - sw->xoffset, y - sw->yoffset));
+		ON_SEAMLESS_WINDOWS_IN(x, y, cx, cy, XCopyArea,
+				       (g_display, g_backstore, sw->wnd, g_gc, x, y, cx, cy,
+					x - sw->xoffset, y - sw->yoffset));
 	}
 	else
 	{
 		XPutImage(g_display, g_wnd, g_gc, image, 0, 0, x, y, cx, cy);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
-					 x - sw->xoffset, y - sw->yoffset));
+		ON_SEAMLESS_WINDOWS_IN(x, y, cx, cy, XCopyArea,
+				       (g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
+					x - sw->xoffset, y - sw->yoffset));
 	}
 
 	XFree(image);
+	g_surface = surface;
+}
+
+void
+ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * data)
+{
+	uint8 *tdata;
+
+	tdata = (g_owncolmap ? data : translate_image(width, height, data));
+	ui_paint_translated_bitmap(x, y, cx, cy, width, height, tdata);
 	if (tdata != data)
 		xfree(tdata);
 }
@@ -2777,7 +3518,11 @@ ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * dat
 void
 ui_destroy_bitmap(RD_HBITMAP bmp)
 {
-	XFreePixmap(g_display, (Pixmap) bmp);
+	xbitmap *bitmap = (xbitmap *) bmp;
+
+	XFreePixmap(g_display, bitmap->pixmap);
+	xfree(bitmap->pixels.data);
+	xfree(bitmap);
 }
 
 RD_HGLYPH
@@ -2811,6 +3556,118 @@ ui_destroy_glyph(RD_HGLYPH glyph)
 	XFreePixmap(g_display, (Pixmap) glyph);
 }
 
+/* Glyphs of the font cache. With XRender these live in the glyph set of
+   their font slot, and the handle is the glyph id within that set. */
+static RD_HGLYPH
+create_font_glyph(uint8 font, int offset, int baseline, int width, int height, uint8 * data)
+{
+#ifdef HAVE_XRENDER
+	XGlyphInfo info;
+	Glyph id;
+	uint8 *bits, byte;
+	int scanline, stride, row, col, bit;
+
+	if (g_xrender && (font < NUM_ELEMENTS(g_xrender_glyphsets)))
+	{
+		if (g_xrender_glyphsets[font] == 0)
+			g_xrender_glyphsets[font] =
+				XRenderCreateGlyphSet(g_display, g_xrender_glyph_format);
+
+		/* RDP glyph scanlines are byte aligned and MSB first, XRender
+		   wants them 32 bit aligned and in the bit order of the server */
+		scanline = (width + 7) / 8;
+		stride = (scanline + 3) & ~3;
+		bits = (uint8 *) xmalloc(stride * height + 1);
+		memset(bits, 0, stride * height);
+		for (row = 0; row < height; row++)
+		{
+			for (col = 0; col < scanline; col++)
+			{
+				byte = data[row * scanline + col];
+				if (BitmapBitOrder(g_display) == LSBFirst)
+				{
+					for (bit = 0; bit < 8; bit++)
+						if (byte & (0x80 >> bit))
+							bits[row * stride + col] |= 1 << bit;
+				}
+				else
+				{
+					bits[row * stride + col] = byte;
+				}
+			}
+		}
+
+		info.width = width;
+		info.height = height;
+		info.x = -offset;
+		info.y = -baseline;
+		info.xOff = 0;
+		info.yOff = 0;
+
+		id = g_xrender_next_glyph++;
+		if ((uint32) g_xrender_next_glyph == 0)
+			g_xrender_next_glyph = 1;
+
+		XRenderAddGlyphs(g_display, g_xrender_glyphsets[font], &id, &info, 1,
+				 (char *) bits, stride * height);
+		xfree(bits);
+		return (RD_HGLYPH) id;
+	}
+#endif
+	return ui_create_glyph(width, height, data);
+}
+
+RD_HGLYPH
+ui_create_font_glyph(uint8 font, int offset, int baseline, int width, int height, uint8 * data)
+{
+	xfontglyph *glyph = (xfontglyph *) xmalloc(sizeof(xfontglyph));
+	int size = (width + 7) / 8 * height;
+
+	glyph->handle = create_font_glyph(font, offset, baseline, width, height, data);
+	glyph->bits = NULL;
+	if (g_shadow_framebuffer)
+	{
+		glyph->bits = (uint8 *) xmalloc(size);
+		memcpy(glyph->bits, data, size);
+	}
+
+	return (RD_HGLYPH) glyph;
+}
+
+void
+ui_destroy_font_glyph(uint8 font, RD_HGLYPH glyph)
+{
+	xfontglyph *fglyph = (xfontglyph *) glyph;
+#ifdef HAVE_XRENDER
+	Glyph id;
+
+	if (g_xrender && (font < NUM_ELEMENTS(g_xrender_glyphsets)))
+	{
+		id = (Glyph) fglyph->handle;
+		XRenderFreeGlyphs(g_display, g_xrender_glyphsets[font], &id, 1);
+	}
+	else
+#endif
+		ui_destroy_glyph(fglyph->handle);
+
+	xfree(fglyph->bits);
+	xfree(fglyph);
+}
+
+void
+ui_destroy_brush(RD_HBRUSH brush)
+{
+	cached_brush *cb = (cached_brush *) brush;
+
+#ifdef HAVE_XRENDER
+	if (cb->picture != None)
+		XRenderFreePicture(g_display, cb->picture);
+#endif
+	XFreePixmap(g_display, cb->pixmap);
+	xfree(cb->tile);
+	xfree(cb);
+}
+
 /* convert next pixel to 32 bpp */
 static int
 get_next_xor_pixel(uint8 * xormask, int bpp, int *k)
@@ -3099,21 +3956,33 @@ ui_set_colourmap(RD_HCOLOURMAP map)
 void
 ui_set_clip(int x, int y, int cx, int cy)
 {
+	flush_fills();
 	g_clip_rectangle.x = x;
 	g_clip_rectangle.y = y;
 	g_clip_rectangle.width = cx;
 	g_clip_rectangle.height = cy;
 	XSetClipRectangles(g_display, g_gc, 0, 0, &g_clip_rectangle, 1, YXBanded);
+	if (g_shadow_framebuffer)
+		shadow_set_clip(x, y, cx, cy);
+#ifdef HAVE_XRENDER
+	g_xrender_clip_changed = True;
+#endif
 }
 
 void
 ui_reset_clip(void)
 {
+	flush_fills();
 	g_clip_rectangle.x = 0;
 	g_clip_rectangle.y = 0;
 	g_clip_rectangle.width = g_width;
 	g_clip_rectangle.height = g_height;
 	XSetClipRectangles(g_display, g_gc, 0, 0, &g_clip_rectangle, 1, YXBanded);
+	if (g_shadow_framebuffer)
+		shadow_set_clip(0, 0, g_width, g_height);
+#ifdef HAVE_XRENDER
+	g_xrender_clip_changed = True;
+#endif
 }
 
 void
@@ -3126,6 +3995,9 @@ void
 ui_destblt(uint8 opcode,
 	   /* dest */ int x, int y, int cx, int cy)
 {
+	flush_fills();
+	if (SHADOW)
+		shadow_blt(ROP3_S(opcode), x, y, cx, cy, NULL, 0, 0, NULL);
 	SET_FUNCTION(opcode);
 	FILL_RECTANGLE(x, y, cx, cy);
 	RESET_FUNCTION(opcode);
@@ -3140,35 +4012,115 @@ static uint8 hatch_patterns[] = {
 	0x81, 0x42, 0x24, 0x18, 0x18, 0x24, 0x42, 0x81	/* 5 - bsDiagCross */
 };
 
-void
-ui_patblt(uint8 opcode,
-	  /* dest */ int x, int y, int cx, int cy,
-	  /* brush */ BRUSH * brush, int bgcolour, int fgcolour)
+#define NUM_HATCHES	(sizeof(hatch_patterns) / 8)
+
+static Pixmap g_hatch_stipples[NUM_HATCHES];
+
+/* Expand a brush the way patblt_gc draws it, for the shadow framebuffer.
+   bits holds a reversed rdp4 pattern, and tile the pixels of a colour
+   brush, which stay with its brush cache entry. */
+static RD_BOOL
+get_pattern(BRUSH * brush, int bgcolour, int fgcolour, PATTERN * pattern, uint8 * bits,
+	    SURFACE * tile)
+{
+	cached_brush *cb;
+	uint8 *tdata;
+	uint8 i;
+
+	pattern->fgcolour = TRANSLATE(fgcolour);
+	pattern->bgcolour = TRANSLATE(bgcolour);
+	pattern->mask = NULL;
+	pattern->tile = NULL;
+	pattern->xorigin = brush ? brush->xorigin : 0;
+	pattern->yorigin = brush ? brush->yorigin : 0;
+
+	switch (brush ? brush->style : 0)
+	{
+		case 0:	/* Solid */
+			return True;
+
+		case 2:	/* Hatch */
+			if (brush->pattern[0] >= NUM_HATCHES)
+				return False;
+			pattern->mask = hatch_patterns + brush->pattern[0] * 8;
+			return True;
+
+		case 3:	/* Pattern, set bits are in the background colour */
+			pattern->fgcolour = TRANSLATE(bgcolour);
+			pattern->bgcolour = TRANSLATE(fgcolour);
+			if (brush->bd == 0)	/* rdp4 brush */
+			{
+				for (i = 0; i != 8; i++)
+					bits[7 - i] = brush->pattern[i];
+				pattern->mask = bits;
+			}
+			else if (brush->bd->colour_code > 1)	/* > 1 bpp */
+			{
+				cb = get_cached_brush(brush->bd);
+				if (cb->tile == NULL)
+				{
+					tdata = (g_owncolmap ? brush->bd->data :
+						 translate_image(8, 8, brush->bd->data));
+					if (tdata == brush->bd->data)
+					{
+						cb->tile = (uint8 *) xmalloc(8 * 8 * (g_bpp / 8));
+						memcpy(cb->tile, tdata, 8 * 8 * (g_bpp / 8));
+					}
+					else
+						cb->tile = tdata;
+				}
+				tile->data = cb->tile;
+				tile->width = tile->height = 8;
+				tile->Bpp = g_bpp / 8;
+				tile->stride = 8 * tile->Bpp;
+				tile->big_endian = g_xserver_be;
+				pattern->tile = tile;
+			}
+			else
+			{
+				pattern->mask = brush->bd->data;
+			}
+			return True;
+	}
+
+	return False;
+}
+
+/* Set up g_gc to fill with a brush. Hatches and cached brushes use
+   pixmaps that are kept; only an rdp4 brush needs a stipple made for
+   the call, which is returned in temp for reset_brush_fill. */
+static RD_BOOL
+set_brush_fill(BRUSH * brush, int bgcolour, int fgcolour, Pixmap * temp)
 {
-	Pixmap fill;
 	uint8 i, ipattern[8];
+	Pixmap fill;
 
-	SET_FUNCTION(opcode);
+	*temp = 0;
 
-	switch (brush->style)
+	switch (brush ? brush->style : 0)
 	{
 		case 0:	/* Solid */
 			SET_FOREGROUND(fgcolour);
-			FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
-			break;
+			return True;
 
 		case 2:	/* Hatch */
-			fill = (Pixmap) ui_create_glyph(8, 8,
-							hatch_patterns + brush->pattern[0] * 8);
+			if (brush->pattern[0] >= NUM_HATCHES)
+			{
+				unimpl("hatch %d\n", brush->pattern[0]);
+				return False;
+			}
+			fill = g_hatch_stipples[brush->pattern[0]];
+			if (fill == 0)
+			{
+				fill = (Pixmap) ui_create_glyph(8, 8,
+								hatch_patterns +
+								brush->pattern[0] * 8);
+				g_hatch_stipples[brush->pattern[0]] = fill;
+			}
 			SET_FOREGROUND(fgcolour);
 			SET_BACKGROUND(bgcolour);
 			XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
 			XSetStipple(g_display, g_gc, fill);
-			XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-			FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
-			XSetFillStyle(g_display, g_gc, FillSolid);
-			XSetTSOrigin(g_display, g_gc, 0, 0);
-			ui_destroy_glyph((RD_HGLYPH) fill);
 			break;
 
 		case 3:	/* Pattern */
@@ -3176,54 +4128,108 @@ ui_patblt(uint8 opcode,
 			{
 				for (i = 0; i != 8; i++)
 					ipattern[7 - i] = brush->pattern[i];
-				fill = (Pixmap) ui_create_glyph(8, 8, ipattern);
-				SET_FOREGROUND(bgcolour);
-				SET_BACKGROUND(fgcolour);
-				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
+				fill = *temp = (Pixmap) ui_create_glyph(8, 8, ipattern);
 			}
-			else if (brush->bd->colour_code > 1)	/* > 1 bpp */
+			else
+			{
+				fill = get_cached_brush(brush->bd)->pixmap;
+			}
+
+			if ((brush->bd != 0) && (brush->bd->colour_code > 1))	/* > 1 bpp */
 			{
-				fill = (Pixmap) ui_create_bitmap(8, 8, brush->bd->data);
 				XSetFillStyle(g_display, g_gc, FillTiled);
 				XSetTile(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_bitmap((RD_HBITMAP) fill);
 			}
 			else
 			{
-				fill = (Pixmap) ui_create_glyph(8, 8, brush->bd->data);
 				SET_FOREGROUND(bgcolour);
 				SET_BACKGROUND(fgcolour);
 				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
 				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
 			}
 			break;
 
 		default:
 			unimpl("brush %d\n", brush->style);
+			return False;
+	}
+
+	XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
+	return True;
+}
+
+static void
+reset_brush_fill(BRUSH * brush, Pixmap temp)
+{
+	if ((brush == NULL) || (brush->style == 0))
+		return;
+
+	XSetFillStyle(g_display, g_gc, FillSolid);
+	XSetTSOrigin(g_display, g_gc, 0, 0);
+	if (temp != 0)
+		ui_destroy_glyph((RD_HGLYPH) temp);
+}
+
+/* Mirror an order with a brush into the shadow framebuffer */
+static void
+shadow_brush_blt(uint8 rop, int x, int y, int cx, int cy, SURFACE * src, int srcx, int srcy,
+		 BRUSH * brush, int bgcolour, int fgcolour)
+{
+	PATTERN pattern;
+	SURFACE tile;
+	uint8 bits[8];
+
+	if (((src != NULL) && (src->data == NULL))
+	    || !get_pattern(brush, bgcolour, fgcolour, &pattern, bits, &tile))
+	{
+		shadow_invalidate(x, y, cx, cy);
+		return;
+	}
+
+	shadow_blt(rop, x, y, cx, cy, src, srcx, srcy, &pattern);
+}
+
+static void
+patblt_gc(uint8 opcode,
+	  /* dest */ int x, int y, int cx, int cy,
+	  /* brush */ BRUSH * brush, int bgcolour, int fgcolour)
+{
+	Pixmap temp;
+
+	SET_FUNCTION(opcode);
+
+	if (set_brush_fill(brush, bgcolour, fgcolour, &temp))
+	{
+		FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
+		reset_brush_fill(brush, temp);
 	}
 
 	RESET_FUNCTION(opcode);
+}
 
-	if (g_ownbackstore)
+void
+ui_patblt(uint8 opcode,
+	  /* dest */ int x, int y, int cx, int cy,
+	  /* brush */ BRUSH * brush, int bgcolour, int fgcolour)
+{
+	if ((brush->style == 0) && (opcode == ROP2_COPY))
+	{
+		queue_fill(x, y, cx, cy, TRANSLATE(fgcolour));
+		return;
+	}
+
+	flush_fills();
+	if (SHADOW)
+		shadow_brush_blt(ROP3_P(opcode), x, y, cx, cy, NULL, 0, 0, brush, bgcolour,
+				 fgcolour);
+	if (!xrender_patblt(opcode, x, y, cx, cy, brush, bgcolour, fgcolour))
+		patblt_gc(opcode, x, y, cx, cy, brush, bgcolour, fgcolour);
+
+	if (OWNBACKSTORE)
 		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-				(g_display, g_ownbackstore ? g_backstore : g_wnd, sw->wnd, g_gc,
-				 x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
+	ON_SEAMLESS_WINDOWS_IN(x, y, cx, cy, XCopyArea,
+			       (g_display, g_ownbackstore ? g_backstore : g_wnd, sw->wnd, g_gc,
+				x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
 }
 
 void
@@ -3231,8 +4237,12 @@ ui_screenblt(uint8 opcode,
 	     /* dest */ int x, int y, int cx, int cy,
 	     /* src */ int srcx, int srcy)
 {
+	flush_fills();
+	if (SHADOW)
+		shadow_blt(ROP3_S(opcode), x, y, cx, cy, shadow_surface(), srcx, srcy, NULL);
+
 	SET_FUNCTION(opcode);
-	if (g_ownbackstore)
+	if (OWNBACKSTORE)
 	{
 		XCopyArea(g_display, g_Unobscured ? g_wnd : g_backstore,
 			  g_wnd, g_gc, srcx, srcy, cx, cy, x, y);
@@ -3240,12 +4250,12 @@ ui_screenblt(uint8 opcode,
 	}
 	else
 	{
-		XCopyArea(g_display, g_wnd, g_wnd, g_gc, srcx, srcy, cx, cy, x, y);
+		XCopyArea(g_display, DRAWABLE, DRAWABLE, g_gc, srcx, srcy, cx, cy, x, y);
 	}
 
-	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-				(g_display, g_ownbackstore ? g_backstore : g_wnd,
-				 sw->wnd, g_gc, x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
+	ON_SEAMLESS_WINDOWS_IN(x, y, cx, cy, XCopyArea,
+			       (g_display, g_ownbackstore ? g_backstore : g_wnd,
+				sw->wnd, g_gc, x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
 
 	RESET_FUNCTION(opcode);
 }
@@ -3255,13 +4265,25 @@ ui_memblt(uint8 opcode,
 	  /* dest */ int x, int y, int cx, int cy,
 	  /* src */ RD_HBITMAP src, int srcx, int srcy)
 {
+	xbitmap *bmp = (xbitmap *) src;
+
+	flush_fills();
+	if (SHADOW)
+	{
+		/* offscreen bitmaps have no copy of their pixels */
+		if (bmp->pixels.data != NULL)
+			shadow_blt(ROP3_S(opcode), x, y, cx, cy, &bmp->pixels, srcx, srcy, NULL);
+		else
+			shadow_invalidate(x, y, cx, cy);
+	}
+
 	SET_FUNCTION(opcode);
-	XCopyArea(g_display, (Pixmap) src, g_wnd, g_gc, srcx, srcy, cx, cy, x, y);
-	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-				(g_display, (Pixmap) src, sw->wnd, g_gc,
-				 srcx, srcy, cx, cy, x - sw->xoffset, y - sw->yoffset));
-	if (g_ownbackstore)
-		XCopyArea(g_display, (Pixmap) src, g_backstore, g_gc, srcx, srcy, cx, cy, x, y);
+	XCopyArea(g_display, bmp->pixmap, DRAWABLE, g_gc, srcx, srcy, cx, cy, x, y);
+	ON_SEAMLESS_WINDOWS_IN(x, y, cx, cy, XCopyArea,
+			       (g_display, bmp->pixmap, sw->wnd, g_gc,
+				srcx, srcy, cx, cy, x - sw->xoffset, y - sw->yoffset));
+	if (OWNBACKSTORE)
+		XCopyArea(g_display, bmp->pixmap, g_backstore, g_gc, srcx, srcy, cx, cy, x, y);
 	RESET_FUNCTION(opcode);
 }
 
@@ -3271,6 +4293,17 @@ ui_triblt(uint8 opcode,
 	  /* src */ RD_HBITMAP src, int srcx, int srcy,
 	  /* brush */ BRUSH * brush, int bgcolour, int fgcolour)
 {
+	xbitmap *bmp = (xbitmap *) src;
+
+	/* The shadow framebuffer does any ROP in one go */
+	if (SHADOW)
+	{
+		flush_fills();
+		shadow_brush_blt(opcode, x, y, cx, cy, &bmp->pixels, srcx, srcy, brush,
+				 bgcolour, fgcolour);
+		g_shadow_hold = True;
+	}
+
 	/* This is potentially difficult to do in general. Until someone
 	   comes up with a more efficient way of doing it I am using cases. */
 
@@ -3293,9 +4326,27 @@ ui_triblt(uint8 opcode,
 			break;
 
 		default:
-			unimpl("triblt 0x%x\n", opcode);
-			ui_memblt(ROP2_COPY, x, y, cx, cy, src, srcx, srcy);
+			/* ROPs that ignore one operand are a single pass */
+			if ((opcode >> 4) == (opcode & 0xf))
+			{
+				ui_memblt(ROP2_S(opcode), x, y, cx, cy, src, srcx, srcy);
+			}
+			else if (((opcode >> 2) & 0x33) == (opcode & 0x33))
+			{
+				ui_patblt(ROP2_P(opcode), x, y, cx, cy, brush, bgcolour, fgcolour);
+			}
+			else
+			{
+				unimpl("triblt 0x%x\n", opcode);
+				ui_memblt(ROP2_COPY, x, y, cx, cy, src, srcx, srcy);
+				/* the window now differs from the shadow, which did
+				   the real ROP; take the window's word for it */
+				if (g_shadow_hold)
+					shadow_invalidate(x, y, cx, cy);
+			}
 	}
+
+	g_shadow_hold = False;
 }
 
 void
@@ -3303,13 +4354,18 @@ ui_line(uint8 opcode,
 	/* dest */ int startx, int starty, int endx, int endy,
 	/* pen */ PEN * pen)
 {
+	flush_fills();
+	if (SHADOW)
+		shadow_line(ROP3_P(opcode), startx, starty, endx, endy, TRANSLATE(pen->colour));
 	SET_FUNCTION(opcode);
 	SET_FOREGROUND(pen->colour);
-	XDrawLine(g_display, g_wnd, g_gc, startx, starty, endx, endy);
-	ON_ALL_SEAMLESS_WINDOWS(XDrawLine, (g_display, sw->wnd, g_gc,
-					    startx - sw->xoffset, starty - sw->yoffset,
-					    endx - sw->xoffset, endy - sw->yoffset));
-	if (g_ownbackstore)
+	XDrawLine(g_display, DRAWABLE, g_gc, startx, starty, endx, endy);
+	ON_SEAMLESS_WINDOWS_IN(MIN(startx, endx), MIN(starty, endy),
+			       abs(endx - startx) + 1, abs(endy - starty) + 1,
+			       XDrawLine, (g_display, sw->wnd, g_gc,
+					   startx - sw->xoffset, starty - sw->yoffset,
+					   endx - sw->xoffset, endy - sw->yoffset));
+	if (OWNBACKSTORE)
 		XDrawLine(g_display, g_backstore, g_gc, startx, starty, endx, endy);
 	RESET_FUNCTION(opcode);
 }
@@ -3319,8 +4375,7 @@ ui_rect(
 	       /* dest */ int x, int y, int cx, int cy,
 	       /* brush */ int colour)
 {
-	SET_FOREGROUND(colour);
-	FILL_RECTANGLE(x, y, cx, cy);
+	queue_fill(x, y, cx, cy, TRANSLATE(colour));
 }
 
 void
@@ -3329,9 +4384,23 @@ ui_polygon(uint8 opcode,
 	   /* dest */ RD_POINT * point, int npoints,
 	   /* brush */ BRUSH * brush, int bgcolour, int fgcolour)
 {
-	uint8 style, i, ipattern[8];
-	Pixmap fill;
+	uint8 ipattern[8];
+	Pixmap temp;
+	PATTERN pattern;
+	SURFACE tile;
+	int x, y, cx, cy;
 
+	flush_fills();
+	if (SHADOW)
+	{
+		if (get_pattern(brush, bgcolour, fgcolour, &pattern, ipattern, &tile))
+			shadow_polygon(ROP3_P(opcode), fillmode, point, npoints, &pattern);
+		else
+		{
+			points_extent(point, npoints, &x, &y, &cx, &cy);
+			shadow_invalidate(x, y, cx, cy);
+		}
+	}
 	SET_FUNCTION(opcode);
 
 	switch (fillmode)
@@ -3346,76 +4415,10 @@ ui_polygon(uint8 opcode,
 			unimpl("fill mode %d\n", fillmode);
 	}
 
-	if (brush)
-		style = brush->style;
-	else
-		style = 0;
-
-	switch (style)
+	if (set_brush_fill(brush, bgcolour, fgcolour, &temp))
 	{
-		case 0:	/* Solid */
-			SET_FOREGROUND(fgcolour);
-			FILL_POLYGON((XPoint *) point, npoints);
-			break;
-
-		case 2:	/* Hatch */
-			fill = (Pixmap) ui_create_glyph(8, 8,
-							hatch_patterns + brush->pattern[0] * 8);
-			SET_FOREGROUND(fgcolour);
-			SET_BACKGROUND(bgcolour);
-			XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-			XSetStipple(g_display, g_gc, fill);
-			XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-			FILL_POLYGON((XPoint *) point, npoints);
-			XSetFillStyle(g_display, g_gc, FillSolid);
-			XSetTSOrigin(g_display, g_gc, 0, 0);
-			ui_destroy_glyph((RD_HGLYPH) fill);
-			break;
-
-		case 3:	/* Pattern */
-			if (brush->bd == 0)	/* rdp4 brush */
-			{
-				for (i = 0; i != 8; i++)
-					ipattern[7 - i] = brush->pattern[i];
-				fill = (Pixmap) ui_create_glyph(8, 8, ipattern);
-				SET_FOREGROUND(bgcolour);
-				SET_BACKGROUND(fgcolour);
-				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_POLYGON((XPoint *) point, npoints);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
-			}
-			else if (brush->bd->colour_code > 1)	/* > 1 bpp */
-			{
-				fill = (Pixmap) ui_create_bitmap(8, 8, brush->bd->data);
-				XSetFillStyle(g_display, g_gc, FillTiled);
-				XSetTile(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_POLYGON((XPoint *) point, npoints);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_bitmap((RD_HBITMAP) fill);
-			}
-			else
-			{
-				fill = (Pixmap) ui_create_glyph(8, 8, brush->bd->data);
-				SET_FOREGROUND(bgcolour);
-				SET_BACKGROUND(fgcolour);
-				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_POLYGON((XPoint *) point, npoints);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
-			}
-			break;
-
-		default:
-			unimpl("brush %d\n", brush->style);
+		FILL_POLYGON((XPoint *) point, npoints);
+		reset_brush_fill(brush, temp);
 	}
 
 	RESET_FUNCTION(opcode);
@@ -3426,16 +4429,22 @@ ui_polyline(uint8 opcode,
 	    /* dest */ RD_POINT * points, int npoints,
 	    /* pen */ PEN * pen)
 {
+	int x, y, cx, cy;
+
 	/* TODO: set join style */
+	flush_fills();
+	points_extent(points, npoints, &x, &y, &cx, &cy);
+	if (SHADOW)
+		shadow_polyline(ROP3_P(opcode), points, npoints, TRANSLATE(pen->colour));
 	SET_FUNCTION(opcode);
 	SET_FOREGROUND(pen->colour);
-	XDrawLines(g_display, g_wnd, g_gc, (XPoint *) points, npoints, CoordModePrevious);
-	if (g_ownbackstore)
+	XDrawLines(g_display, DRAWABLE, g_gc, (XPoint *) points, npoints, CoordModePrevious);
+	if (OWNBACKSTORE)
 		XDrawLines(g_display, g_backstore, g_gc, (XPoint *) points, npoints,
 			   CoordModePrevious);
 
-	ON_ALL_SEAMLESS_WINDOWS(seamless_XDrawLines,
-				(sw->wnd, (XPoint *) points, npoints, sw->xoffset, sw->yoffset));
+	ON_SEAMLESS_WINDOWS_IN(x, y, cx, cy, seamless_XDrawLines,
+			       (sw->wnd, (XPoint *) points, npoints, sw->xoffset, sw->yoffset));
 
 	RESET_FUNCTION(opcode);
 }
@@ -3446,81 +4455,25 @@ ui_ellipse(uint8 opcode,
 	   /* dest */ int x, int y, int cx, int cy,
 	   /* brush */ BRUSH * brush, int bgcolour, int fgcolour)
 {
-	uint8 style, i, ipattern[8];
-	Pixmap fill;
+	uint8 ipattern[8];
+	Pixmap temp;
+	PATTERN pattern;
+	SURFACE tile;
 
+	flush_fills();
+	if (SHADOW)
+	{
+		if (get_pattern(brush, bgcolour, fgcolour, &pattern, ipattern, &tile))
+			shadow_ellipse(ROP3_P(opcode), fillmode, x, y, cx, cy, &pattern);
+		else
+			shadow_invalidate(x, y, cx + 1, cy + 1);
+	}
 	SET_FUNCTION(opcode);
 
-	if (brush)
-		style = brush->style;
-	else
-		style = 0;
-
-	switch (style)
+	if (set_brush_fill(brush, bgcolour, fgcolour, &temp))
 	{
-		case 0:	/* Solid */
-			SET_FOREGROUND(fgcolour);
-			DRAW_ELLIPSE(x, y, cx, cy, fillmode);
-			break;
-
-		case 2:	/* Hatch */
-			fill = (Pixmap) ui_create_glyph(8, 8,
-							hatch_patterns + brush->pattern[0] * 8);
-			SET_FOREGROUND(fgcolour);
-			SET_BACKGROUND(bgcolour);
-			XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-			XSetStipple(g_display, g_gc, fill);
-			XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-			DRAW_ELLIPSE(x, y, cx, cy, fillmode);
-			XSetFillStyle(g_display, g_gc, FillSolid);
-			XSetTSOrigin(g_display, g_gc, 0, 0);
-			ui_destroy_glyph((RD_HGLYPH) fill);
-			break;
-
-		case 3:	/* Pattern */
-			if (brush->bd == 0)	/* rdp4 brush */
-			{
-				for (i = 0; i != 8; i++)
-					ipattern[7 - i] = brush->pattern[i];
-				fill = (Pixmap) ui_create_glyph(8, 8, ipattern);
-				SET_FOREGROUND(bgcolour);
-				SET_BACKGROUND(fgcolour);
-				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				DRAW_ELLIPSE(x, y, cx, cy, fillmode);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
-			}
-			else if (brush->bd->colour_code > 1)	/* > 1 bpp */
-			{
-				fill = (Pixmap) ui_create_bitmap(8, 8, brush->bd->data);
-				XSetFillStyle(g_display, g_gc, FillTiled);
-				XSetTile(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				DRAW_ELLIPSE(x, y, cx, cy, fillmode);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_bitmap((RD_HBITMAP) fill);
-			}
-			else
-			{
-				fill = (Pixmap) ui_create_glyph(8, 8, brush->bd->data);
-				SET_FOREGROUND(bgcolour);
-				SET_BACKGROUND(fgcolour);
-				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				DRAW_ELLIPSE(x, y, cx, cy, fillmode);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
-			}
-			break;
-
-		default:
-			unimpl("brush %d\n", brush->style);
+		DRAW_ELLIPSE(x, y, cx, cy, fillmode);
+		reset_brush_fill(brush, temp);
 	}
 
 	RESET_FUNCTION(opcode);
@@ -3533,6 +4486,8 @@ ui_draw_glyph(int mixmode,
 	      /* src */ RD_HGLYPH glyph, int srcx, int srcy,
 	      int bgcolour, int fgcolour)
 {
+	flush_fills();
+	SHADOW_INVALIDATE(x, y, cx, cy);
 	SET_FOREGROUND(fgcolour);
 	SET_BACKGROUND(bgcolour);
 
@@ -3570,11 +4525,22 @@ ui_draw_glyph(int mixmode,
   }\
   if (glyph != NULL)\
   {\
+    fglyph = (xfontglyph *) glyph->pixmap;\
     x1 = x + glyph->offset;\
     y1 = y + glyph->baseline;\
-    XSetStipple(g_display, g_gc, (Pixmap) glyph->pixmap);\
-    XSetTSOrigin(g_display, g_gc, x1, y1);\
-    FILL_RECTANGLE_BACKSTORE(x1, y1, glyph->width, glyph->height);\
+    if (SHADOW)\
+      shadow_stipple(x1, y1, glyph->width, glyph->height, fglyph->bits,\
+		     (glyph->width + 7) / 8, 0, 0, fgpixel, 0, False);\
+    if (XRENDER_TEXT)\
+    {\
+      xrender_queue_glyph(font, fglyph->handle, x, y);\
+    }\
+    else\
+    {\
+      XSetStipple(g_display, g_gc, (Pixmap) fglyph->handle);\
+      XSetTSOrigin(g_display, g_gc, x1, y1);\
+      FILL_RECTANGLE_BACKSTORE(x1, y1, glyph->width, glyph->height);\
+    }\
     if (flags & TEXT2_IMPLICIT_X)\
       x += glyph->width;\
   }\
@@ -3589,9 +4555,12 @@ ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y,
 	/* TODO: use brush appropriately */
 
 	FONTGLYPH *glyph;
+	xfontglyph *fglyph;
 	int i, j, xyoffset, x1, y1;
+	uint32 fgpixel = TRANSLATE(fgcolour);
 	DATABLOB *entry;
 
+	flush_fills();
 	SET_FOREGROUND(bgcolour);
 
 	/* Sometimes, the boxcx value is something really large, like
@@ -3603,15 +4572,22 @@ ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y,
 	if (boxcx > 1)
 	{
 		FILL_RECTANGLE_BACKSTORE(boxx, boxy, boxcx, boxcy);
+		if (SHADOW)
+			shadow_fill(boxx, boxy, boxcx, boxcy, TRANSLATE(bgcolour));
 	}
 	else if (mixmode == MIX_OPAQUE)
 	{
 		FILL_RECTANGLE_BACKSTORE(clipx, clipy, clipcx, clipcy);
+		if (SHADOW)
+			shadow_fill(clipx, clipy, clipcx, clipcy, TRANSLATE(bgcolour));
 	}
 
-	SET_FOREGROUND(fgcolour);
-	SET_BACKGROUND(bgcolour);
-	XSetFillStyle(g_display, g_gc, FillStippled);
+	if (!XRENDER_TEXT)
+	{
+		SET_FOREGROUND(fgcolour);
+		SET_BACKGROUND(bgcolour);
+		XSetFillStyle(g_display, g_gc, FillStippled);
+	}
 
 	/* Paint text, character by character */
 	for (i = 0; i < length;)
@@ -3679,40 +4655,43 @@ ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y,
 		}
 	}
 
-	XSetFillStyle(g_display, g_gc, FillSolid);
+	if (XRENDER_TEXT)
+		xrender_draw_text(fgcolour);
+	else
+		XSetFillStyle(g_display, g_gc, FillSolid);
 
-	if (g_ownbackstore)
+	if (OWNBACKSTORE)
 	{
 		if (boxcx > 1)
 		{
 			XCopyArea(g_display, g_backstore, g_wnd, g_gc, boxx,
 				  boxy, boxcx, boxcy, boxx, boxy);
-			ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-						(g_display, g_backstore, sw->wnd, g_gc,
-						 boxx, boxy,
-						 boxcx, boxcy,
-						 boxx - sw->xoffset, boxy - sw->yoffset));
+			ON_SEAMLESS_WINDOWS_IN(boxx, boxy, boxcx, boxcy, XCopyArea,
+					       (g_display, g_backstore, sw->wnd, g_gc,
+						boxx, boxy,
+						boxcx, boxcy,
+						boxx - sw->xoffset, boxy - sw->yoffset));
 		}
 		else
 		{
 			XCopyArea(g_display, g_backstore, g_wnd, g_gc, clipx,
 				  clipy, clipcx, clipcy, clipx, clipy);
-			ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-						(g_display, g_backstore, sw->wnd, g_gc,
-						 clipx, clipy,
-						 clipcx, clipcy, clipx - sw->xoffset,
-						 clipy - sw->yoffset));
+			ON_SEAMLESS_WINDOWS_IN(clipx, clipy, clipcx, clipcy, XCopyArea,
+					       (g_display, g_backstore, sw->wnd, g_gc,
+						clipx, clipy,
+						clipcx, clipcy, clipx - sw->xoffset,
+						clipy - sw->yoffset));
 		}
 	}
 }
 
-void
-ui_desktop_save(uint32 offset, int x, int y, int cx, int cy)
+static XImage *
+get_screen_image(int x, int y, int cx, int cy)
 {
 	Pixmap pix;
 	XImage *image;
 
-	if (g_ownbackstore)
+	if (OWNBACKSTORE)
 	{
 		image = XGetImage(g_display, g_backstore, x, y, cx, cy, AllPlanes, ZPixmap);
 		exit_if_null(image);
@@ -3720,13 +4699,43 @@ ui_desktop_save(uint32 offset, int x, int y, int cx, int cy)
 	else
 	{
 		pix = XCreatePixmap(g_display, g_wnd, cx, cy, g_depth);
-		XCopyArea(g_display, g_wnd, pix, g_gc, x, y, cx, cy, 0, 0);
+		XCopyArea(g_display, DRAWABLE, pix, g_gc, x, y, cx, cy, 0, 0);
 		image = XGetImage(g_display, pix, 0, 0, cx, cy, AllPlanes, ZPixmap);
 		exit_if_null(image);
 		XFreePixmap(g_display, pix);
 	}
 
+	return image;
+}
+
+void
+ui_desktop_save(uint32 offset, int x, int y, int cx, int cy)
+{
+	XImage *image;
+	SURFACE *shadow;
+	int sx = x, sy = y, scx = cx, scy = cy;
+
+	flush_fills();
+
 	offset *= g_bpp / 8;
+	if (SHADOW && (x >= 0) && (y >= 0) && (x + cx <= g_width)
+	    && (y + cy <= g_height))
+	{
+		/* only what we could not mirror needs to come from the server */
+		if (shadow_get_stale(&sx, &sy, &scx, &scy))
+		{
+			image = get_screen_image(sx, sy, scx, scy);
+			shadow_load(sx, sy, scx, scy, (uint8 *) image->data, image->bytes_per_line);
+			XDestroyImage(image);
+		}
+
+		shadow = shadow_surface();
+		cache_put_desktop(offset, cx, cy, shadow->stride, shadow->Bpp,
+				  shadow->data + y * shadow->stride + x * shadow->Bpp);
+		return;
+	}
+
+	image = get_screen_image(x, y, cx, cy);
 	cache_put_desktop(offset, cx, cy, image->bytes_per_line, g_bpp / 8, (uint8 *) image->data);
 
 	XDestroyImage(image);
@@ -3738,6 +4747,8 @@ ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy)
 	XImage *image;
 	uint8 *data;
 
+	flush_fills();
+
 	offset *= g_bpp / 8;
 	data = cache_get_desktop(offset, cx, cy, g_bpp / 8);
 	if (data == NULL)
@@ -3746,20 +4757,23 @@ ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy)
 	image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
 			     (char *) data, cx, cy, g_bpp, 0);
 
-	if (g_ownbackstore)
+	if (SHADOW)
+		shadow_put_image(x, y, cx, cy, data, image->bytes_per_line);
+
+	if (OWNBACKSTORE)
 	{
 		XPutImage(g_display, g_backstore, g_gc, image, 0, 0, x, y, cx, cy);
 		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_backstore, sw->wnd, g_gc,
-					 x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
+		ON_SEAMLESS_WINDOWS_IN(x, y, cx, cy, XCopyArea,
+				       (g_display, g_backstore, sw->wnd, g_gc,
+					x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
 	}
 	else
 	{
-		XPutImage(g_display, g_wnd, g_gc, image, 0, 0, x, y, cx, cy);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
-					 x - sw->xoffset, y - sw->yoffset));
+		XPutImage(g_display, DRAWABLE, g_gc, image, 0, 0, x, y, cx, cy);
+		ON_SEAMLESS_WINDOWS_IN(x, y, cx, cy, XCopyArea,
+				       (g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
+					x - sw->xoffset, y - sw->yoffset));
 	}
 
 	XFree(image);
@@ -3774,9 +4788,18 @@ ui_begin_update(void)
 void
 ui_end_update(void)
 {
+	flush_fills();
 	XFlush(g_display);
 }
 
+/* Wait for the X server to finish drawing, for timing */
+void
+ui_sync(void)
+{
+	flush_fills();
+	XSync(g_display, False);
+}
+
 
 void
 ui_seamless_begin(RD_BOOL hidden)
@@ -3986,6 +5009,11 @@ ui_seamless_create_window(unsigned long id, unsigned long group, unsigned long p
 
 	sw->next = g_seamless_windows;
 	g_seamless_windows = sw;
+	sw->id_next = g_sw_by_id[SW_HASH(id)];
+	g_sw_by_id[SW_HASH(id)] = sw;
+	sw->wnd_next = g_sw_by_wnd[SW_HASH(wnd)];
+	g_sw_by_wnd[SW_HASH(wnd)] = sw;
+	sw_grid_add(sw);
 
 	/* WM_HINTS */
 	wmhints = XAllocWMHints();
@@ -4154,6 +5182,7 @@ ui_seamless_move_window(unsigned long id, int x, int y, int width, int height, u
 	sw->yoffset = y;
 	sw->width = width;
 	sw->height = height;
+	sw_grid_move(sw);
 
 	/* If we move the window in a maximized state, then KDE won't
 	   accept restoration */
@@ -4328,6 +5357,7 @@ ui_seamless_ack(unsigned int serial)
 			sw->width = sw->outpos_width;
 			sw->height = sw->outpos_height;
 			sw->outstanding_position = False;
+			sw_grid_move(sw);
 
 			/* Do a complete redraw of the window as part of the
 			   completion of the move. This is to remove any